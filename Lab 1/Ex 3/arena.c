@@ -0,0 +1,62 @@
+#include "arena.h"
+
+/*
+ ******************************************************************************
+ *                          Internal Arena Routines
+ ******************************************************************************
+*/
+
+/* Returns a pointer to size bytes at the top of the arena, bumping it. The
+ * top is first advanced to the given alignment.
+*/
+static void *bump (Arena *arena, size_t size, size_t align) {
+    size_t header = (sizeof(ArenaChunk) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    size_t chunkSize = header + ((size > ARENA_CHUNK_SIZE) ? size : ARENA_CHUNK_SIZE);
+    uintptr_t p = ((uintptr_t)arena->top + align - 1) & ~(uintptr_t)(align - 1);
+    ArenaChunk *chunk;
+
+    // Start a new chunk if the current one can't hold the allocation.
+    if (arena->top == NULL || p + size > (uintptr_t)arena->end) {
+        if ((chunk = malloc(chunkSize)) == NULL) {
+            fprintf(stderr, "Error: Couldn't allocate arena chunk!\n");
+            exit(EXIT_FAILURE);
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->top = (char *)chunk + header;
+        arena->end = (char *)chunk + chunkSize;
+        p = (uintptr_t)arena->top;
+    }
+
+    arena->top = (char *)(p + size);
+    arena->used += size;
+    return (void *)p;
+}
+
+/*
+ ******************************************************************************
+ *                               Arena Routines
+ ******************************************************************************
+*/
+
+/* Allocates size bytes (aligned to ARENA_ALIGNMENT) from the arena */
+void *arenaAlloc (Arena *arena, size_t size) {
+    return bump(arena, size, ARENA_ALIGNMENT);
+}
+
+/* Copies a string into the arena (unaligned). Returns the copy */
+char *arenaString (Arena *arena, const char *s) {
+    size_t n = strlen(s) + 1;
+    return memcpy(bump(arena, n, 1), s, n);
+}
+
+/* Free's all memory of the arena, leaving it empty and reusable */
+void freeArena (Arena *arena) {
+    ArenaChunk *chunk = arena->chunks, *next;
+    while (chunk != NULL) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    *arena = (Arena){0};
+}
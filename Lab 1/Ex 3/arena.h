@@ -0,0 +1,55 @@
+#if !defined(ARENA_H)
+#define ARENA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Size of an arena chunk in bytes. Larger allocations get a chunk of their own.
+#define ARENA_CHUNK_SIZE            (1024 * 1024)
+
+// Alignment of arenaAlloc allocations.
+#define ARENA_ALIGNMENT             8
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Arena Chunk: Header of a block of arena memory */
+typedef struct arenaChunk {
+    struct arenaChunk *next;
+} ArenaChunk;
+
+/* Arena: Bump allocator over a list of chunks. Zero-initialize before use */
+typedef struct {
+    ArenaChunk *chunks;
+    char *top, *end;
+    size_t used;
+} Arena;
+
+/*
+ ******************************************************************************
+ *                               Arena Routines
+ ******************************************************************************
+*/
+
+/* Allocates size bytes (aligned to ARENA_ALIGNMENT) from the arena */
+void *arenaAlloc (Arena *arena, size_t size);
+
+/* Copies a string into the arena (unaligned). Returns the copy */
+char *arenaString (Arena *arena, const char *s);
+
+/* Free's all memory of the arena, leaving it empty and reusable */
+void freeArena (Arena *arena);
+
+#endif
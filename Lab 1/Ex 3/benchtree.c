@@ -0,0 +1,415 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+/*
+ ******************************************************************************
+ *                 Synthetic Tree Benchmark (make bench)
+ ******************************************************************************
+*/
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Name of the file recording the shape a tree was generated with.
+#define MANIFEST_NAME               ".benchtree"
+
+// Bytes written per write call.
+#define WRITE_BUFFER_SIZE           (64 * 1024)
+
+// Longest path generated.
+#define MAX_PATH_LENGTH             4096
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Tree Shape: What to generate */
+typedef struct {
+    long files;                     // Number of files.
+    int depth, fanout;              // Levels of subdirectories, and subdirectories per directory.
+    long minSize, maxSize;          // Bounds of the (log-uniform) file size distribution.
+    double duplicates;              // Fraction of files copying an earlier file.
+    double nearDuplicates;          // Fraction of files copying one but for a byte.
+    long nearOffset;                // Offset of that byte (or the last, if beyond it).
+    uint64_t seed;
+} TreeShape;
+
+/* Original: Size and content seed of a file that others may copy */
+typedef struct {
+    long size;
+    uint64_t seed;
+} Original;
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* Random state of the generator */
+static uint64_t randomState;
+
+/* Total files and bytes in the tree being benchmarked */
+static long treeFiles;
+static long long treeBytes;
+
+/*
+ ******************************************************************************
+ *                             Generator Routines
+ ******************************************************************************
+*/
+
+/* Returns the next value of a splitmix64 sequence */
+static uint64_t nextRandom (uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* Returns a uniform random number in [0, 1) */
+static double uniform (void) {
+    return (nextRandom(&randomState) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Returns a file size drawn log-uniformly from [minSize, maxSize] */
+static long drawSize (const TreeShape *shape) {
+    double lo = log(shape->minSize + 1.0), hi = log(shape->maxSize + 1.0);
+    return (long)exp(lo + uniform() * (hi - lo)) - 1;
+}
+
+/* Writes the path of directory i (in breadth-first order) to buffer */
+static void directoryPath (const char *root, int fanout, long i, char *buffer) {
+    char suffix[MAX_PATH_LENGTH] = "";
+    char part[32];
+    while (i > 0) {
+        snprintf(part, sizeof(part), "/d%ld", (i - 1) % fanout);
+        memmove(suffix + strlen(part), suffix, strlen(suffix) + 1);
+        memcpy(suffix, part, strlen(part));
+        i = (i - 1) / fanout;
+    }
+    snprintf(buffer, MAX_PATH_LENGTH, "%s%s", root, suffix);
+}
+
+/* Writes a file of the given size, with content generated from seed. If
+ * flip is nonnegative, the byte at that offset is inverted.
+*/
+static void writeFile (const char *path, long size, uint64_t seed, long flip) {
+    static unsigned char buffer[WRITE_BUFFER_SIZE];
+    uint64_t state = seed, word;
+    long written = 0, n;
+    int fd;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        fprintf(stderr, "Error: Couldn't create %s!\n", path);
+        exit(EXIT_FAILURE);
+    }
+    while (written < size) {
+        n = (size - written < WRITE_BUFFER_SIZE) ? size - written : WRITE_BUFFER_SIZE;
+        for (long i = 0; i < n; i += 8) {
+            word = nextRandom(&state);
+            memcpy(buffer + i, &word, (n - i < 8) ? n - i : 8);
+        }
+        if (flip >= written && flip < written + n) {
+            buffer[flip - written] ^= 0xFF;
+        }
+        if (write(fd, buffer, n) != n) {
+            fprintf(stderr, "Error: Couldn't write %s!\n", path);
+            exit(EXIT_FAILURE);
+        }
+        written += n;
+    }
+    close(fd);
+}
+
+/* Formats a shape as its manifest line */
+static void describeShape (const TreeShape *s, char *buffer, size_t n) {
+    snprintf(buffer, n, "files=%ld depth=%d fanout=%d size=%ld:%ld duplicates=%g near=%g offset=%ld seed=%llu\n",
+        s->files, s->depth, s->fanout, s->minSize, s->maxSize, s->duplicates, s->nearDuplicates,
+        s->nearOffset, (unsigned long long)s->seed);
+}
+
+/* Removes one entry of a tree being deleted */
+static int removeEntry (const char *path, const struct stat *statBuffer, int flag, struct FTW *ftw) {
+    if (remove(path) == -1) {
+        fprintf(stderr, "Error: Couldn't remove %s!\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns nonzero if root holds a tree of this shape. Removes a benchmark
+ * tree of another shape. Exits if root is something else.
+*/
+static int treeExists (const char *root, const TreeShape *shape) {
+    char path[MAX_PATH_LENGTH], expected[512], found[512] = "";
+    FILE *manifest;
+    struct stat statBuffer;
+
+    if (stat(root, &statBuffer) == -1) {
+        return 0;
+    }
+    snprintf(path, sizeof(path), "%s/%s", root, MANIFEST_NAME);
+    if ((manifest = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "Error: %s exists, but isn't a benchmark tree!\n", root);
+        exit(EXIT_FAILURE);
+    }
+    if (fgets(found, sizeof(found), manifest) == NULL) {
+        found[0] = '\0';
+    }
+    fclose(manifest);
+    describeShape(shape, expected, sizeof(expected));
+    if (strcmp(found, expected) == 0) {
+        return 1;
+    }
+    if (nftw(root, removeEntry, 64, FTW_DEPTH | FTW_PHYS) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+/* Generates a tree of the given shape below root.
+ * - Directories form a complete tree of 'depth' levels of 'fanout' each.
+ *   Files are spread uniformly over all of them.
+ * - Content is a pseudorandom stream per original, so copies are regenerated
+ *   rather than read back.
+*/
+static void generateTree (const char *root, const TreeShape *shape) {
+    Original *originals = malloc(shape->files * sizeof(Original));
+    char path[MAX_PATH_LENGTH], manifest[512];
+    long directories = 1, level = 1, originalCount = 0, flip;
+    double u;
+    FILE *file;
+    Original o;
+    assert(originals != NULL);
+
+    // Create the directories, breadth first.
+    for (int d = 0; d < shape->depth; d++) {
+        directories += (level *= shape->fanout);
+    }
+    for (long i = 0; i < directories; i++) {
+        directoryPath(root, shape->fanout, i, path);
+        if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+            fprintf(stderr, "Error: Couldn't create directory %s!\n", path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Each file is an original, a copy of an earlier one, or a near copy.
+    randomState = shape->seed;
+    for (long i = 0; i < shape->files; i++) {
+        u = uniform();
+        flip = -1;
+        if (originalCount > 0 && u < shape->duplicates + shape->nearDuplicates) {
+            o = originals[nextRandom(&randomState) % originalCount];
+            if (u >= shape->duplicates && o.size > 0) {
+                flip = (shape->nearOffset < o.size) ? shape->nearOffset : o.size - 1;
+            }
+        } else {
+            o = (Original){.size = drawSize(shape), .seed = nextRandom(&randomState)};
+            originals[originalCount++] = o;
+        }
+        directoryPath(root, shape->fanout, nextRandom(&randomState) % directories, path);
+        snprintf(path + strlen(path), sizeof(path) - strlen(path), "/f%ld", i);
+        writeFile(path, o.size, o.seed, flip);
+    }
+
+    // Record the shape last, so that an interrupted tree is regenerated.
+    snprintf(path, sizeof(path), "%s/%s", root, MANIFEST_NAME);
+    describeShape(shape, manifest, sizeof(manifest));
+    if ((file = fopen(path, "w")) == NULL || fputs(manifest, file) == EOF || fclose(file) != 0) {
+        fprintf(stderr, "Error: Couldn't write %s!\n", path);
+        exit(EXIT_FAILURE);
+    }
+    free(originals);
+}
+
+/*
+ ******************************************************************************
+ *                             Benchmark Routines
+ ******************************************************************************
+*/
+
+/* Returns monotonic time in seconds */
+static double now (void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Counts one file of the tree, and drops its pages from the page cache */
+static int evictFile (const char *path, const struct stat *statBuffer, int flag, struct FTW *ftw) {
+    int fd;
+    if (flag != FTW_F || strcmp(path + ftw->base, MANIFEST_NAME) == 0) {
+        return 0;
+    }
+    treeFiles++;
+    treeBytes += statBuffer->st_size;
+    if ((fd = open(path, O_RDONLY)) != -1) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    return 0;
+}
+
+/* Counts the tree and evicts its file pages before a cold run. Then all
+ * kernel caches (metadata too) are dropped, if permitted.
+*/
+static void dropCaches (const char *root) {
+    int fd;
+    treeFiles = treeBytes = 0;
+    nftw(root, evictFile, 64, FTW_PHYS);
+    sync();
+    if ((fd = open("/proc/sys/vm/drop_caches", O_WRONLY)) == -1 || write(fd, "3", 1) != 1) {
+        fprintf(stderr, "Can't drop kernel caches (not root?). Evicted file pages only.\n");
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+/* Runs the finder once over root, and prints its time, throughput and peak RSS */
+static void runFinder (const char *label, const char *root, char *finder[], int finderCount) {
+    char **args = malloc((finderCount + 2) * sizeof(char *));
+    struct rusage usage;
+    double start, elapsed;
+    int status, null;
+    pid_t pid;
+    assert(args != NULL);
+
+    memcpy(args, finder, finderCount * sizeof(char *));
+    args[finderCount] = (char *)root;
+    args[finderCount + 1] = NULL;
+
+    start = now();
+    if ((pid = fork()) == 0) {
+        if ((null = open("/dev/null", O_WRONLY)) != -1) {
+            dup2(null, STDOUT_FILENO);
+        }
+        execvp(args[0], args);
+        fprintf(stderr, "Error: Couldn't run %s!\n", args[0]);
+        _exit(127);
+    }
+    if (pid == -1 || wait4(pid, &status, 0, &usage) == -1) {
+        fprintf(stderr, "Error: Couldn't run %s!\n", args[0]);
+        exit(EXIT_FAILURE);
+    }
+    elapsed = now() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Error: %s failed!\n", args[0]);
+        exit(EXIT_FAILURE);
+    }
+    printf("%-6s %9.3f s %11.0f files/s %9.1f MB/s %9ld KB peak RSS\n", label, elapsed,
+        treeFiles / elapsed, treeBytes / elapsed / 1e6, usage.ru_maxrss);
+    free(args);
+}
+
+/*
+ ******************************************************************************
+ *                                   Main
+ ******************************************************************************
+*/
+
+/* Parses a size with an optional K, M or G suffix. Exits if invalid */
+static long parseSize (const char *arg) {
+    char *end;
+    long n = strtol(arg, &end, 10);
+    switch (*end) {
+        case 'K': case 'k': n <<= 10; end++; break;
+        case 'M': case 'm': n <<= 20; end++; break;
+        case 'G': case 'g': n <<= 30; end++; break;
+    }
+    if (end == arg || (*end != '\0' && *end != ':') || n < 0) {
+        fprintf(stderr, "Error: Invalid size \"%s\"!\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    return n;
+}
+
+/* Prints program usage and exits */
+static void usage (const char *program) {
+    fprintf(stderr, "Usage: %s [-n files] [-d depth] [-f fanout] [-s size[:maxsize]] "
+        "[-r duplicates] [-x near-duplicates] [-o offset] [-S seed] [-w warm runs] "
+        "directory [finder [options]]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main (int argc, char *argv[]) {
+    TreeShape shape = {.files = 10000, .depth = 3, .fanout = 8, .minSize = 512,
+        .maxSize = 256 * 1024, .duplicates = 0.3, .nearDuplicates = 0.05,
+        .nearOffset = 4096, .seed = 1};
+    const char *colon, *root;
+    int opt, warmRuns = 3;
+    char label[16];
+    double start;
+
+    // Parse options, up to the tree directory.
+    while ((opt = getopt(argc, argv, "+n:d:f:s:r:x:o:S:w:")) != -1) {
+        switch (opt) {
+            case 'n': shape.files = atol(optarg); break;
+            case 'd': shape.depth = atoi(optarg); break;
+            case 'f': shape.fanout = atoi(optarg); break;
+            case 'r': shape.duplicates = atof(optarg); break;
+            case 'x': shape.nearDuplicates = atof(optarg); break;
+            case 'o': shape.nearOffset = parseSize(optarg); break;
+            case 'S': shape.seed = strtoull(optarg, NULL, 10); break;
+            case 'w': warmRuns = atoi(optarg); break;
+            case 's':
+                shape.minSize = shape.maxSize = parseSize(optarg);
+                if ((colon = strchr(optarg, ':')) != NULL) {
+                    shape.maxSize = parseSize(colon + 1);
+                }
+                break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind == argc || shape.files < 1 || shape.depth < 0 || shape.fanout < 1 ||
+        shape.minSize > shape.maxSize || shape.duplicates < 0 || shape.nearDuplicates < 0 ||
+        shape.duplicates + shape.nearDuplicates > 1 || warmRuns < 0) {
+        usage(argv[0]);
+    }
+    root = argv[optind++];
+
+    // Generate the tree, unless it is there already.
+    if (!treeExists(root, &shape)) {
+        start = now();
+        generateTree(root, &shape);
+        fprintf(stderr, "Generated %s in %.1f s.\n", root, now() - start);
+    }
+    if (optind == argc) {
+        return 0;
+    }
+
+    // One cold run, then warm runs.
+    dropCaches(root);
+    printf("%ld files, %.1f MB: %s", treeFiles, treeBytes / 1e6, argv[optind]);
+    for (int i = optind + 1; i < argc; i++) {
+        printf(" %s", argv[i]);
+    }
+    printf("\n");
+    runFinder("cold", root, argv + optind, argc - optind);
+    for (int i = 0; i < warmRuns; i++) {
+        snprintf(label, sizeof(label), "warm%d", i + 1);
+        runFinder(label, root, argv + optind, argc - optind);
+    }
+    return 0;
+}
@@ -0,0 +1,332 @@
+#define _POSIX_C_SOURCE 200809L
+#include "cache.h"
+#include "stats.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+#define DEFAULT_INDEX_SIZE          1024
+
+// Marks an empty index slot.
+#define EMPTY_SLOT                  UINT32_MAX
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Cache file header */
+typedef struct {
+    char magic[8];
+    uint32_t version, recordSize;
+} CacheHeader;
+
+/* An open cache */
+struct Cache {
+
+    // Cache file descriptor (-1 once writing failed) and its path.
+    int fd;
+    char *path;
+
+    // Mapped records of the file as opened, and their count.
+    const CacheRecord *mapped;
+    uint32_t mappedCount;
+    size_t mappedLength;
+
+    // Records stored since opening, and their count and capacity.
+    CacheRecord *added;
+    uint32_t addedCount, addedCapacity;
+
+    // Index: Open-addressed on inode, holding record numbers. Mapped come first.
+    uint32_t *index;
+    uint32_t indexSize, indexCount;
+
+    // Guards all of the above once open.
+    pthread_mutex_t lock;
+};
+
+/*
+ ******************************************************************************
+ *                          Internal Index Routines
+ ******************************************************************************
+*/
+
+/* Returns the record with given record number */
+static CacheRecord *record (Cache *c, uint32_t n) {
+    return (n < c->mappedCount) ? (CacheRecord *)(c->mapped + n) : c->added + (n - c->mappedCount);
+}
+
+/* Returns the home slot of an inode */
+static uint32_t hashKey (Cache *c, CacheKey key) {
+    uint64_t h = (key.ino ^ (key.dev * 0xC2B2AE3D27D4EB4FULL)) * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(h >> 32) & (c->indexSize - 1);
+}
+
+/* Returns the slot of the inode in the key, or the empty slot it belongs in */
+static uint32_t probeIndex (Cache *c, CacheKey key) {
+    uint32_t i = hashKey(c, key);
+    while (c->index[i] != EMPTY_SLOT && (record(c, c->index[i])->key.ino != key.ino ||
+        record(c, c->index[i])->key.dev != key.dev)) {
+        i = (i + 1) & (c->indexSize - 1);
+    }
+    return i;
+}
+
+/* Indexes a record number, superseding any record of the same inode */
+static void indexRecord (Cache *c, uint32_t n) {
+    uint32_t *old = c->index, oldSize = c->indexSize, i;
+
+    // Rehash at half load.
+    if (2 * (c->indexCount + 1) > c->indexSize) {
+        c->indexSize = (c->indexSize == 0) ? DEFAULT_INDEX_SIZE : c->indexSize * 2;
+        c->index = malloc(c->indexSize * sizeof(uint32_t));
+        assert(c->index != NULL);
+        memset(c->index, 0xFF, c->indexSize * sizeof(uint32_t));
+        for (i = 0; i < oldSize; i++) {
+            if (old[i] != EMPTY_SLOT) {
+                c->index[probeIndex(c, record(c, old[i])->key)] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    i = probeIndex(c, record(c, n)->key);
+    c->indexCount += (c->index[i] == EMPTY_SLOT);
+    c->index[i] = n;
+}
+
+/* Returns nonzero if two keys identify the same file version */
+static int sameKey (CacheKey a, CacheKey b) {
+    return a.dev == b.dev && a.ino == b.ino && a.size == b.size &&
+        a.mtimeSec == b.mtimeSec && a.mtimeNsec == b.mtimeNsec;
+}
+
+/* Returns the latest record of the given file version, or NULL if none */
+static CacheRecord *findRecord (Cache *c, CacheKey key) {
+    uint32_t i;
+    if (c->indexCount == 0 || c->index[i = probeIndex(c, key)] == EMPTY_SLOT) {
+        return NULL;
+    }
+    return sameKey(record(c, c->index[i])->key, key) ? record(c, c->index[i]) : NULL;
+}
+
+/* Writes all of a buffer. Returns -1 on error */
+static int writeAll (int fd, const void *buffer, size_t n) {
+    const char *p = buffer;
+    ssize_t w;
+    while (n > 0) {
+        if ((w = write(fd, p, n)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += w; n -= w;
+    }
+    return 0;
+}
+
+/* Appends fingerprints (as given by flags) for a file version, merged with
+ * the record of it (if any).
+*/
+static void appendRecord (Cache *cache, CacheKey key, int flags, Fingerprint sample, Fingerprint digest) {
+    CacheRecord r = {.key = key}, *known;
+
+    // Merge with what is known of this version already.
+    if ((known = findRecord(cache, key)) != NULL) {
+        r = *known;
+    }
+    if ((r.flags | flags) == r.flags) {
+        return;
+    }
+    if (flags & CACHE_SAMPLE) {
+        r.sample = sample;
+    }
+    if (flags & CACHE_DIGEST) {
+        r.digest = digest;
+    }
+    r.flags |= flags;
+
+    // Append to file and memory. On a write error the cache stops persisting.
+    if (writeAll(cache->fd, &r, sizeof(r)) == -1) {
+        fprintf(stderr, "Error: Couldn't write cache %s! -Ignoring-\n", cache->path);
+        close(cache->fd);
+        cache->fd = -1;
+        return;
+    }
+    if (cache->addedCount == cache->addedCapacity) {
+        cache->addedCapacity = (cache->addedCapacity == 0) ? DEFAULT_INDEX_SIZE : cache->addedCapacity * 2;
+        cache->added = realloc(cache->added, cache->addedCapacity * sizeof(CacheRecord));
+        assert(cache->added != NULL);
+    }
+    cache->added[cache->addedCount++] = r;
+    indexRecord(cache, cache->mappedCount + cache->addedCount - 1);
+}
+
+/* Rewrites the cache file with only the indexed (live) records */
+static void compactCache (Cache *c) {
+    CacheHeader header = {.magic = CACHE_MAGIC, .version = CACHE_VERSION,
+        .recordSize = sizeof(CacheRecord)};
+    char *tempPath = malloc(strlen(c->path) + 5);
+    int fd, ok;
+    assert(tempPath != NULL);
+    sprintf(tempPath, "%s.tmp", c->path);
+
+    // Write to a temporary file, then atomically replace the cache.
+    if ((fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        free(tempPath);
+        return;
+    }
+    ok = (writeAll(fd, &header, sizeof(header)) == 0);
+    for (uint32_t i = 0; ok && i < c->indexSize; i++) {
+        if (c->index[i] != EMPTY_SLOT) {
+            ok = (writeAll(fd, record(c, c->index[i]), sizeof(CacheRecord)) == 0);
+        }
+    }
+    ok = (close(fd) == 0) && ok;
+    if (!ok || rename(tempPath, c->path) == -1) {
+        fprintf(stderr, "Error: Couldn't compact cache %s! -Ignoring-\n", c->path);
+        unlink(tempPath);
+    }
+    free(tempPath);
+}
+
+/*
+ ******************************************************************************
+ *                               Cache Routines
+ ******************************************************************************
+*/
+
+/* Opens (creating if needed) the cache file at path. Returns NULL on error.
+ * - Existing records are memory-mapped and indexed by inode.
+ * - New records are appended to the file as they are stored.
+*/
+Cache *openCache (const char *path) {
+    CacheHeader header = {.magic = CACHE_MAGIC, .version = CACHE_VERSION,
+        .recordSize = sizeof(CacheRecord)};
+    const CacheHeader *found;
+    struct stat statBuffer;
+    Cache *c = calloc(1, sizeof(Cache));
+    void *map;
+    assert(c != NULL && path != NULL);
+
+    if ((c->fd = open(path, O_RDWR | O_CREAT, 0644)) == -1 || fstat(c->fd, &statBuffer) == -1) {
+        goto fail;
+    }
+
+    // A new (or foreign) file is started afresh.
+    if (statBuffer.st_size >= (off_t)sizeof(header)) {
+        if ((map = mmap(NULL, statBuffer.st_size, PROT_READ, MAP_SHARED, c->fd, 0)) == MAP_FAILED) {
+            goto fail;
+        }
+        found = map;
+        if (memcmp(found->magic, CACHE_MAGIC, sizeof(found->magic)) == 0 &&
+            found->version == CACHE_VERSION && found->recordSize == sizeof(CacheRecord)) {
+            c->mapped = (const CacheRecord *)(found + 1);
+            c->mappedCount = (statBuffer.st_size - sizeof(header)) / sizeof(CacheRecord);
+            c->mappedLength = statBuffer.st_size;
+        } else {
+            munmap(map, statBuffer.st_size);
+        }
+    }
+    if (c->mapped == NULL && (ftruncate(c->fd, 0) == -1 ||
+        writeAll(c->fd, &header, sizeof(header)) == -1)) {
+        goto fail;
+    }
+
+    // Drop a torn trailing record, then position for appending.
+    if (ftruncate(c->fd, sizeof(header) + (off_t)c->mappedCount * sizeof(CacheRecord)) == -1 ||
+        lseek(c->fd, 0, SEEK_END) == -1) {
+        goto fail;
+    }
+
+    // Index the records. Later records supersede earlier ones.
+    for (uint32_t i = 0; i < c->mappedCount; i++) {
+        indexRecord(c, i);
+    }
+
+    c->path = malloc(strlen(path) + 1);
+    assert(c->path != NULL);
+    strcpy(c->path, path);
+    pthread_mutex_init(&c->lock, NULL);
+    return c;
+
+fail:
+    fprintf(stderr, "Error: Couldn't open cache %s!\n", path);
+    if (c->fd != -1) {
+        close(c->fd);
+    }
+    if (c->mapped != NULL) {
+        munmap((void *)((const CacheHeader *)c->mapped - 1), c->mappedLength);
+    }
+    free(c->index);
+    free(c);
+    return NULL;
+}
+
+/* Looks up a file version. Returns the flags of fingerprints found (zero if
+ * none), writing them to sample/digest. Thread-safe.
+*/
+int lookupCache (Cache *cache, CacheKey key, Fingerprint *sample, Fingerprint *digest) {
+    CacheRecord *r;
+    int flags = 0;
+    if (cache == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&cache->lock);
+    if (cache->fd != -1) {
+        if ((r = findRecord(cache, key)) == NULL) {
+            countStat(STAT_CACHE_MISSES, 1);
+        } else {
+            countStat(STAT_CACHE_HITS, 1);
+            *sample = r->sample;
+            *digest = r->digest;
+            flags = r->flags;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return flags;
+}
+
+/* Stores fingerprints (as given by flags) for a file version. Thread-safe */
+void storeCache (Cache *cache, CacheKey key, int flags, Fingerprint sample, Fingerprint digest) {
+    if (cache == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    if (cache->fd != -1) {
+        appendRecord(cache, key, flags, sample, digest);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Closes the cache. Compacts the file if most of it is superseded records */
+void closeCache (Cache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    if (cache->fd != -1) {
+        close(cache->fd);
+        if (cache->mappedCount + cache->addedCount > 2 * cache->indexCount) {
+            compactCache(cache);
+        }
+    }
+    if (cache->mapped != NULL) {
+        munmap((void *)((const CacheHeader *)cache->mapped - 1), cache->mappedLength);
+    }
+    free(cache->added);
+    free(cache->index);
+    free(cache->path);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
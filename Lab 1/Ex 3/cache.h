@@ -0,0 +1,74 @@
+#if !defined(CACHE_H)
+#define CACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "fingerprint.h"
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Cache file magic and format version.
+#define CACHE_MAGIC                 "DUPCACHE"
+#define CACHE_VERSION               1
+
+// Record flags: Which fingerprints a record holds.
+#define CACHE_SAMPLE                0x1
+#define CACHE_DIGEST                0x2
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Identifies one version of a file: its inode, size, and modification time */
+typedef struct {
+    uint64_t dev, ino;
+    int64_t size, mtimeSec, mtimeNsec;
+} CacheKey;
+
+/* Cache record as stored on disk */
+typedef struct {
+    CacheKey key;
+    uint32_t flags, reserved;
+    Fingerprint sample, digest;
+} CacheRecord;
+
+/* An open cache file (see cache.c) */
+typedef struct Cache Cache;
+
+/*
+ ******************************************************************************
+ *                               Cache Routines
+ ******************************************************************************
+*/
+
+/* Opens (creating if needed) the cache file at path. Returns NULL on error.
+ * - Existing records are memory-mapped and indexed by inode.
+ * - New records are appended to the file as they are stored.
+*/
+Cache *openCache (const char *path);
+
+/* Looks up a file version. Returns the flags of fingerprints found (zero if
+ * none, or if cache is NULL), writing them to sample/digest. Thread-safe.
+*/
+int lookupCache (Cache *cache, CacheKey key, Fingerprint *sample, Fingerprint *digest);
+
+/* Stores fingerprints (as given by flags) for a file version. A NULL cache
+ * stores nothing. Thread-safe.
+*/
+void storeCache (Cache *cache, CacheKey key, int flags, Fingerprint sample, Fingerprint digest);
+
+/* Closes the cache (if not NULL). Compacts the file if most of it is
+ * superseded records.
+*/
+void closeCache (Cache *cache);
+
+#endif
@@ -0,0 +1,426 @@
+#define _POSIX_C_SOURCE 200809L
+#include "checkpoint.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Checkpoint file header */
+typedef struct {
+    char magic[8];
+    uint32_t version, reserved;
+} CheckpointHeader;
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* Log file descriptor (-1 if not open) and path */
+static int checkpointFd = -1;
+static char *checkpointPath;
+
+/* Records pending for the next checkpoint, and where the open record starts */
+static char *pendingLog;
+static size_t pendingLength, pendingCapacity, recordStart;
+static int recordOpen;
+
+/* Time of the last checkpoint */
+static time_t lastCheckpoint;
+
+/* Resume: Window of the log being replayed, and where it starts */
+static char *window;
+static size_t windowLength, windowCapacity;
+static off_t windowOffset;
+
+/* Resume: Set of completed directory paths (open-addressed) */
+static char **completed;
+static size_t completedSize, completedCount;
+
+/*
+ ******************************************************************************
+ *                           Internal Log Routines
+ ******************************************************************************
+*/
+
+/* Writes all n bytes of buffer to fd. Returns -1 on error */
+static int writeAll (int fd, const void *buffer, size_t n) {
+    const char *p = buffer;
+    ssize_t w;
+    while (n > 0) {
+        if ((w = write(fd, p, n)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += w; n -= w;
+    }
+    return 0;
+}
+
+/* Appends n bytes to the pending log */
+static void append (const void *data, size_t n) {
+    if (pendingLength + n > pendingCapacity) {
+        while (pendingLength + n > pendingCapacity) {
+            pendingCapacity = (pendingCapacity == 0) ? 64 * 1024 : pendingCapacity * 2;
+        }
+        pendingLog = realloc(pendingLog, pendingCapacity);
+        assert(pendingLog != NULL);
+    }
+    memcpy(pendingLog + pendingLength, data, n);
+    pendingLength += n;
+}
+
+/* Appends a record with an empty payload */
+static void appendRecord (uint32_t type) {
+    RecordHeader header = {.type = type, .length = 0, .check = fingerprint("", 0)};
+    append(&header, sizeof(header));
+}
+
+/* Writes the completed pending records out and syncs them. Exits on error,
+ * since later checkpoints would be lost too.
+*/
+static void checkpoint (void) {
+    size_t n = recordOpen ? recordStart : pendingLength;
+    if (n > 0 && (writeAll(checkpointFd, pendingLog, n) == -1 || fdatasync(checkpointFd) == -1)) {
+        fprintf(stderr, "Error: Can't write checkpoint %s!\n", checkpointPath);
+        exit(EXIT_FAILURE);
+    }
+    memmove(pendingLog, pendingLog + n, pendingLength - n);
+    pendingLength -= n;
+    recordStart = 0;
+    lastCheckpoint = time(NULL);
+}
+
+/* Returns the log bytes [off, off + n), refilling the replay window from off
+ * (growing it for a larger record) unless it holds them. Returns NULL if they
+ * can't be read.
+*/
+static const char *readWindow (off_t off, size_t n) {
+    ssize_t r;
+    if (off >= windowOffset && off + (off_t)n <= windowOffset + (off_t)windowLength) {
+        return window + (off - windowOffset);
+    }
+    if (n > windowCapacity || window == NULL) {
+        windowCapacity = (n > CHECKPOINT_BUFFER_SIZE) ? n : CHECKPOINT_BUFFER_SIZE;
+        free(window);
+        window = malloc(windowCapacity);
+        assert(window != NULL);
+    }
+    windowOffset = off;
+    windowLength = 0;
+    while (windowLength < windowCapacity) {
+        if ((r = pread(checkpointFd, window + windowLength, windowCapacity - windowLength,
+            off + windowLength)) == -1 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            break;
+        }
+        windowLength += r;
+    }
+    return (windowLength >= n) ? window : NULL;
+}
+
+/* Reads the record at off, of a log of given size. Returns its payload (valid
+ * until the next read), or NULL if the record is torn.
+*/
+static const char *readRecord (off_t off, off_t size, RecordHeader *record) {
+    const char *p;
+    if (off + (off_t)sizeof(*record) > size || (p = readWindow(off, sizeof(*record))) == NULL) {
+        return NULL;
+    }
+    memcpy(record, p, sizeof(*record));
+    off += sizeof(*record);
+    if (record->length > size - off || (p = readWindow(off, record->length)) == NULL ||
+        compareFingerprints(fingerprint(p, record->length), record->check) != 0) {
+        return NULL;
+    }
+    return p;
+}
+
+/* Returns the home slot of a path in the completed set */
+static size_t hashPath (const char *path) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (; *path != '\0'; path++) {
+        h = (h ^ (unsigned char)*path) * 0x100000001B3ULL;
+    }
+    return (size_t)(h >> 32) & (completedSize - 1);
+}
+
+/* Returns the slot of a path in the completed set, or the empty slot it belongs in */
+static size_t probeCompleted (const char *path) {
+    size_t i = hashPath(path);
+    while (completed[i] != NULL && strcmp(completed[i], path) != 0) {
+        i = (i + 1) & (completedSize - 1);
+    }
+    return i;
+}
+
+/* Adds a path (which the set takes ownership of) to the completed set */
+static void addCompleted (char *path) {
+    char **old = completed;
+    size_t oldSize = completedSize, i;
+
+    if (2 * (completedCount + 1) > completedSize) {
+        completedSize = (completedSize == 0) ? 64 : completedSize * 2;
+        completed = calloc(completedSize, sizeof(char *));
+        assert(completed != NULL);
+        for (i = 0; i < oldSize; i++) {
+            if (old[i] != NULL) {
+                completed[probeCompleted(old[i])] = old[i];
+            }
+        }
+        free(old);
+    }
+    if (completed[i = probeCompleted(path)] == NULL) {
+        completed[i] = path;
+        completedCount++;
+    } else {
+        free(path);
+    }
+}
+
+/* Returns a malloc'd copy of "dir/name" */
+static char *joinPath (const char *dir, const char *name) {
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    assert(path != NULL);
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+/* Returns the length of the string at p (within end), or -1 if unterminated */
+static ssize_t boundedLength (const char *p, const char *end) {
+    const char *nul = memchr(p, '\0', end - p);
+    return (nul == NULL) ? -1 : nul - p;
+}
+
+/* Replays a directory record: Applies 'f' to its files, and gathers its
+ * subdirectories. Returns -1 if the record is malformed.
+*/
+static int replayDirectory (const char *p, const char *end,
+    void (*f)(const char *path, const struct stat *statBuffer), char ***found_p, size_t *count_p,
+    size_t *capacity_p) {
+    const char *dir = p;
+    struct stat statBuffer;
+    ssize_t n;
+    FileItem item;
+    char *path;
+
+    if ((n = boundedLength(p, end)) == -1) {
+        return -1;
+    }
+    for (p += n + 1; p < end; p += n + 1) {
+        if (*p == ITEM_FILE && end - p > (ssize_t)sizeof(item) &&
+            (n = boundedLength(p + 1 + sizeof(item), end)) != -1) {
+            memcpy(&item, p + 1, sizeof(item));
+            memset(&statBuffer, 0, sizeof(statBuffer));
+            statBuffer.st_mode = S_IFREG;
+            statBuffer.st_size = item.size;
+            statBuffer.st_dev = item.dev;
+            statBuffer.st_ino = item.ino;
+            statBuffer.st_mtim.tv_sec = item.mtimeSec;
+            statBuffer.st_mtim.tv_nsec = item.mtimeNsec;
+            path = joinPath(dir, p + 1 + sizeof(item));
+            f(path, &statBuffer);
+            free(path);
+            p += 1 + sizeof(item);
+        } else if (*p == ITEM_SUBDIRECTORY && (n = boundedLength(p + 1, end)) != -1) {
+            if (*count_p == *capacity_p) {
+                *capacity_p = (*capacity_p == 0) ? 64 : *capacity_p * 2;
+                *found_p = realloc(*found_p, *capacity_p * sizeof(char *));
+                assert(*found_p != NULL);
+            }
+            (*found_p)[(*count_p)++] = joinPath(dir, p + 1);
+            p += 1;
+        } else {
+            return -1;
+        }
+    }
+
+    path = malloc(strlen(dir) + 1);
+    assert(path != NULL);
+    addCompleted(strcpy(path, dir));
+    return 0;
+}
+
+/*
+ ******************************************************************************
+ *                             Checkpoint Routines
+ ******************************************************************************
+*/
+
+/* Opens (creating if needed) the checkpoint log at path. Returns -1 on error */
+int openCheckpoint (const char *path) {
+    assert(checkpointFd == -1 && path != NULL);
+    if ((checkpointFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+        fprintf(stderr, "Error: Couldn't open checkpoint %s!\n", path);
+        return -1;
+    }
+    checkpointPath = malloc(strlen(path) + 1);
+    assert(checkpointPath != NULL);
+    strcpy(checkpointPath, path);
+    lastCheckpoint = time(NULL);
+    return 0;
+}
+
+/* Replays the log of an earlier scan of root. Returns nonzero if the scan
+ * was already complete.
+*/
+int resumeCheckpoint (const char *root, void (*f)(const char *path, const struct stat *statBuffer),
+    void (*pending)(const char *path)) {
+    CheckpointHeader header = {.magic = CHECKPOINT_MAGIC, .version = CHECKPOINT_VERSION};
+    char **found = NULL, *rootPayload;
+    const char *p;
+    size_t foundCount = 0, foundCapacity = 0, rootLength = sizeof(RootItem) + strlen(root) + 1;
+    off_t size = lseek(checkpointFd, 0, SEEK_END), valid = 0, off;
+    RecordHeader record, rootRecord = {.type = RECORD_ROOT, .length = rootLength};
+    RootItem rootItem = {0, 0};
+    struct stat statBuffer;
+    int done = 0;
+
+    // The root record: The root's identity and path.
+    if (stat(root, &statBuffer) == 0) {
+        rootItem.dev = statBuffer.st_dev;
+        rootItem.ino = statBuffer.st_ino;
+    }
+    rootPayload = malloc(rootLength);
+    assert(rootPayload != NULL);
+    memcpy(rootPayload, &rootItem, sizeof(rootItem));
+    strcpy(rootPayload + sizeof(rootItem), root);
+    rootRecord.check = fingerprint(rootPayload, rootLength);
+
+    // A foreign or empty file, or the log of another root, starts afresh.
+    if (size >= (off_t)sizeof(header) && (p = readWindow(0, sizeof(header))) != NULL &&
+        memcmp(p, &header, sizeof(header)) == 0 &&
+        (p = readRecord(sizeof(header), size, &record)) != NULL) {
+        if (record.type == RECORD_ROOT && record.length == rootLength &&
+            memcmp(p, rootPayload, rootLength) == 0) {
+            valid = sizeof(header) + sizeof(record) + rootLength;
+        } else {
+            fprintf(stderr, "Error: Checkpoint %s is of another scan! -Starting afresh-\n", checkpointPath);
+        }
+    }
+
+    // Replay the intact records. Replay stops at the first torn one.
+    for (off = valid; valid > 0 && (p = readRecord(off, size, &record)) != NULL; off = valid) {
+        if (record.type == RECORD_DIRECTORY &&
+            replayDirectory(p, p + record.length, f, &found, &foundCount, &foundCapacity) == -1) {
+            break;
+        }
+        done |= (record.type == RECORD_SCAN_DONE);
+        valid = off + sizeof(record) + record.length;
+    }
+    free(window);
+    window = NULL;
+    windowLength = windowCapacity = 0;
+    windowOffset = 0;
+
+    // Drop the torn tail (or everything), and continue the log after it.
+    if (ftruncate(checkpointFd, valid) == -1 || lseek(checkpointFd, valid, SEEK_SET) == -1 ||
+        (valid == 0 && (writeAll(checkpointFd, &header, sizeof(header)) == -1 ||
+        writeAll(checkpointFd, &rootRecord, sizeof(rootRecord)) == -1 ||
+        writeAll(checkpointFd, rootPayload, rootLength) == -1))) {
+        fprintf(stderr, "Error: Can't write checkpoint %s!\n", checkpointPath);
+        exit(EXIT_FAILURE);
+    }
+
+    // The frontier: Directories found but not completed.
+    if (completedCount == 0) {
+        pending(root);
+    }
+    for (size_t i = 0; i < foundCount; i++) {
+        if (!done && completed[probeCompleted(found[i])] == NULL) {
+            pending(found[i]);
+        }
+        free(found[i]);
+    }
+    free(found);
+    free(rootPayload);
+    for (size_t i = 0; i < completedSize; i++) {
+        free(completed[i]);
+    }
+    free(completed);
+    completed = NULL;
+    completedSize = completedCount = 0;
+    return done;
+}
+
+/* Starts the record of a directory being scanned */
+void beginDirectory (const char *path) {
+    RecordHeader header = {.type = RECORD_DIRECTORY};
+    recordStart = pendingLength;
+    recordOpen = 1;
+    append(&header, sizeof(header));
+    append(path, strlen(path) + 1);
+}
+
+/* Adds a regular file to the record of the directory being scanned */
+void logFile (const char *name, const struct stat *statBuffer) {
+    char tag = ITEM_FILE;
+    FileItem item = {
+        .size = statBuffer->st_size,
+        .dev = statBuffer->st_dev,
+        .ino = statBuffer->st_ino,
+        .mtimeSec = statBuffer->st_mtim.tv_sec,
+        .mtimeNsec = statBuffer->st_mtim.tv_nsec
+    };
+    append(&tag, 1);
+    append(&item, sizeof(item));
+    append(name, strlen(name) + 1);
+}
+
+/* Adds a subdirectory to the record of the directory being scanned */
+void logSubdirectory (const char *name) {
+    char tag = ITEM_SUBDIRECTORY;
+    append(&tag, 1);
+    append(name, strlen(name) + 1);
+}
+
+/* Completes the record of the directory being scanned. Checkpoints if due */
+void endDirectory (void) {
+    RecordHeader header;
+    memcpy(&header, pendingLog + recordStart, sizeof(header));
+    header.length = pendingLength - recordStart - sizeof(header);
+    header.check = fingerprint(pendingLog + recordStart + sizeof(header), header.length);
+    memcpy(pendingLog + recordStart, &header, sizeof(header));
+    recordOpen = 0;
+
+    if (pendingLength >= CHECKPOINT_BUFFER_SIZE || time(NULL) - lastCheckpoint >= CHECKPOINT_INTERVAL) {
+        checkpoint();
+    }
+}
+
+/* Records the end of the scan, and checkpoints */
+void endScan (void) {
+    appendRecord(RECORD_SCAN_DONE);
+    checkpoint();
+}
+
+/* Checkpoints what is pending and closes the log. Removes it if 'discard' */
+void closeCheckpoint (int discard) {
+    if (checkpointFd == -1) {
+        return;
+    }
+    if (discard) {
+        unlink(checkpointPath);
+    } else {
+        checkpoint();
+    }
+    close(checkpointFd);
+    free(checkpointPath);
+    free(pendingLog);
+    checkpointFd = -1;
+    checkpointPath = NULL;
+    pendingLog = NULL;
+    pendingLength = pendingCapacity = 0;
+    recordOpen = 0;
+}
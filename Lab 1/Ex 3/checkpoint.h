@@ -0,0 +1,109 @@
+#if !defined(CHECKPOINT_H)
+#define CHECKPOINT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "fingerprint.h"
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Checkpoint file magic and format version.
+#define CHECKPOINT_MAGIC            "DUPCHKPT"
+#define CHECKPOINT_VERSION          2
+
+// Seconds between checkpoints, and pending bytes that force one sooner.
+// Logs are also replayed through a window of that size.
+#define CHECKPOINT_INTERVAL         10
+#define CHECKPOINT_BUFFER_SIZE      (4 * 1024 * 1024)
+
+// Record types.
+#define RECORD_DIRECTORY            1   // A completely scanned directory.
+#define RECORD_SCAN_DONE            2   // The end of the scan.
+#define RECORD_ROOT                 3   // The root scanned (the first record).
+
+// Directory record item tags.
+#define ITEM_FILE                   'F'
+#define ITEM_SUBDIRECTORY           'D'
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Record Header: Type and length of the payload that follows, and its
+ * fingerprint (so that a torn record is recognized).
+*/
+typedef struct {
+    uint32_t type, length;
+    Fingerprint check;
+} RecordHeader;
+
+/* File Item: The stat fields of a regular file, followed by its name.
+ * A directory record holds its path, then tagged file and subdirectory items.
+*/
+typedef struct {
+    int64_t size;
+    uint64_t dev, ino;
+    int64_t mtimeSec, mtimeNsec;
+} FileItem;
+
+/* Root Item: The identity of the scanned root, followed by its path as given.
+ * A root record holds just that.
+*/
+typedef struct {
+    uint64_t dev, ino;
+} RootItem;
+
+/*
+ ******************************************************************************
+ *                             Checkpoint Routines
+ ******************************************************************************
+*/
+
+/* Opens (creating if needed) the checkpoint log at path. Returns -1 on error.
+ * - The log is append-only. Each checkpoint writes only what completed since
+ *   the last one.
+ * - A torn trailing record is dropped.
+*/
+int openCheckpoint (const char *path);
+
+/* Replays the log of an earlier scan of root.
+ * - 'f' is applied to every file of every completed directory (by full path),
+ *   with the metadata logged for it. The file may have changed since.
+ * - 'pending' is applied to every directory found but not yet completed: the
+ *   frontier. For a new log, that is root.
+ * - A log of another root (by path or identity) is started afresh.
+ * - Returns nonzero if the scan was already complete.
+*/
+int resumeCheckpoint (const char *root, void (*f)(const char *path, const struct stat *statBuffer),
+    void (*pending)(const char *path));
+
+/* Starts the record of a directory being scanned */
+void beginDirectory (const char *path);
+
+/* Adds a regular file to the record of the directory being scanned */
+void logFile (const char *name, const struct stat *statBuffer);
+
+/* Adds a subdirectory to the record of the directory being scanned */
+void logSubdirectory (const char *name);
+
+/* Completes the record of the directory being scanned. Checkpoints if due */
+void endDirectory (void);
+
+/* Records the end of the scan, and checkpoints */
+void endScan (void);
+
+/* Checkpoints what is pending and closes the log. Removes it if 'discard' */
+void closeCheckpoint (int discard);
+
+#endif
@@ -0,0 +1,159 @@
+#define _POSIX_C_SOURCE 200809L
+#include "chunk.h"
+#include "compare.h"
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* Gear table: A random 64-bit value per byte */
+static uint64_t gear[256];
+
+/* Chunk size bounds, and the cut masks below and above the average */
+static size_t minChunk, averageChunk = DEFAULT_CHUNK_SIZE, maxChunk;
+static uint64_t smallMask, largeMask;
+
+/* Read buffer: Holds at least a block beyond the largest chunk */
+static unsigned char *chunkBuffer;
+static size_t chunkBufferSize;
+
+/*
+ ******************************************************************************
+ *                         Internal Chunking Routines
+ ******************************************************************************
+*/
+
+/* Returns a mask of the top n bits. The gear hash shifts left, so its top
+ * bits depend on the most (up to 64) recent bytes.
+*/
+static uint64_t topBits (int n) {
+    return ~(uint64_t)0 << (64 - n);
+}
+
+/* Fills the gear table and masks for the average chunk size, if not yet */
+static void initChunker (void) {
+    uint64_t state = 0x243F6A8885A308D3ULL, z;
+    int bits = 0;
+    if (maxChunk != 0) {
+        return;
+    }
+    for (int i = 0; i < 256; i++) {
+        z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    while (((size_t)1 << (bits + 1)) <= averageChunk) {
+        bits++;
+    }
+    minChunk = averageChunk / CHUNK_MIN_DIVISOR;
+    maxChunk = averageChunk * CHUNK_MAX_FACTOR;
+    smallMask = topBits(bits + CHUNK_NORMALIZATION);
+    largeMask = topBits(bits - CHUNK_NORMALIZATION);
+}
+
+/* Returns the length of the chunk starting at data (of n bytes available) */
+static size_t cutPoint (const unsigned char *data, size_t n) {
+    size_t i = minChunk, normal = averageChunk;
+    uint64_t h = 0;
+    if (n <= minChunk) {
+        return n;
+    }
+    n = (n > maxChunk) ? maxChunk : n;
+    normal = (n < normal) ? n : normal;
+
+    // Bytes below the minimum are skipped. Cuts are rarer before the average.
+    for (; i < normal; i++) {
+        h = (h << 1) + gear[data[i]];
+        if ((h & smallMask) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < n; i++) {
+        h = (h << 1) + gear[data[i]];
+        if ((h & largeMask) == 0) {
+            return i + 1;
+        }
+    }
+    return n;
+}
+
+/* Allocates the chunking buffer, if not yet */
+static void initChunkBuffer (void) {
+    size_t size = maxChunk + getBlockSize();
+    if (chunkBuffer != NULL && chunkBufferSize >= size) {
+        return;
+    }
+    free(chunkBuffer);
+    if (posix_memalign((void **)&chunkBuffer, BLOCK_ALIGNMENT, size) != 0) {
+        fprintf(stderr, "Error: Couldn't allocate chunk buffer!\n");
+        exit(EXIT_FAILURE);
+    }
+    chunkBufferSize = size;
+}
+
+/*
+ ******************************************************************************
+ *                              Chunking Routines
+ ******************************************************************************
+*/
+
+/* Sets the average chunk size. Returns -1 if out of bounds */
+int setChunkSize (size_t average) {
+    size_t size = MIN_CHUNK_SIZE;
+    if (average < MIN_CHUNK_SIZE || average > MAX_CHUNK_SIZE) {
+        return -1;
+    }
+    while (2 * size <= average) {
+        size *= 2;
+    }
+    averageChunk = size;
+    maxChunk = 0;
+    return 0;
+}
+
+/* Returns the average chunk size */
+size_t getChunkSize (void) {
+    return averageChunk;
+}
+
+/* Splits a file into content-defined chunks, and applies 'f' to the
+ * fingerprint and length of each in turn. Returns -1 on a read error.
+*/
+int chunkFile (int fd, void (*f)(Fingerprint chunk, uint32_t length, void *arg), void *arg) {
+    SparseCursor cursor;
+    size_t held = 0, start, n;
+    ssize_t r = 1;
+
+    initChunker();
+    initChunkBuffer();
+    if (openCursor(&cursor, fd) == -1) {
+        return -1;
+    }
+
+    // Keep the buffer topped up past the largest chunk, and cut what is held.
+    while (r > 0 || held > 0) {
+        while (r > 0 && held < maxChunk) {
+            if ((r = readSparse(&cursor, chunkBuffer + held, getBlockSize())) == -1) {
+                return -1;
+            }
+            held += r;
+        }
+        for (start = 0; held - start >= maxChunk || (r == 0 && start < held); start += n) {
+            n = cutPoint(chunkBuffer + start, held - start);
+            f(fingerprint(chunkBuffer + start, n), n, arg);
+        }
+        memmove(chunkBuffer, chunkBuffer + start, held - start);
+        held -= start;
+    }
+    return 0;
+}
+
+/* Frees the chunking buffer */
+void freeChunkBuffer (void) {
+    free(chunkBuffer);
+    chunkBuffer = NULL;
+    chunkBufferSize = 0;
+}
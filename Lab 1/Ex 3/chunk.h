@@ -0,0 +1,54 @@
+#if !defined(CHUNK_H)
+#define CHUNK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "fingerprint.h"
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Average chunk size: default and bounds (rounded down to a power of two).
+#define DEFAULT_CHUNK_SIZE          (8 * 1024)
+#define MIN_CHUNK_SIZE              256
+#define MAX_CHUNK_SIZE              (1024 * 1024)
+
+// Chunks are at least a quarter, and at most eight times, the average.
+#define CHUNK_MIN_DIVISOR           4
+#define CHUNK_MAX_FACTOR            8
+
+// Bits by which the cut condition is harder below the average (and easier
+// above it), to narrow the chunk size distribution.
+#define CHUNK_NORMALIZATION         2
+
+/*
+ ******************************************************************************
+ *                              Chunking Routines
+ ******************************************************************************
+*/
+
+/* Sets the average chunk size. Returns -1 if out of bounds */
+int setChunkSize (size_t average);
+
+/* Returns the average chunk size */
+size_t getChunkSize (void);
+
+/* Splits a file into content-defined chunks (FastCDC: a gear rolling hash,
+ * with normalized chunking), and applies 'f' to the fingerprint and length of
+ * each in turn.
+ * - Cut points depend only on nearby content, so regions shared by files of
+ *   any size (or at any offset) yield the same chunks.
+ * - Returns -1 on a read error.
+*/
+int chunkFile (int fd, void (*f)(Fingerprint chunk, uint32_t length, void *arg), void *arg);
+
+/* Frees the chunking buffer */
+void freeChunkBuffer (void);
+
+#endif
@@ -0,0 +1,487 @@
+#define _GNU_SOURCE
+#include "compare.h"
+#include "stats.h"
+#include "throttle.h"
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* Comparison block size in bytes */
+static size_t blockSize = DEFAULT_BLOCK_SIZE;
+
+/* Page cache policy for reads */
+static int ioPolicy = IO_CACHED;
+
+/* Aligned comparison buffers (one per file) */
+static unsigned char *buffer1, *buffer2;
+
+/* Zeros that holes are compared against */
+static unsigned char zeroBlock[MAX_BLOCK_SIZE];
+
+/* Partition state shared with the member comparator (qsort has no context) */
+static unsigned char *partitionBlocks;
+static size_t partitionBlockSize;
+static ssize_t *partitionLengths;
+
+/*
+ ******************************************************************************
+ *                          Internal Buffer Routines
+ ******************************************************************************
+*/
+
+/* Allocates the comparison buffers if they don't exist yet */
+static void initCompareBuffers (void) {
+    if (buffer1 != NULL) {
+        return;
+    }
+    if (posix_memalign((void **)&buffer1, BLOCK_ALIGNMENT, blockSize) != 0 ||
+        posix_memalign((void **)&buffer2, BLOCK_ALIGNMENT, blockSize) != 0) {
+        fprintf(stderr, "Error: Couldn't allocate comparison buffers!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ ******************************************************************************
+ *                             Comparison Routines
+ ******************************************************************************
+*/
+
+/* Sets the block size used by diff. Clamped to range, rounded to alignment */
+void setBlockSize (size_t size) {
+    size = (size < MIN_BLOCK_SIZE) ? MIN_BLOCK_SIZE : size;
+    size = (size > MAX_BLOCK_SIZE) ? MAX_BLOCK_SIZE : size;
+    size = (size + BLOCK_ALIGNMENT - 1) & ~((size_t)BLOCK_ALIGNMENT - 1);
+
+    // Buffers are sized on first use, so drop any existing ones.
+    freeCompareBuffers();
+    blockSize = size;
+}
+
+/* Returns the block size used by diff */
+size_t getBlockSize (void) {
+    return blockSize;
+}
+
+/* Returns the index of the first differing byte in a and b, or n if equal */
+size_t mismatch (const void *a, const void *b, size_t n) {
+    const unsigned char *p = a, *q = b;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    // Compare 64 bytes per iteration, locating the byte only on a mismatch.
+    for (; i + 64 <= n; i += 64) {
+        __m128i e0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)),
+                                    _mm_loadu_si128((const __m128i *)(q + i)));
+        __m128i e1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 16)),
+                                    _mm_loadu_si128((const __m128i *)(q + i + 16)));
+        __m128i e2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 32)),
+                                    _mm_loadu_si128((const __m128i *)(q + i + 32)));
+        __m128i e3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 48)),
+                                    _mm_loadu_si128((const __m128i *)(q + i + 48)));
+        __m128i all = _mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3));
+        if (_mm_movemask_epi8(all) != 0xFFFF) {
+            break;
+        }
+    }
+    for (; i + 16 <= n; i += 16) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)),
+                                    _mm_loadu_si128((const __m128i *)(q + i)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(eq) ^ 0xFFFFu;
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#else
+    // Compare a word at a time, falling through to bytes on a mismatch.
+    for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+        uint64_t x, y;
+        memcpy(&x, p + i, sizeof(x));
+        memcpy(&y, q + i, sizeof(y));
+        if (x != y) {
+            break;
+        }
+    }
+#endif
+
+    // Compare any remaining tail byte-wise.
+    for (; i < n; i++) {
+        if (p[i] != q[i]) {
+            return i;
+        }
+    }
+    return n;
+}
+
+/*
+ ******************************************************************************
+ *                              I/O Policy Routines
+ ******************************************************************************
+*/
+
+/* Sets the page cache policy (IO_CACHED, IO_DROP, or IO_DIRECT) for reads */
+void setIoPolicy (int policy) {
+    ioPolicy = policy;
+}
+
+/* Returns the page cache policy for reads */
+int getIoPolicy (void) {
+    return ioPolicy;
+}
+
+/* Advises the kernel of how a freshly opened file will be read */
+void adviseOpen (int fd) {
+    if (ioPolicy != IO_CACHED) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+    }
+}
+
+/* Drops a consumed range of a file from the page cache (if the policy says
+ * so). A length of zero extends to the end of the file.
+*/
+void adviseConsumed (int fd, off_t offset, off_t length) {
+    if (ioPolicy != IO_CACHED) {
+        posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+    }
+}
+
+/* Switches an open file to direct I/O if the policy is IO_DIRECT. Reads fall
+ * back to the page cache where direct I/O is refused.
+*/
+void adviseDirect (int fd) {
+    int flags;
+    if (ioPolicy == IO_DIRECT && (flags = fcntl(fd, F_GETFL)) != -1) {
+        fcntl(fd, F_SETFL, flags | O_DIRECT);
+    }
+}
+
+/* Leaves direct I/O on a cursor's file, for reads it can't align */
+static void leaveDirect (SparseCursor *c) {
+    int flags;
+    if ((flags = fcntl(c->fd, F_GETFL)) != -1) {
+        fcntl(c->fd, F_SETFL, flags & ~O_DIRECT);
+    }
+    c->direct = 0;
+}
+
+/*
+ ******************************************************************************
+ *                            Sparse Read Routines
+ ******************************************************************************
+*/
+
+/* Places a cursor at the current offset of an open file. Returns -1 on error */
+int openCursor (SparseCursor *c, int fd) {
+    struct stat statBuffer;
+    int flags;
+    if (fstat(fd, &statBuffer) == -1 || (c->offset = lseek(fd, 0, SEEK_CUR)) == -1 ||
+        (flags = fcntl(fd, F_GETFL)) == -1) {
+        return -1;
+    }
+    c->fd = fd;
+    c->size = statBuffer.st_size;
+    c->regionEnd = c->offset;
+    c->hole = 0;
+    c->direct = (flags & O_DIRECT) != 0;
+    return 0;
+}
+
+/* Returns the bytes (at most n) from the cursor to the end of its region,
+ * or zero at end of file. Sets hole_p if the region is a hole.
+*/
+size_t regionSpan (SparseCursor *c, size_t n, int *hole_p) {
+    off_t data, hole;
+    if (c->offset >= c->size) {
+        *hole_p = 0;
+        return 0;
+    }
+
+    // Locate the region anew once the cursor leaves it. Without support for
+    // seeking holes, the rest of the file is taken to be data.
+    if (c->offset >= c->regionEnd) {
+        if ((data = lseek(c->fd, c->offset, SEEK_DATA)) == -1) {
+            data = (errno == ENXIO) ? c->size : c->offset;
+        }
+        if (data > c->offset) {
+            c->hole = 1;
+            c->regionEnd = data;
+        } else {
+            hole = lseek(c->fd, c->offset, SEEK_HOLE);
+            c->hole = 0;
+            c->regionEnd = (hole == -1 || hole <= c->offset) ? c->size : hole;
+        }
+        c->regionEnd = (c->regionEnd > c->size) ? c->size : c->regionEnd;
+    }
+
+    *hole_p = c->hole;
+    return ((off_t)n < c->regionEnd - c->offset) ? n : (size_t)(c->regionEnd - c->offset);
+}
+
+/* Reads exactly n bytes at the cursor's offset (within its region) and
+ * advances it. Holes are skipped, leaving the buffer untouched. Consumed data
+ * is dropped from the page cache as the policy says. Returns -1 on error or a
+ * short read.
+*/
+static int readSpan (SparseCursor *c, void *buffer, size_t n) {
+    size_t total = 0, want, mask = BLOCK_ALIGNMENT - 1;
+    uint64_t t, u;
+    ssize_t r;
+    while (!c->hole && total < n) {
+        want = n - total;
+
+        // Direct reads must be aligned. Only the last may overrun (into EOF).
+        if (c->direct) {
+            if (c->offset + (off_t)n == c->size) {
+                want = (want + mask) & ~mask;
+            }
+            if ((((uintptr_t)buffer + total) | (c->offset + total) | want) & mask) {
+                leaveDirect(c);
+                want = n - total;
+            }
+        }
+        u = throttleRead(want);
+        t = startTimer();
+        r = pread(c->fd, (char *)buffer + total, want, c->offset + total);
+        stopTimer(HIST_READ, t);
+        throttleDone(u);
+        if (r == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL && c->direct) {
+                leaveDirect(c);
+                continue;
+            }
+            return -1;
+        }
+        if (r == 0) {
+            return -1;
+        }
+        countStat(STAT_BYTES_READ, r);
+        total += r;
+    }
+    if (!c->hole && !c->direct) {
+        adviseConsumed(c->fd, c->offset, n);
+    }
+    c->offset += n;
+    return 0;
+}
+
+/* Reads up to n bytes at the cursor and advances it. Holes are filled with
+ * zeros rather than read. Returns the bytes read (zero at end of file), or -1
+ * on error.
+*/
+ssize_t readSparse (SparseCursor *c, void *buffer, size_t n) {
+    size_t total = 0, span;
+    int hole;
+    while (total < n && (span = regionSpan(c, n - total, &hole)) > 0) {
+        if (readSpan(c, (char *)buffer + total, span) == -1) {
+            return -1;
+        }
+        if (hole) {
+            memset((char *)buffer + total, 0, span);
+        }
+        total += span;
+    }
+    return total;
+}
+
+/* Returns nonzero if an open file has holes (fewer blocks than its size) */
+int sparseFile (int fd) {
+    struct stat statBuffer;
+    return fstat(fd, &statBuffer) == 0 && (off_t)statBuffer.st_blocks * 512 < statBuffer.st_size;
+}
+
+/*
+ ******************************************************************************
+ *                          File Comparison Routines
+ ******************************************************************************
+*/
+
+/* Returns nonzero if a difference exists between two given files.
+ * - Files are compared block-wise from their current offsets.
+ * - Holes are not read. Holes in both files are skipped, and a hole facing
+ *   data only checks the data for zeros.
+ * - If offset_p is not NULL, the offset of the first difference is written.
+ * - A read error counts as a difference at the offset it occurred.
+*/
+int diff (int fd1, int fd2, off_t *offset_p) {
+    SparseCursor c1, c2;
+    off_t start;
+    size_t n, m;
+    int hole1, hole2, differ = 1;
+    uint64_t t = startTimer();
+
+    initCompareBuffers();
+    if (openCursor(&c1, fd1) == -1 || openCursor(&c2, fd2) == -1) {
+        if (offset_p != NULL) {
+            *offset_p = 0;
+        }
+        return 1;
+    }
+    start = c1.offset;
+
+    do {
+        // Step to the nearest region boundary of either file.
+        n = regionSpan(&c1, blockSize, &hole1);
+        n = regionSpan(&c2, n, &hole2);
+
+        // Unequal lengths differ where one ends.
+        if (n == 0) {
+            differ = (c1.size - c1.offset != c2.size - c2.offset);
+            break;
+        }
+        if (readSpan(&c1, buffer1, n) == -1 || readSpan(&c2, buffer2, n) == -1) {
+            break;
+        }
+
+        // Compare the data read, against zeros if the other side is a hole.
+        if (hole1 && hole2) {
+            continue;
+        }
+        m = mismatch(hole1 ? zeroBlock : buffer1, hole2 ? zeroBlock : buffer2, n);
+        if (m < n) {
+            c1.offset -= n - m;
+            break;
+        }
+    } while (1);
+
+    if (offset_p != NULL) {
+        *offset_p = c1.offset - start;
+    }
+    stopTimer(HIST_COMPARE, t);
+    if (differ) {
+        countStat(STAT_PAIRS_DIFFERENT, 1);
+        recordOffset(HIST_EARLY_EXIT, c1.offset - start);
+    }
+    return differ;
+}
+
+/* Orders partition members by the length, then content, of their last block */
+static int byBlock (const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    size_t n;
+    if (partitionLengths[x] != partitionLengths[y]) {
+        return (partitionLengths[x] < partitionLengths[y]) ? -1 : 1;
+    }
+    n = mismatch(partitionBlocks + x * partitionBlockSize,
+        partitionBlocks + y * partitionBlockSize, partitionLengths[x]);
+    if (n == (size_t)partitionLengths[x]) {
+        return 0;
+    }
+    return (partitionBlocks[x * partitionBlockSize + n] <
+        partitionBlocks[y * partitionBlockSize + n]) ? -1 : 1;
+}
+
+/* Partitions n open files into classes of identical content.
+ * - All files are read block by block in lockstep, each byte exactly once.
+ * - A class is split whenever its members' blocks differ, and dropped once
+ *   it has a single member.
+ * - classOf[i] receives the class of file i. Files of equal class have equal
+ *   content. Files that failed to read get class -1.
+ * - Block buffers take at most PARTITION_MEMORY bytes in total, as long as
+ *   n is at most MAX_PARTITION_FILES.
+*/
+void partitionFiles (const int *fds, int n, int *classOf) {
+    int *order = malloc(n * sizeof(int)), *next = malloc(2 * (n + 1) * sizeof(int));
+    int *segments = malloc(2 * (n + 1) * sizeof(int)), segmentCount = 1, nextCount;
+    int classes = 0, start, end, j;
+    size_t size = PARTITION_MEMORY / (n > 0 ? n : 1);
+    SparseCursor *cursors = malloc(n * sizeof(SparseCursor));
+
+    // Blocks shrink with the number of files, to bound memory.
+    size = (size > blockSize) ? blockSize : size;
+    size = (size < MIN_PARTITION_BLOCK) ? MIN_PARTITION_BLOCK : size & ~((size_t)BLOCK_ALIGNMENT - 1);
+    partitionBlockSize = size;
+    partitionLengths = malloc(n * sizeof(ssize_t));
+    if (order == NULL || next == NULL || segments == NULL || partitionLengths == NULL || cursors == NULL ||
+        posix_memalign((void **)&partitionBlocks, BLOCK_ALIGNMENT, n * size) != 0) {
+        fprintf(stderr, "Error: Couldn't allocate partition buffers!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Segments of 'order' are the live classes. Initially everything is one.
+    for (int i = 0; i < n; i++) {
+        order[i] = i;
+        classOf[i] = -1;
+    }
+
+    // Members that can't be placed fail on their first read.
+    for (int i = 0; i < n; i++) {
+        if (openCursor(cursors + i, fds[i]) == -1) {
+            cursors[i].fd = -1;
+        }
+    }
+    segments[0] = 0;
+    segments[1] = n;
+    countStat(STAT_PARTITIONED_FILES, n);
+
+    while (segmentCount > 0) {
+        nextCount = 0;
+        for (int s = 0; s < segmentCount; s++) {
+            start = segments[2 * s];
+            end = segments[2 * s + 1];
+
+            // Read the next block of every member. Failed members leave.
+            for (int i = start; i < end; i++) {
+                int f = order[i];
+                partitionLengths[f] = (cursors[f].fd == -1) ? -1 :
+                    readSparse(cursors + f, partitionBlocks + f * size, size);
+                if (partitionLengths[f] == -1) {
+                    order[i--] = order[--end];
+                    order[end] = f;
+                }
+            }
+
+            // Split into runs of equal blocks.
+            qsort(order + start, end - start, sizeof(int), byBlock);
+            for (int i = start; i < end; i = j) {
+                for (j = i + 1; j < end && byBlock(order + i, order + j) == 0; j++)
+                    ;
+
+                // Runs of one have no duplicates, runs at EOF are complete.
+                if (j - i == 1 || partitionLengths[order[i]] == 0) {
+                    for (int k = i; k < j; k++) {
+                        classOf[order[k]] = classes;
+                    }
+                    classes++;
+                    continue;
+                }
+                next[2 * nextCount] = i;
+                next[2 * nextCount++ + 1] = j;
+            }
+        }
+
+        // The split runs are the next round's classes.
+        memcpy(segments, next, 2 * nextCount * sizeof(int));
+        segmentCount = nextCount;
+    }
+
+    free(order);
+    free(next);
+    free(segments);
+    free(cursors);
+    free(partitionLengths);
+    free(partitionBlocks);
+    partitionLengths = NULL;
+    partitionBlocks = NULL;
+}
+
+/* Free's the comparison buffers */
+void freeCompareBuffers (void) {
+    free(buffer1);
+    free(buffer2);
+    buffer1 = buffer2 = NULL;
+}
@@ -0,0 +1,128 @@
+#if !defined(COMPARE_H)
+#define COMPARE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Alignment of comparison buffers (and granularity of block sizes).
+#define BLOCK_ALIGNMENT             4096
+
+// Default, minimum, and maximum comparison block sizes in bytes.
+#define DEFAULT_BLOCK_SIZE          (256 * 1024)
+#define MIN_BLOCK_SIZE              (64 * 1024)
+#define MAX_BLOCK_SIZE              (1024 * 1024)
+
+// Total bytes of block buffers a k-way partition may use, the smallest
+// block it reads per file, and so the most files it can take.
+#define PARTITION_MEMORY            (64 * 1024 * 1024)
+#define MIN_PARTITION_BLOCK         BLOCK_ALIGNMENT
+#define MAX_PARTITION_FILES         (PARTITION_MEMORY / MIN_PARTITION_BLOCK)
+
+// Page cache policies for reading files.
+#define IO_CACHED                   0   // Plain cached reads.
+#define IO_DROP                     1   // Sequential reads, dropped from the cache once consumed.
+#define IO_DIRECT                   2   // As IO_DROP, but full fingerprints bypass the cache.
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Sparse Cursor: Position in an open file, and the data segment or hole it
+ * lies in. Holes are known to read as zeros, so they needn't be read.
+*/
+typedef struct {
+    int fd;
+    off_t offset, size;
+    off_t regionEnd;        // End of the current data segment or hole.
+    int hole;               // Nonzero if the current region is a hole.
+    int direct;             // Nonzero if the file was opened for direct I/O.
+} SparseCursor;
+
+/*
+ ******************************************************************************
+ *                             Comparison Routines
+ ******************************************************************************
+*/
+
+/* Sets the block size used by diff. Clamped to range, rounded to alignment */
+void setBlockSize (size_t size);
+
+/* Returns the block size used by diff */
+size_t getBlockSize (void);
+
+/* Returns the index of the first differing byte in a and b, or n if equal */
+size_t mismatch (const void *a, const void *b, size_t n);
+
+/* Sets the page cache policy (IO_CACHED, IO_DROP, or IO_DIRECT) for reads */
+void setIoPolicy (int policy);
+
+/* Returns the page cache policy for reads */
+int getIoPolicy (void);
+
+/* Advises the kernel of how a freshly opened file will be read */
+void adviseOpen (int fd);
+
+/* Drops a consumed range of a file from the page cache (if the policy says
+ * so). A length of zero extends to the end of the file.
+*/
+void adviseConsumed (int fd, off_t offset, off_t length);
+
+/* Switches an open file to direct I/O if the policy is IO_DIRECT. Reads fall
+ * back to the page cache where direct I/O is refused.
+*/
+void adviseDirect (int fd);
+
+/* Places a cursor at the current offset of an open file. Returns -1 on error */
+int openCursor (SparseCursor *c, int fd);
+
+/* Returns the bytes (at most n) from the cursor to the end of its region,
+ * or zero at end of file. Sets hole_p if the region is a hole.
+*/
+size_t regionSpan (SparseCursor *c, size_t n, int *hole_p);
+
+/* Reads up to n bytes at the cursor and advances it. Holes are filled with
+ * zeros rather than read. With direct I/O, the buffer must be aligned with
+ * room for n rounded up to BLOCK_ALIGNMENT. Returns the bytes read (zero at
+ * end of file), or -1 on error.
+*/
+ssize_t readSparse (SparseCursor *c, void *buffer, size_t n);
+
+/* Returns nonzero if an open file has holes (fewer blocks than its size) */
+int sparseFile (int fd);
+
+/* Returns nonzero if a difference exists between two given files.
+ * - Files are compared block-wise from their current offsets.
+ * - Holes are not read. Holes in both files are skipped, and a hole facing
+ *   data only checks the data for zeros.
+ * - If offset_p is not NULL, the offset of the first difference is written.
+ * - A read error counts as a difference at the offset it occurred.
+*/
+int diff (int fd1, int fd2, off_t *offset_p);
+
+/* Partitions n open files into classes of identical content.
+ * - All files are read block by block in lockstep, each byte exactly once.
+ * - A class is split whenever its members' blocks differ, and dropped once
+ *   it has a single member.
+ * - classOf[i] receives the class of file i. Files of equal class have equal
+ *   content. Files that failed to read get class -1.
+ * - Block buffers take at most PARTITION_MEMORY bytes in total, as long as
+ *   n is at most MAX_PARTITION_FILES.
+*/
+void partitionFiles (const int *fds, int n, int *classOf);
+
+/* Free's the comparison buffers */
+void freeCompareBuffers (void);
+
+#endif
@@ -0,0 +1,130 @@
+#!/bin/sh
+# Checks the replacement paths of -a against real file systems:
+# - Hard links (-a link) and a refused reflink (-a reflink) on the temporary
+#   directory's file system, which is assumed not to share extents.
+# - FIDEDUPERANGE and FICLONE (-a reflink) on a loop-mounted btrfs or xfs
+#   image. Needs root, losetup and mkfs.btrfs or mkfs.xfs; skipped otherwise.
+#   FICLONE is forced by deduplicating, as an unprivileged user, a read-only
+#   file it doesn't own (which it can't open for FIDEDUPERANGE).
+# Usage: ./dedupe-check.sh [duplicates]
+
+BIN=$(cd "$(dirname "${1:-./duplicates}")" && pwd)/$(basename "${1:-./duplicates}")
+WORK=$(mktemp -d)
+MNT=$WORK/mnt
+FAILED=0
+SKIPPED=0
+
+cleanup () {
+    mountpoint -q "$MNT" 2>/dev/null && umount "$MNT"
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+pass () { echo "PASS: $1"; }
+fail () { echo "FAIL: $1"; FAILED=1; }
+skip () { echo "SKIP: $1"; SKIPPED=1; }
+
+# Makes a pair of equal files a and b (1 MiB, several extents) in a directory.
+makePair () {
+    mkdir -p "$1"
+    head -c 1048576 /dev/urandom > "$1/a"
+    cp "$1/a" "$1/b"
+    sync
+}
+
+# Prints the path deduplicated by a run's report, given as $1.
+dedupedPath () {
+    sed -n 's/ is now a .*//p' "$1" | head -n 1
+}
+
+# Prints nonzero if every extent of a file is marked shared.
+allShared () {
+    filefrag -v "$1" 2>/dev/null | awk '
+        /^ *[0-9]+:/ { n++; if ($0 ~ /shared/) s++ }
+        END { print (n > 0 && n == s) ? 1 : 0 }'
+}
+
+[ -x "$BIN" ] || { echo "No binary at $BIN (run make first)"; exit 1; }
+
+# Hard links: The duplicate becomes a link to the original.
+makePair "$WORK/link"
+(cd "$WORK/link" && "$BIN" -a link > ../link.out 2> ../link.err)
+if [ "$(stat -c %i "$WORK/link/a")" = "$(stat -c %i "$WORK/link/b")" ] &&
+   grep -q "is now a hard link to" "$WORK/link.out"; then
+    pass "-a link replaces the duplicate by a hard link"
+else
+    fail "-a link"; cat "$WORK/link.err"
+fi
+
+# Refused reflinks: Without shared extents, both files stay as they were.
+makePair "$WORK/norefl"
+A=$(stat -c %i "$WORK/norefl/a"); B=$(stat -c %i "$WORK/norefl/b")
+(cd "$WORK/norefl" && "$BIN" -a reflink > ../norefl.out 2> ../norefl.err)
+if grep -q "is now a reflink" "$WORK/norefl.out"; then
+    skip "-a reflink refusal ($(df -T "$WORK" | awk 'NR == 2 { print $2 }') shares extents)"
+elif grep -q "Can't deduplicate" "$WORK/norefl.err" &&
+     [ "$A" = "$(stat -c %i "$WORK/norefl/a")" ] && [ "$B" = "$(stat -c %i "$WORK/norefl/b")" ] &&
+     cmp -s "$WORK/norefl/a" "$WORK/norefl/b"; then
+    pass "-a reflink leaves files alone where extents can't be shared"
+else
+    fail "-a reflink refusal"; cat "$WORK/norefl.err"
+fi
+
+# Reflinks, on a loop-mounted image of a file system sharing extents.
+if [ "$(id -u)" -ne 0 ]; then
+    skip "FIDEDUPERANGE and FICLONE (not root)"
+elif command -v mkfs.btrfs > /dev/null; then
+    FS="mkfs.btrfs -q"
+elif command -v mkfs.xfs > /dev/null; then
+    FS="mkfs.xfs -q -m reflink=1"
+else
+    skip "FIDEDUPERANGE and FICLONE (no mkfs.btrfs or mkfs.xfs)"
+fi
+if [ -n "$FS" ]; then
+    mkdir "$MNT"
+    truncate -s 512M "$WORK/image"
+    if ! $FS "$WORK/image" > /dev/null 2>&1 || ! mount -o loop "$WORK/image" "$MNT" 2> /dev/null; then
+        skip "FIDEDUPERANGE and FICLONE (can't mount a ${FS%% *} image)"
+        FS=
+    fi
+fi
+if [ -n "$FS" ]; then
+    cp "$BIN" "$MNT/duplicates"
+    chmod 755 "$MNT" "$MNT/duplicates"
+
+    # FIDEDUPERANGE: Extents become shared, inodes stay.
+    makePair "$MNT/range"
+    A=$(stat -c %i "$MNT/range/a"); B=$(stat -c %i "$MNT/range/b")
+    (cd "$MNT/range" && ../duplicates -a reflink > ../range.out 2> ../range.err)
+    if grep -q "is now a reflink of" "$MNT/range.out" &&
+       [ "$A" = "$(stat -c %i "$MNT/range/a")" ] && [ "$B" = "$(stat -c %i "$MNT/range/b")" ] &&
+       cmp -s "$MNT/range/a" "$MNT/range/b" &&
+       [ "$(allShared "$MNT/range/a")" = 1 ] && [ "$(allShared "$MNT/range/b")" = 1 ]; then
+        pass "FIDEDUPERANGE shares the extents in place"
+    else
+        fail "FIDEDUPERANGE"; cat "$MNT/range.err"
+    fi
+
+    # FICLONE: Both files read-only and root's, in a directory nobody owns.
+    makePair "$MNT/clone"
+    chmod 444 "$MNT/clone/a" "$MNT/clone/b"
+    chown nobody "$MNT/clone"
+    (cd "$MNT/clone" && setpriv --reuid=nobody --regid=nogroup --clear-groups \
+        ../duplicates -a reflink > ../clone.out 2> ../clone.err)
+    DUP=$(dedupedPath "$MNT/clone.out")
+    if grep -q "is now a reflink of" "$MNT/clone.out" && [ -n "$DUP" ] &&
+       cmp -s "$MNT/clone/a" "$MNT/clone/b" &&
+       [ "$(stat -c %a "$MNT/clone/$DUP")" = 444 ] &&
+       [ "$(allShared "$MNT/clone/a")" = 1 ] && [ "$(allShared "$MNT/clone/b")" = 1 ] &&
+       [ -z "$(ls "$MNT/clone" | grep -v -x -e a -e b)" ]; then
+        pass "FICLONE replaces an unwritable duplicate by a clone"
+    else
+        fail "FICLONE"; cat "$MNT/clone.err"
+    fi
+fi
+
+if [ "$FAILED" -ne 0 ]; then
+    exit 1
+fi
+[ "$SKIPPED" -ne 0 ] && echo "Some checks were skipped."
+exit 0
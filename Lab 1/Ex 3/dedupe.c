@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+#include "dedupe.h"
+#include "throttle.h"
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+/*
+ ******************************************************************************
+ *                          Internal Dedupe Routines
+ ******************************************************************************
+*/
+
+/* Returns nonzero if a file still has the identity, size, and modification
+ * time it was compared with.
+*/
+static int unchanged (const struct stat *now, const struct stat *expected) {
+    return now->st_dev == expected->st_dev && now->st_ino == expected->st_ino &&
+        now->st_size == expected->st_size &&
+        now->st_mtim.tv_sec == expected->st_mtim.tv_sec &&
+        now->st_mtim.tv_nsec == expected->st_mtim.tv_nsec;
+}
+
+/* Returns nonzero if the file at a path is unchanged (and not replaced) */
+static int unchangedPath (const char *path, const struct stat *expected) {
+    struct stat now;
+    return lstat(path, &now) == 0 && S_ISREG(now.st_mode) && unchanged(&now, expected);
+}
+
+/* Shares the extents of 'dst' with those of 'src' in place, chunk by chunk.
+ * The kernel only shares ranges it finds equal. Returns -1 on failure.
+*/
+static int dedupeRange (int src, int dst, off_t size) {
+    uint64_t buffer[(sizeof(struct file_dedupe_range) +
+        sizeof(struct file_dedupe_range_info)) / sizeof(uint64_t) + 1];
+    struct file_dedupe_range *range = (struct file_dedupe_range *)buffer;
+    struct file_dedupe_range_info *info = range->info;
+    uint64_t u;
+    int r;
+
+    for (off_t offset = 0; offset < size; offset += info->bytes_deduped) {
+        memset(buffer, 0, sizeof(buffer));
+        range->src_offset = offset;
+        range->src_length = (size - offset < DEDUPE_CHUNK_SIZE) ? size - offset : DEDUPE_CHUNK_SIZE;
+        range->dest_count = 1;
+        info->dest_fd = dst;
+        info->dest_offset = offset;
+
+        // The kernel reads both ranges to compare them.
+        u = throttleRead(2 * range->src_length);
+        r = ioctl(src, FIDEDUPERANGE, range);
+        throttleDone(u);
+        if (r == -1 || info->status != FILE_DEDUPE_RANGE_SAME || info->bytes_deduped == 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Writes a temporary name next to 'path' (attempt i) to a buffer */
+static char *tempName (const char *path, int i, char **bp) {
+    size_t size = strlen(path) + 32;
+    if ((*bp = realloc(*bp, size)) == NULL) {
+        fprintf(stderr, "Error: Couldn't allocate path buffer!\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(*bp, size, "%s.dupe-%d-%d", path, (int)getpid(), i);
+    return *bp;
+}
+
+/* Clones the open 'src' to a temporary file with the metadata of 'current',
+ * then renames it over 'path' if that is unchanged. Returns -1 on failure.
+*/
+static int cloneReplace (int src, const char *path, const struct stat *current) {
+    struct timespec times[2] = {current->st_atim, current->st_mtim};
+    char *temp = NULL;
+    int fd = -1, result = -1;
+
+    for (int i = 0; fd == -1 && i < DEDUPE_TEMP_ATTEMPTS; i++) {
+        if ((fd = open(tempName(path, i, &temp), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) == -1 &&
+            errno != EEXIST) {
+            break;
+        }
+    }
+    if (fd == -1) {
+        free(temp);
+        return -1;
+    }
+
+    // Ownership can only be kept with privilege. The rest always is.
+    if (ioctl(fd, FICLONE, src) == 0 &&
+        (fchown(fd, current->st_uid, current->st_gid) == 0 || errno == EPERM) &&
+        fchmod(fd, current->st_mode & 07777) == 0 && futimens(fd, times) == 0 &&
+        fsync(fd) == 0 && unchangedPath(path, current) && rename(temp, path) == 0) {
+        result = 0;
+    }
+    close(fd);
+    if (result == -1) {
+        unlink(temp);
+    }
+    free(temp);
+    return result;
+}
+
+/* Hard links 'sourcePath' to a temporary name, then renames it over 'path'
+ * if that is unchanged. Returns -1 on failure.
+*/
+static int linkReplace (const char *sourcePath, const char *path, const struct stat *current) {
+    char *temp = NULL;
+    int linked = 0, result = -1;
+
+    for (int i = 0; !linked && i < DEDUPE_TEMP_ATTEMPTS; i++) {
+        if (linkat(AT_FDCWD, sourcePath, AT_FDCWD, tempName(path, i, &temp), AT_SYMLINK_FOLLOW) == 0) {
+            linked = 1;
+        } else if (errno != EEXIST) {
+            break;
+        }
+    }
+    if (linked) {
+        if (unchangedPath(path, current) && rename(temp, path) == 0) {
+            result = 0;
+        } else {
+            unlink(temp);
+        }
+    }
+    free(temp);
+    return result;
+}
+
+/*
+ ******************************************************************************
+ *                               Dedupe Routines
+ ******************************************************************************
+*/
+
+/* Makes the file at 'path' share the storage of the file at 'sourcePath'.
+ * Returns the method used, or -1 (with the file left as it was).
+*/
+int dedupeFile (const char *path, const struct stat *expected,
+    const char *sourcePath, const struct stat *sourceExpected, int methods) {
+    struct stat current, source;
+    int src, dst, method = -1;
+
+    // Both files must be as they were compared. Links to files are left alone.
+    if (lstat(path, &current) == -1 || !S_ISREG(current.st_mode) || !unchanged(&current, expected) ||
+        (src = open(sourcePath, O_RDONLY | O_CLOEXEC)) == -1) {
+        return -1;
+    }
+    if (fstat(src, &source) == -1 || !unchanged(&source, sourceExpected)) {
+        close(src);
+        return -1;
+    }
+
+    if (methods & DEDUPE_REFLINK) {
+        if ((dst = open(path, O_WRONLY | O_CLOEXEC)) != -1) {
+            if (dedupeRange(src, dst, current.st_size) == 0) {
+                method = DEDUPE_REFLINK;
+            }
+            close(dst);
+        }
+        if (method == -1 && cloneReplace(src, path, &current) == 0) {
+            method = DEDUPE_REFLINK;
+        }
+    }
+    if (method == -1 && (methods & DEDUPE_LINK) && linkReplace(sourcePath, path, &current) == 0) {
+        method = DEDUPE_LINK;
+    }
+
+    close(src);
+    return method;
+}
@@ -0,0 +1,46 @@
+#if !defined(DEDUPE_H)
+#define DEDUPE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Ways of replacing a duplicate, tried in this order.
+#define DEDUPE_REFLINK              1   // Share extents (FIDEDUPERANGE, else FICLONE).
+#define DEDUPE_LINK                 2   // Hard link to the original.
+
+// Bytes shared per FIDEDUPERANGE request.
+#define DEDUPE_CHUNK_SIZE           (16 * 1024 * 1024)
+
+// Attempts at finding an unused temporary name.
+#define DEDUPE_TEMP_ATTEMPTS        16
+
+/*
+ ******************************************************************************
+ *                               Dedupe Routines
+ ******************************************************************************
+*/
+
+/* Makes the file at 'path' share the storage of the file at 'sourcePath'.
+ * - 'expected' and 'sourceExpected' hold the identity, size, and modification
+ *   time of both files from when they were compared. Nothing is done if
+ *   either file changed since, or if 'path' is not a regular file.
+ * - Extents are shared in place if the filesystem can (the kernel compares
+ *   the data once more). Otherwise a reflink or hard link is made under a
+ *   temporary name and renamed over 'path', so that it always names a whole
+ *   file. Hard links take on the metadata of the source.
+ * - 'methods' is a combination of DEDUPE_REFLINK and DEDUPE_LINK.
+ * - Returns the method used, or -1 (with the file left as it was).
+*/
+int dedupeFile (const char *path, const struct stat *expected,
+    const char *sourcePath, const struct stat *sourceExpected, int methods);
+
+#endif
@@ -0,0 +1,413 @@
+#define _GNU_SOURCE
+#include "dirtree.h"
+#include "arena.h"
+#include "stats.h"
+#include "meta.h"
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+#define DEFAULT_NODE_COUNT          64
+
+// Marks an empty child-index slot.
+#define EMPTY_SLOT                  (-1)
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Directory entry record as returned by getdents64 */
+typedef struct {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} LinuxDirent64;
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* All directory nodes, with count and capacity */
+static DirNode *nodes;
+static int nodeCount, nodeCapacity;
+
+/* Storage for node and file names */
+static Arena names;
+
+/* Child index: Open-addressed on (parent, name), holding node indices */
+static int *children;
+static int childrenSize, childrenCount;
+
+/* Most recently interned directory path, and its node */
+static char *lastPath;
+static size_t lastLength, lastCapacity;
+static int lastNode = NO_PARENT;
+
+/* Shared getdents64 batch buffer */
+static char *dentsBuffer;
+
+/* Non-directory names of the current batch, with their metadata and results */
+static const char **batchNames;
+static struct stat *batchStats;
+static int *batchResults;
+static int batchCapacity;
+
+/* File callback of the current scan */
+static void (*callback)(int, const char *, const struct stat *);
+
+/* Directory hook, applied to each directory as a scan enters it (or NULL) */
+static void (*directoryHook)(int);
+
+/*
+ ******************************************************************************
+ *                          Internal Node Routines
+ ******************************************************************************
+*/
+
+/* Appends a directory node. Returns its index */
+static int newDirNode (int parent, const char *name, size_t length) {
+    char *sp;
+    if (nodeCount == nodeCapacity) {
+        nodeCapacity = (nodeCapacity == 0) ? DEFAULT_NODE_COUNT : nodeCapacity * 2;
+        nodes = realloc(nodes, nodeCapacity * sizeof(DirNode));
+        assert(nodes != NULL);
+    }
+    sp = arenaAlloc(&names, length + 1);
+    memcpy(sp, name, length);
+    sp[length] = '\0';
+    nodes[nodeCount] = (DirNode){.parent = parent, .name = sp};
+    return nodeCount++;
+}
+
+/* Returns the home slot of a (parent, name) pair */
+static int hashChild (int parent, const char *name, size_t length) {
+    uint64_t h = (uint64_t)(parent + 1) * 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < length; i++) {
+        h = (h ^ (unsigned char)name[i]) * 0x100000001B3ULL;
+    }
+    return (int)(h >> 32) & (childrenSize - 1);
+}
+
+/* Returns the slot of a (parent, name) pair, or the empty slot it belongs in */
+static int probeChildren (int parent, const char *name, size_t length) {
+    int i = hashChild(parent, name, length);
+    while (children[i] != EMPTY_SLOT && (nodes[children[i]].parent != parent ||
+        strncmp(nodes[children[i]].name, name, length) != 0 ||
+        nodes[children[i]].name[length] != '\0')) {
+        i = (i + 1) & (childrenSize - 1);
+    }
+    return i;
+}
+
+/* Returns the node of 'name' within 'parent', creating it if needed */
+static int internChild (int parent, const char *name, size_t length) {
+    int *old = children, oldSize = childrenSize, i;
+
+    // Rehash at half load.
+    if (2 * (childrenCount + 1) > childrenSize) {
+        childrenSize = (childrenSize == 0) ? DEFAULT_NODE_COUNT : childrenSize * 2;
+        children = malloc(childrenSize * sizeof(int));
+        assert(children != NULL);
+        memset(children, 0xFF, childrenSize * sizeof(int));
+        for (i = 0; i < oldSize; i++) {
+            if (old[i] != EMPTY_SLOT) {
+                const DirNode *node = nodes + old[i];
+                children[probeChildren(node->parent, node->name, strlen(node->name))] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    if (children[i = probeChildren(parent, name, length)] == EMPTY_SLOT) {
+        children[i] = newDirNode(parent, name, length);
+        childrenCount++;
+    }
+    return children[i];
+}
+
+/* Prints an error message about 'name' in 'dir', building its path */
+static void scanError (const char *format, int dir, const char *name) {
+    char *path = NULL;
+    int size = 0;
+    fprintf(stderr, format, buildPath(dir, name, &path, &size));
+    free(path);
+}
+
+/*
+ ******************************************************************************
+ *                          Internal Scan Routines
+ ******************************************************************************
+*/
+
+/* Returns nonzero for unused entries, self, and parent */
+static int skipEntry (const LinuxDirent64 *entry) {
+    return entry->d_ino == 0 || strcmp(entry->d_name, ".") == 0 ||
+        strcmp(entry->d_name, "..") == 0;
+}
+
+/* Appends a non-directory name to the current batch */
+static void addToBatch (int count, const char *name) {
+    if (count == batchCapacity) {
+        batchCapacity = (batchCapacity == 0) ? 256 : batchCapacity * 2;
+        batchNames = realloc(batchNames, batchCapacity * sizeof(char *));
+        batchStats = realloc(batchStats, batchCapacity * sizeof(struct stat));
+        batchResults = realloc(batchResults, batchCapacity * sizeof(int));
+        assert(batchNames != NULL && batchStats != NULL && batchResults != NULL);
+    }
+    batchNames[count] = name;
+}
+
+/* Scans the open directory 'fd' (of node 'dir'), then its subdirectories.
+ * Takes ownership of (closes) the descriptor.
+*/
+static void scanAt (int fd, int dir) {
+    char **subdirs = NULL;
+    int subdirCount = 0, subdirCapacity = 0, childFd;
+    int batchCount, b;
+    LinuxDirent64 *entry;
+    long n;
+
+    countStat(STAT_DIRECTORIES, 1);
+    if (directoryHook != NULL) {
+        directoryHook(dir);
+    }
+
+    // Read the directory in batches. Only subdirectory names are kept.
+    while ((n = syscall(SYS_getdents64, fd, dentsBuffer, DENTS_BUFFER_SIZE)) > 0) {
+
+        // Anything not known to be a directory is stat'ed (following links),
+        // the whole batch at once.
+        batchCount = 0;
+        for (long off = 0; off < n; off += entry->d_reclen) {
+            entry = (LinuxDirent64 *)(dentsBuffer + off);
+            if (!skipEntry(entry) && entry->d_type != DT_DIR) {
+                addToBatch(batchCount++, entry->d_name);
+            }
+        }
+        fetchMetadataBatch(fd, batchNames, batchCount, batchStats, batchResults);
+
+        // Hand out files, in directory order, and keep the subdirectories.
+        b = 0;
+        for (long off = 0; off < n; off += entry->d_reclen) {
+            entry = (LinuxDirent64 *)(dentsBuffer + off);
+            if (skipEntry(entry)) {
+                continue;
+            }
+            if (entry->d_type != DT_DIR) {
+                if (batchResults[b] == -1) {
+                    scanError("Error: Can't access file %s! -Ignoring-\n", dir, entry->d_name);
+                    b++;
+                    continue;
+                }
+                if (!S_ISDIR(batchStats[b].st_mode)) {
+                    callback(dir, entry->d_name, batchStats + b++);
+                    continue;
+                }
+                b++;
+            }
+
+            if (subdirCount == subdirCapacity) {
+                subdirCapacity = (subdirCapacity == 0) ? 16 : subdirCapacity * 2;
+                subdirs = realloc(subdirs, subdirCapacity * sizeof(char *));
+                assert(subdirs != NULL);
+            }
+            subdirs[subdirCount] = malloc(strlen(entry->d_name) + 1);
+            assert(subdirs[subdirCount] != NULL);
+            strcpy(subdirs[subdirCount++], entry->d_name);
+        }
+    }
+    if (n == -1) {
+        scanError("Error: Can't read directory %s! -Ignoring-\n", nodes[dir].parent, nodes[dir].name);
+    }
+
+    // Descend relative to this directory.
+    for (int i = 0; i < subdirCount; i++) {
+        if ((childFd = openat(fd, subdirs[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+            scanError("Error: Can't access directory %s! -Ignoring-\n", dir, subdirs[i]);
+        } else {
+            scanAt(childFd, newDirNode(dir, subdirs[i], strlen(subdirs[i])));
+        }
+        free(subdirs[i]);
+    }
+
+    free(subdirs);
+    close(fd);
+}
+
+/* Scans the open directory 'fd' as a new node of 'name' within 'parent' */
+static void scanRoot (int fd, int parent, const char *name,
+    void (*f)(int dir, const char *name, const struct stat *statBuffer)) {
+    if ((dentsBuffer = malloc(DENTS_BUFFER_SIZE)) == NULL) {
+        fprintf(stderr, "Error: Couldn't allocate directory buffer!\n");
+        exit(EXIT_FAILURE);
+    }
+    callback = f;
+
+    scanAt(fd, newDirNode(parent, name, strlen(name)));
+
+    free(dentsBuffer);
+    dentsBuffer = NULL;
+    free(batchNames);
+    free(batchStats);
+    free(batchResults);
+    batchNames = NULL;
+    batchStats = NULL;
+    batchResults = NULL;
+    batchCapacity = 0;
+}
+
+/*
+ ******************************************************************************
+ *                           Directory Tree Routines
+ ******************************************************************************
+*/
+
+/* Walks the tree below root using descriptor-relative system calls.
+ * - Directories are read in large getdents64 batches and opened with openat.
+ * - Entries typed as directories are descended into without a stat.
+ * - 'f' is applied to every other file, with the node index of its directory
+ *   and its name within it. No full paths are built.
+*/
+void scanTree (const char *root,
+    void (*f)(int dir, const char *name, const struct stat *statBuffer)) {
+    int fd;
+    assert(root != NULL && f != NULL);
+
+    if ((fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        fprintf(stderr, "Error: Can't access directory %s! -Ignoring-\n", root);
+        return;
+    }
+    scanRoot(fd, NO_PARENT, root, f);
+}
+
+/* Walks the tree below directory 'name' within node 'parent', as scanTree.
+ * The directory gets a new node, even if one by that name existed before.
+*/
+void scanSubtree (int parent, const char *name,
+    void (*f)(int dir, const char *name, const struct stat *statBuffer)) {
+    char *path = NULL;
+    int size = 0, fd;
+    assert(name != NULL && f != NULL);
+
+    if ((fd = open(buildPath(parent, name, &path, &size), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        fprintf(stderr, "Error: Can't access directory %s! -Ignoring-\n", path);
+    } else {
+        scanRoot(fd, parent, name, f);
+    }
+    free(path);
+}
+
+/* Sets a hook applied to each directory node as a scan enters it (before
+ * reading it). NULL removes the hook.
+*/
+void setDirectoryHook (void (*g)(int dir)) {
+    directoryHook = g;
+}
+
+/* Returns a directory node by index */
+const DirNode *getDirNode (int dir) {
+    assert(dir >= 0 && dir < nodeCount);
+    return nodes + dir;
+}
+
+/* Returns nonzero if directory node 'dir' is 'ancestor' or lies below it */
+int isBelow (int dir, int ancestor) {
+    for (; dir != NO_PARENT; dir = nodes[dir].parent) {
+        if (dir == ancestor) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Returns the node index of a directory path, creating nodes as needed.
+ * Paths sharing a prefix share the nodes of that prefix.
+*/
+int internDirectory (const char *path, size_t length) {
+    const char *component = path, *end = path + length, *slash;
+    int node = NO_PARENT;
+
+    // Files of one directory tend to arrive together.
+    if (lastNode != NO_PARENT && length == lastLength && memcmp(path, lastPath, length) == 0) {
+        return lastNode;
+    }
+
+    // Resolve one component at a time from the root.
+    do {
+        if ((slash = memchr(component, '/', end - component)) == NULL) {
+            slash = end;
+        }
+        node = internChild(node, component, slash - component);
+        component = slash + 1;
+    } while (slash < end);
+
+    if (lastCapacity < length) {
+        lastPath = realloc(lastPath, lastCapacity = length);
+        assert(lastPath != NULL);
+    }
+    memcpy(lastPath, path, lastLength = length);
+    return lastNode = node;
+}
+
+/* Copies a name into directory-tree storage. Returns the stored copy */
+const char *internName (const char *name) {
+    return arenaString(&names, name);
+}
+
+/* Writes the full path of 'name' in directory 'dir' to a buffer, growing it
+ * (and updating size_p) as needed. Returns the buffer.
+*/
+char *buildPath (int dir, const char *name, char **bp, int *size_p) {
+    int length = strlen(name), n;
+    char *p;
+
+    // Measure the path, then fill it in from the end.
+    for (int d = dir; d != NO_PARENT; d = nodes[d].parent) {
+        length += strlen(nodes[d].name) + 1;
+    }
+    if (*bp == NULL || *size_p < length + 1) {
+        *bp = realloc(*bp, length + 1);
+        assert(*bp != NULL);
+        *size_p = length + 1;
+    }
+
+    p = *bp + length;
+    *p = '\0';
+    p -= (n = strlen(name));
+    memcpy(p, name, n);
+    for (int d = dir; d != NO_PARENT; d = nodes[d].parent) {
+        *--p = '/';
+        p -= (n = strlen(nodes[d].name));
+        memcpy(p, nodes[d].name, n);
+    }
+    return *bp;
+}
+
+/* Free's all directory nodes */
+void freeDirNodes (void) {
+    freeArena(&names);
+    free(nodes);
+    free(children);
+    free(lastPath);
+    nodes = NULL;
+    children = NULL;
+    lastPath = NULL;
+    nodeCount = nodeCapacity = childrenSize = childrenCount = 0;
+    lastLength = lastCapacity = 0;
+    lastNode = NO_PARENT;
+}
@@ -0,0 +1,83 @@
+#if !defined(DIRTREE_H)
+#define DIRTREE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Size of the getdents64 batch buffer in bytes.
+#define DENTS_BUFFER_SIZE           (256 * 1024)
+
+// Parent index of a root directory node.
+#define NO_PARENT                   (-1)
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Directory Node: A directory, named relative to its parent (by index) */
+typedef struct {
+    int parent;
+    const char *name;
+} DirNode;
+
+/*
+ ******************************************************************************
+ *                           Directory Tree Routines
+ ******************************************************************************
+*/
+
+/* Walks the tree below root using descriptor-relative system calls.
+ * - Directories are read in large getdents64 batches and opened with openat.
+ * - Entries typed as directories are descended into without a stat.
+ * - 'f' is applied to every other file, with the node index of its directory
+ *   and its name within it. No full paths are built.
+*/
+void scanTree (const char *root,
+    void (*f)(int dir, const char *name, const struct stat *statBuffer));
+
+/* Walks the tree below directory 'name' within node 'parent', as scanTree.
+ * The directory gets a new node, even if one by that name existed before.
+*/
+void scanSubtree (int parent, const char *name,
+    void (*f)(int dir, const char *name, const struct stat *statBuffer));
+
+/* Sets a hook applied to each directory node as a scan enters it (before
+ * reading it). NULL removes the hook.
+*/
+void setDirectoryHook (void (*g)(int dir));
+
+/* Returns a directory node by index */
+const DirNode *getDirNode (int dir);
+
+/* Returns nonzero if directory node 'dir' is 'ancestor' or lies below it */
+int isBelow (int dir, int ancestor);
+
+/* Returns the node index of a directory path, creating nodes as needed.
+ * Paths sharing a prefix share the nodes of that prefix.
+*/
+int internDirectory (const char *path, size_t length);
+
+/* Copies a name into directory-tree storage. Returns the stored copy */
+const char *internName (const char *name);
+
+/* Writes the full path of 'name' in directory 'dir' to a buffer, growing it
+ * (and updating size_p) as needed. Returns the buffer.
+*/
+char *buildPath (int dir, const char *name, char **bp, int *size_p);
+
+/* Free's all directory nodes */
+void freeDirNodes (void);
+
+#endif
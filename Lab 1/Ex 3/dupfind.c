@@ -0,0 +1,548 @@
+#define _POSIX_C_SOURCE 200809L
+#include "dupfind.h"
+#include "walker.h"
+#include "compare.h"
+#include "arena.h"
+#include "meta.h"
+#include "stats.h"
+#include "throttle.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+#define DEFAULT_ENTRY_COUNT         1024
+
+// Entry states.
+#define HAVE_SAMPLE                 1
+#define HAVE_DIGEST                 2
+#define UNREADABLE                  4
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* A file added to the run in progress */
+typedef struct {
+    const char *path;
+    off_t size;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int id;                 // Order added.
+    int links;              // Paths of this inode that follow (first path only).
+    int state;
+    Fingerprint sample, digest;
+} DupEntry;
+
+/* A duplicate finder */
+struct DupFinder {
+    DupOptions options;
+
+    // Files of the run in progress, and storage for their paths.
+    DupEntry *entries;
+    int entryCount, entryCapacity;
+    Arena paths;
+    pthread_mutex_t lock;
+
+    // Read buffers, hash state, and the group being passed.
+    unsigned char *buffers[2];
+    void *hashState;
+    DupFile *group;
+    int groupCapacity;
+
+    // Groups passed, and nonzero once onGroup asked to stop.
+    int groupCount, stopped;
+};
+
+/*
+ ******************************************************************************
+ *                          Internal Backend Routines
+ ******************************************************************************
+*/
+
+/* Adds a file found by the walker */
+static void addFound (void *arg, const char *fileName, const struct stat *statBuffer) {
+    addDupFile(arg, fileName, statBuffer);
+}
+
+/* Walks the tree at root with the finder's number of walker threads */
+static int walkTree (void *state, DupFinder *finder, const char *root) {
+    struct stat statBuffer;
+    if (fetchMetadata(AT_FDCWD, root, &statBuffer) == -1) {
+        return -1;
+    }
+    if (S_ISDIR(statBuffer.st_mode)) {
+        parallelScan(root, finder->options.threads, addFound, finder);
+    } else {
+        addDupFile(finder, root, &statBuffer);
+    }
+    return 0;
+}
+
+/* Opens a file for reading */
+static int openRead (void *state, const char *path) {
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/* Reads up to n bytes at an offset, throttled and counted like the finder's */
+static ssize_t preadRead (void *state, int handle, void *buffer, size_t n, off_t offset) {
+    uint64_t t, u;
+    ssize_t r;
+    do {
+        u = throttleRead(n);
+        t = startTimer();
+        r = pread(handle, buffer, n, offset);
+        stopTimer(HIST_READ, t);
+        throttleDone(u);
+    } while (r == -1 && errno == EINTR);
+    if (r > 0) {
+        countStat(STAT_BYTES_READ, r);
+    }
+    return r;
+}
+
+/* Closes a file */
+static void closeRead (void *state, int handle) {
+    close(handle);
+}
+
+/* Fingerprint hash backend routines */
+static void initHash (void *hashState) {
+    initFingerprint(hashState);
+}
+
+static void updateHash (void *hashState, const void *data, size_t n) {
+    updateFingerprint(hashState, data, n);
+}
+
+static Fingerprint finalHash (const void *hashState) {
+    return finalFingerprint(hashState);
+}
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* Built-in backends */
+const DupTraversal dupWalkerTraversal = {.walk = walkTree};
+const DupIo dupPreadIo = {.open = openRead, .read = preadRead, .close = closeRead};
+const DupHasher dupFingerprintHasher = {.stateSize = sizeof(FingerprintState),
+    .init = initHash, .update = updateHash, .final = finalHash};
+
+/*
+ ******************************************************************************
+ *                          Internal Content Routines
+ ******************************************************************************
+*/
+
+/* Enters a stage through the onStage hook (if any). Returns the stage left */
+static int enterRunStage (DupFinder *f, int stage) {
+    return (f->options.onStage != NULL) ? f->options.onStage(f->options.arg, stage) : STAGE_OTHER;
+}
+
+/* Reports a file that can't be read */
+static void readError (DupFinder *f, const char *path, int errnum) {
+    if (f->options.onError != NULL) {
+        f->options.onError(f->options.arg, path, errnum);
+    } else {
+        fprintf(stderr, "Error: Can't read file %s! -Ignoring-\n", path);
+    }
+}
+
+/* Reads n bytes at an offset into buffer b, retrying short reads. Returns -1
+ * on error, or if the file ends early (it changed since it was found).
+*/
+static int readExactly (DupFinder *f, int handle, int b, size_t n, off_t offset) {
+    size_t total = 0;
+    ssize_t r;
+    while (total < n) {
+        r = f->options.io->read(f->options.io->state, handle, f->buffers[b] + total, n - total,
+            offset + total);
+        if (r == 0) {
+            errno = EIO;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        total += r;
+    }
+    return 0;
+}
+
+/* Hashes length bytes of an open file from an offset into the hash state */
+static int hashRange (DupFinder *f, int handle, off_t offset, off_t length) {
+    size_t n;
+    for (off_t done = 0; done < length; done += n) {
+        n = (length - done < (off_t)f->options.blockSize) ? length - done : f->options.blockSize;
+        if (readExactly(f, handle, 0, n, offset + done) == -1) {
+            return -1;
+        }
+        f->options.hasher->update(f->hashState, f->buffers[0], n);
+    }
+    return 0;
+}
+
+/* Returns the cache key of an entry */
+static CacheKey entryKey (const DupEntry *e) {
+    return (CacheKey){.dev = e->dev, .ino = e->ino, .size = e->size,
+        .mtimeSec = e->mtime.tv_sec, .mtimeNsec = e->mtime.tv_nsec};
+}
+
+/* Returns the cache of a finder, or NULL if its fingerprints can't be cached */
+static Cache *finderCache (DupFinder *f) {
+    return (f->options.hasher == &dupFingerprintHasher) ? f->options.cache : NULL;
+}
+
+/* Fingerprints an entry: Its head and tail samples, or its full content.
+ * - Files no larger than two samples are sampled whole: Their sample is their
+ *   full fingerprint.
+ * - Returns -1 (marking the entry unreadable) on error.
+*/
+static int fingerprintEntry (DupFinder *f, DupEntry *e, int full) {
+    const DupIo *io = f->options.io;
+    Fingerprint sample, digest;
+    int handle, flags, r, errnum;
+
+    if (e->state & (full ? HAVE_DIGEST : HAVE_SAMPLE)) {
+        return 0;
+    }
+    if ((flags = lookupCache(finderCache(f), entryKey(e), &sample, &digest)) &
+        (full ? CACHE_DIGEST : CACHE_SAMPLE)) {
+        e->sample = sample;
+        e->digest = digest;
+        e->state |= HAVE_SAMPLE | ((flags & CACHE_DIGEST) ? HAVE_DIGEST : 0);
+        return 0;
+    }
+
+    if ((handle = io->open(io->state, e->path)) == -1) {
+        goto fail;
+    }
+    f->options.hasher->init(f->hashState);
+    if (full || e->size <= 2 * SAMPLE_SIZE) {
+        r = hashRange(f, handle, 0, e->size);
+    } else {
+        r = hashRange(f, handle, 0, SAMPLE_SIZE);
+        r = (r == 0) ? hashRange(f, handle, e->size - SAMPLE_SIZE, SAMPLE_SIZE) : r;
+    }
+    errnum = errno;
+    io->close(io->state, handle);
+    if (r == -1) {
+        errno = errnum;
+        goto fail;
+    }
+
+    // Store what was computed. Files sampled whole have their digest too.
+    if (full) {
+        e->digest = f->options.hasher->final(f->hashState);
+        flags = CACHE_DIGEST;
+    } else {
+        e->sample = e->digest = f->options.hasher->final(f->hashState);
+        flags = (e->size <= 2 * SAMPLE_SIZE) ? CACHE_SAMPLE | CACHE_DIGEST : CACHE_SAMPLE;
+    }
+    e->state |= ((flags & CACHE_SAMPLE) ? HAVE_SAMPLE : 0) | ((flags & CACHE_DIGEST) ? HAVE_DIGEST : 0);
+    countStat(full ? STAT_DIGESTS : STAT_SAMPLES, 1);
+    storeCache(finderCache(f), entryKey(e), flags, e->sample, e->digest);
+    return 0;
+
+fail:
+    readError(f, e->path, errno);
+    e->state |= UNREADABLE;
+    return -1;
+}
+
+/* Returns nonzero if two entries have equal content. Unreadable ones don't */
+static int sameContent (DupFinder *f, DupEntry *a, DupEntry *b) {
+    const DupIo *io = f->options.io;
+    int ha, hb, same = 1, stage;
+    uint64_t t;
+    size_t n;
+
+    if ((ha = io->open(io->state, a->path)) == -1) {
+        readError(f, a->path, errno);
+        return 0;
+    }
+    if ((hb = io->open(io->state, b->path)) == -1) {
+        readError(f, b->path, errno);
+        io->close(io->state, ha);
+        return 0;
+    }
+    stage = enterRunStage(f, STAGE_COMPARE);
+    t = startTimer();
+    for (off_t done = 0; same && done < a->size; done += n) {
+        n = (a->size - done < (off_t)f->options.blockSize) ? a->size - done : f->options.blockSize;
+        if (readExactly(f, ha, 0, n, done) == -1) {
+            readError(f, a->path, errno);
+            same = 0;
+        } else if (readExactly(f, hb, 1, n, done) == -1) {
+            readError(f, b->path, errno);
+            same = 0;
+        } else {
+            same = (mismatch(f->buffers[0], f->buffers[1], n) == n);
+        }
+    }
+    io->close(io->state, ha);
+    io->close(io->state, hb);
+    stopTimer(HIST_COMPARE, t);
+    if (!same) {
+        countStat(STAT_PAIRS_DIFFERENT, 1);
+    }
+    enterRunStage(f, stage);
+    return same;
+}
+
+/*
+ ******************************************************************************
+ *                          Internal Grouping Routines
+ ******************************************************************************
+*/
+
+/* Orders entries by size, then inode, then order added */
+static int bySizeInode (const void *a, const void *b) {
+    const DupEntry *x = a, *y = b;
+    if (x->size != y->size) {
+        return (x->size < y->size) ? -1 : 1;
+    }
+    if (x->dev != y->dev) {
+        return (x->dev < y->dev) ? -1 : 1;
+    }
+    if (x->ino != y->ino) {
+        return (x->ino < y->ino) ? -1 : 1;
+    }
+    return x->id - y->id;
+}
+
+/* Orders entry pointers by order added */
+static int byId (const void *a, const void *b) {
+    return (*(DupEntry *const *)a)->id - (*(DupEntry *const *)b)->id;
+}
+
+/* Orders entry pointers by sample */
+static int bySample (const void *a, const void *b) {
+    return compareFingerprints((*(DupEntry *const *)a)->sample, (*(DupEntry *const *)b)->sample);
+}
+
+/* Orders entry pointers by digest */
+static int byDigest (const void *a, const void *b) {
+    return compareFingerprints((*(DupEntry *const *)a)->digest, (*(DupEntry *const *)b)->digest);
+}
+
+/* Passes the paths of n inodes (given by their first entries) as a group, if
+ * there are at least two.
+*/
+static void passGroup (DupFinder *f, DupEntry **inodes, int n) {
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        count += 1 + inodes[i]->links;
+    }
+    if (count < 2 || f->stopped) {
+        return;
+    }
+
+    if (count > f->groupCapacity) {
+        f->groupCapacity = count;
+        f->group = realloc(f->group, count * sizeof(DupFile));
+        assert(f->group != NULL);
+    }
+    count = 0;
+    for (int i = 0; i < n; i++) {
+        for (DupEntry *e = inodes[i]; e <= inodes[i] + inodes[i]->links; e++) {
+            f->group[count++] = (DupFile){.path = e->path, .dev = e->dev, .ino = e->ino,
+                .mtimeSec = e->mtime.tv_sec, .mtimeNsec = e->mtime.tv_nsec};
+        }
+    }
+
+    f->groupCount++;
+    f->stopped = f->options.onGroup(f->options.arg,
+        &(DupGroup){.size = inodes[0]->size, .count = count, .files = f->group});
+}
+
+/* Passes inodes of equal fingerprints (in order added) as groups. If
+ * verifying, those differing from the first are split off and checked as a
+ * group of their own.
+*/
+static void passVerified (DupFinder *f, DupEntry **inodes, int n) {
+    DupEntry *t;
+    int m;
+    while (n > 0) {
+        m = 1;
+        for (int i = 1; f->options.verify && i < n; i++) {
+            if (sameContent(f, inodes[0], inodes[i])) {
+                t = inodes[m]; inodes[m++] = inodes[i]; inodes[i] = t;
+            }
+        }
+        m = f->options.verify ? m : n;
+        passGroup(f, inodes, m);
+
+        // Restore the order of the remainder.
+        inodes += m; n -= m;
+        qsort(inodes, n, sizeof(DupEntry *), byId);
+    }
+}
+
+/* Fingerprints n inodes, dropping the unreadable ones. Returns those left */
+static int fingerprintInodes (DupFinder *f, DupEntry **inodes, int n, int full) {
+    int m = 0, stage = enterRunStage(f, full ? STAGE_DIGEST : STAGE_SAMPLE);
+    for (int i = 0; i < n; i++) {
+        if (fingerprintEntry(f, inodes[i], full) == 0) {
+            inodes[m++] = inodes[i];
+        }
+    }
+    enterRunStage(f, stage);
+    return m;
+}
+
+/* Applies 'pass' to each run of inodes equal under 'order' until stopped.
+ * Runs are passed in order added.
+*/
+static void forEachRun (DupFinder *f, DupEntry **inodes, int n,
+    int (*order)(const void *, const void *), void (*pass)(DupFinder *, DupEntry **, int)) {
+    int j;
+    qsort(inodes, n, sizeof(DupEntry *), order);
+    for (int i = 0; i < n && !f->stopped; i = j) {
+        for (j = i + 1; j < n && order(inodes + i, inodes + j) == 0; j++)
+            ;
+        qsort(inodes + i, j - i, sizeof(DupEntry *), byId);
+        pass(f, inodes + i, j - i);
+    }
+}
+
+/* Splits inodes of equal samples by full fingerprint, then passes them */
+static void refineSampleRun (DupFinder *f, DupEntry **inodes, int n) {
+    if (n > 1 && inodes[0]->size > 2 * SAMPLE_SIZE) {
+        n = fingerprintInodes(f, inodes, n, 1);
+        forEachRun(f, inodes, n, byDigest, passVerified);
+    } else {
+        passVerified(f, inodes, n);
+    }
+}
+
+/* Resolves the entries of one size: Files sharing an inode are grouped
+ * outright; distinct inodes are compared by sample, then by digest.
+*/
+static void resolveSize (DupFinder *f, DupEntry *entries, int n) {
+    DupEntry **inodes = malloc(n * sizeof(DupEntry *));
+    int count = 0, j;
+    assert(inodes != NULL);
+
+    // The first entry of each inode stands for it (and its links).
+    for (int i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && entries[j].dev == entries[i].dev && entries[j].ino == entries[i].ino; j++)
+            ;
+        entries[i].links = j - i - 1;
+        inodes[count++] = entries + i;
+    }
+
+    if (count == 1) {
+        passGroup(f, inodes, 1);
+    } else {
+        count = fingerprintInodes(f, inodes, count, 0);
+        forEachRun(f, inodes, count, bySample, refineSampleRun);
+    }
+    free(inodes);
+}
+
+/*
+ ******************************************************************************
+ *                            Dup Finder Routines
+ ******************************************************************************
+*/
+
+/* Returns a new finder with the given options (onGroup is required) */
+DupFinder *newDupFinder (const DupOptions *options) {
+    DupFinder *f = calloc(1, sizeof(DupFinder));
+    assert(f != NULL && options != NULL && options->onGroup != NULL);
+
+    f->options = *options;
+    f->options.traversal = (options->traversal != NULL) ? options->traversal : &dupWalkerTraversal;
+    f->options.io = (options->io != NULL) ? options->io : &dupPreadIo;
+    f->options.hasher = (options->hasher != NULL) ? options->hasher : &dupFingerprintHasher;
+    f->options.threads = (options->threads > 0) ? options->threads : 1;
+    f->options.blockSize = (options->blockSize > 0) ? options->blockSize : DEFAULT_BLOCK_SIZE;
+
+    f->buffers[0] = malloc(f->options.blockSize);
+    f->buffers[1] = malloc(f->options.blockSize);
+    f->hashState = malloc(f->options.hasher->stateSize);
+    assert(f->buffers[0] != NULL && f->buffers[1] != NULL && f->hashState != NULL);
+    pthread_mutex_init(&f->lock, NULL);
+    return f;
+}
+
+/* Adds a file (of the given metadata) to the run in progress. Thread-safe */
+void addDupFile (DupFinder *finder, const char *path, const struct stat *statBuffer) {
+    DupEntry *e;
+    if (!S_ISREG(statBuffer->st_mode)) {
+        return;
+    }
+    pthread_mutex_lock(&finder->lock);
+    if (finder->entryCount == finder->entryCapacity) {
+        finder->entryCapacity = (finder->entryCapacity == 0) ? DEFAULT_ENTRY_COUNT :
+            finder->entryCapacity * 2;
+        finder->entries = realloc(finder->entries, finder->entryCapacity * sizeof(DupEntry));
+        assert(finder->entries != NULL);
+    }
+    e = finder->entries + finder->entryCount++;
+    *e = (DupEntry){.path = arenaString(&finder->paths, path), .size = statBuffer->st_size,
+        .dev = statBuffer->st_dev, .ino = statBuffer->st_ino, .mtime = statBuffer->st_mtim,
+        .id = finder->entryCount - 1};
+    countStat(STAT_FILES, 1);
+    pthread_mutex_unlock(&finder->lock);
+}
+
+/* Finds the duplicate files below root, passing each group to onGroup as
+ * soon as its size class is resolved. Returns the number of groups passed,
+ * or -1 if root can't be walked.
+*/
+int runDupFinder (DupFinder *finder, const char *root) {
+    const DupTraversal *traversal = finder->options.traversal;
+    int j, result, stage = enterRunStage(finder, STAGE_SCAN);
+
+    finder->groupCount = finder->stopped = 0;
+    if (traversal->walk(traversal->state, finder, root) == -1) {
+        result = -1;
+    } else {
+        enterRunStage(finder, STAGE_OTHER);
+
+        // Resolve sizes in turn. Entries of a size are ordered by inode.
+        qsort(finder->entries, finder->entryCount, sizeof(DupEntry), bySizeInode);
+        for (int i = 0; i < finder->entryCount && !finder->stopped; i = j) {
+            for (j = i + 1; j < finder->entryCount && finder->entries[j].size == finder->entries[i].size; j++)
+                ;
+            if (j - i > 1) {
+                resolveSize(finder, finder->entries + i, j - i);
+            }
+        }
+        result = finder->groupCount;
+    }
+
+    // Forget the run's files, keeping the storage for the next.
+    finder->entryCount = 0;
+    freeArena(&finder->paths);
+    enterRunStage(finder, stage);
+    return result;
+}
+
+/* Free's a finder. Its cache (if any) stays open */
+void freeDupFinder (DupFinder *finder) {
+    if (finder == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&finder->lock);
+    free(finder->entries);
+    free(finder->buffers[0]);
+    free(finder->buffers[1]);
+    free(finder->hashState);
+    free(finder->group);
+    freeArena(&finder->paths);
+    free(finder);
+}
@@ -0,0 +1,153 @@
+#if !defined(DUPFIND_H)
+#define DUPFIND_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "fingerprint.h"
+#include "cache.h"
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* A duplicate finder: Its options and the files of the run in progress.
+ * - The library is a separate implementation of the sample, digest and
+ *   verify passes: duplicates keeps its own (see duplicates.c), and changes
+ *   to either have to be made to both.
+*/
+typedef struct DupFinder DupFinder;
+
+/* A file of a duplicate group. Hard links are listed once per path */
+typedef struct {
+    const char *path;
+    dev_t dev;
+    ino_t ino;
+    int64_t mtimeSec, mtimeNsec;
+} DupFile;
+
+/* A group of files of equal content. Valid only during the group callback.
+ * Inodes are in the order their first path was added, each followed by its
+ * further paths (hard links) in order added.
+*/
+typedef struct {
+    off_t size;
+    int count;
+    const DupFile *files;
+} DupGroup;
+
+/* Traversal backend: Walks the tree at root, passing every file found to
+ * addDupFile (with metadata following links). Returns -1 if root can't be
+ * walked.
+*/
+typedef struct {
+    int (*walk)(void *state, DupFinder *finder, const char *root);
+    void *state;
+} DupTraversal;
+
+/* I/O backend: Opens a file for reading (returning a handle, or -1), reads
+ * up to n bytes at an offset (returning the bytes read, zero at end of file,
+ * or -1), and closes it.
+*/
+typedef struct {
+    int (*open)(void *state, const char *path);
+    ssize_t (*read)(void *state, int handle, void *buffer, size_t n, off_t offset);
+    void (*close)(void *state, int handle);
+    void *state;
+} DupIo;
+
+/* Hash backend: A streaming 128-bit hash whose state is stateSize bytes */
+typedef struct {
+    size_t stateSize;
+    void (*init)(void *hashState);
+    void (*update)(void *hashState, const void *data, size_t n);
+    Fingerprint (*final)(const void *hashState);
+} DupHasher;
+
+/* Options of a finder. Zeroed fields take their defaults */
+typedef struct {
+
+    // Backends. Default to dupWalkerTraversal, dupPreadIo and dupFingerprintHasher.
+    const DupTraversal *traversal;
+    const DupIo *io;
+    const DupHasher *hasher;
+
+    // Walker threads of dupWalkerTraversal (one by default).
+    int threads;
+
+    // Cache to reuse and store fingerprints in, or NULL. Only consulted with
+    // dupFingerprintHasher, whose fingerprints it holds. May be shared between
+    // concurrent finders.
+    Cache *cache;
+
+    // Bytes per read (DEFAULT_BLOCK_SIZE by default).
+    size_t blockSize;
+
+    // Nonzero if files of equal fingerprints should be compared byte by byte.
+    int verify;
+
+    // Called with arg for each group as soon as it is known. A nonzero return
+    // stops the run.
+    int (*onGroup)(void *arg, const DupGroup *group);
+
+    // Called with arg for each file that can't be read. Printed if NULL.
+    void (*onError)(void *arg, const char *path, int errnum);
+
+    // Called with arg as the run enters a stage (STAGE_* of stats.h), to return
+    // the stage it left. Optional; called from the thread running the finder.
+    // enterStage of stats.h fits, but its stage is the process's: Only one
+    // finder running at a time should use it, or the stage times blur.
+    int (*onStage)(void *arg, int stage);
+    void *arg;
+} DupOptions;
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* Built-in backends: The parallel walker (walker.c), pread, and fingerprint.c */
+extern const DupTraversal dupWalkerTraversal;
+extern const DupIo dupPreadIo;
+extern const DupHasher dupFingerprintHasher;
+
+/*
+ ******************************************************************************
+ *                            Dup Finder Routines
+ ******************************************************************************
+*/
+
+/* Returns a new finder with the given options (onGroup is required).
+ * - A finder's files, buffers and groups are its own: Finders may run
+ *   concurrently in as many threads, though each finder runs in one at a time.
+ * - Process-wide, shared by all finders: The statistics (stats.h, counting
+ *   the reads of all), the throttle (throttle.h, limiting all reads together)
+ *   and the fallback from statx to stat (meta.c). The block size is the
+ *   finder's own; setBlockSize of compare.h doesn't apply.
+*/
+DupFinder *newDupFinder (const DupOptions *options);
+
+/* Adds a file (of the given metadata) to the run in progress. Files other
+ * than regular files are ignored. For traversal backends; thread-safe.
+*/
+void addDupFile (DupFinder *finder, const char *path, const struct stat *statBuffer);
+
+/* Finds the duplicate files below root, passing each group to onGroup as
+ * soon as its size class is resolved.
+ * - Files sharing size and an inode are grouped without reading them.
+ * - Otherwise groups are narrowed by head and tail samples, then by full
+ *   fingerprints (and content, if verifying).
+ * - Returns the number of groups passed, or -1 if root can't be walked.
+*/
+int runDupFinder (DupFinder *finder, const char *root);
+
+/* Free's a finder. Its cache (if any) stays open */
+void freeDupFinder (DupFinder *finder);
+
+#endif
@@ -1,13 +1,38 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/dir.h>
 #include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <dirent.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include "compare.h"
+#include "fingerprint.h"
+#include "walker.h"
+#include "cache.h"
+#include "dirtree.h"
+#include "arena.h"
+#include "uring.h"
+#include "external.h"
+#include "extent.h"
+#include "watch.h"
+#include "dedupe.h"
+#include "checkpoint.h"
+#include "shard.h"
+#include "stats.h"
+#include "chunk.h"
+#include "meta.h"
+#include "throttle.h"
 
 /*
  ******************************************************************************
@@ -23,25 +48,194 @@
 */
 
 #define DEFAULT_TBL_SIZE            32
+#define DEFAULT_BKT_SIZE            4
+
+// Descriptors kept free when opening a whole group at once.
+#define FD_RESERVE                  64
 
 #define MAX(a,b)            ((a) > (b) ? (a) : (b))
+#define MIN(a,b)            ((a) < (b) ? (a) : (b))
+
+/* Fibonacci hashing multiplier (2^64 / golden ratio) */
+#define HASH_MULTIPLIER             0x9E3779B97F4A7C15ULL
+
+// Chunks held by more files than this count toward savings, but not pairs
+// (their bytes are reported apart).
+#define CHUNK_MAX_SHARERS           64
+
+// File entry states: Fingerprints already known, or the file can't be read.
+#define HAVE_SAMPLE                 1
+#define HAVE_DIGEST                 2
+#define UNREADABLE                  4
 
 /* Directory Entry: Filename and inode */
 typedef struct {
     char *fileName;
 } DirEntry;
 
-/* File Table Entry: Filename, size, and time modified */
+/* File Table Entry: Filename, size, identity, tabulation order, fingerprints,
+ * and state. The fileName is relative to directory node 'dir'. Merged entries
+ * also keep the shard they came from, and their verified class in it.
+*/
 typedef struct {
     long size;
-    char *fileName;
+    int id;
+    int dir;
+    const char *fileName;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    Fingerprint sample, digest;
+    unsigned char state;
+    unsigned short shard;
+    int class;
 } FileEntry;
 
-/* File Table */
-FileEntry **fileTable;
+/* Placed Entry: A file entry and where its first extent lies on disk */
+typedef struct {
+    dev_t dev;
+    int known;
+    uint64_t offset;
+    FileEntry *entry;
+} PlacedEntry;
+
+/* Sample Group: A run of entries whose full fingerprints are yet to be read */
+typedef struct {
+    FileEntry **entries;
+    int count;
+} SampleGroup;
+
+/* Chunk: A distinct chunk, the number of files holding it, and its last
+ * posting (-1 if none). Empty if length is zero.
+*/
+typedef struct {
+    Fingerprint fingerprint;
+    uint32_t length;
+    int files, last;
+} Chunk;
+
+/* Posting: A chunked file holding a chunk, how many times it does, and the
+ * chunk's previous posting.
+*/
+typedef struct {
+    int file, count, previous;
+} Posting;
+
+/* Shared Pair: Two chunked files (a < b), and the bytes of the chunks they
+ * share. Empty if bytes is zero.
+*/
+typedef struct {
+    int a, b;
+    long long bytes;
+} SharedPair;
+
+/* Classed Entry: A file entry and the content class it was partitioned into */
+typedef struct {
+    int class;
+    FileEntry *entry;
+} ClassedEntry;
+
+/* Size Bucket: All tabulated files sharing a size. Empty if count is zero */
+typedef struct {
+    long size;
+    int count, capacity;
+    FileEntry **entries;
+} SizeBucket;
+
+/* File Table: Open-addressed (linear probing) on file size */
+SizeBucket *fileTable;
+
+/* Number of tabulated files, number of occupied buckets, and table size */
+int tp, bucketCount, tableSize;
+
+/* Storage for file entries */
+Arena entryArena;
+
+/* Nonzero if diagnostics (e.g. offsets of differences) should be printed */
+int verbose;
+
+/* Nonzero if fingerprint matches should be verified byte-by-byte */
+int verify;
+
+/* Number of directory walker threads. Scans sequentially if one */
+int threads = 1;
+
+/* Nonzero if the tree should be scanned with descriptor-relative calls */
+int relative;
+
+/* Nonzero if fingerprints should be read through io_uring (if available) */
+int useUring;
+
+/* Fingerprint cache, or NULL if fingerprints aren't cached */
+Cache *cache;
 
-/* File Table pointer and size */
-int tp, tableSize;
+/* Nonzero if sample groups should be split by lockstep comparison */
+int kway;
+
+/* Nonzero if files should be fingerprinted in order of their disk offset */
+int physicalOrder;
+
+/* Physical order: Sample groups deferred to the full fingerprint stage */
+static SampleGroup *deferred;
+static int deferredCount, deferredCapacity, deferring;
+
+/* Memory budget in bytes for external-memory mode. In-memory if zero */
+size_t memoryBudget;
+
+/* External-memory mode: Sorter of scanned files by size */
+Sorter sizeSorter;
+
+/* Stream duplicates are reported to */
+FILE *report;
+
+/* Nonzero if duplicates should be classified for a shard index, not reported */
+int sharding;
+
+/* Nonzero if partial duplicates should be found by content-defined chunks */
+int chunking;
+
+/* Chunking: Index of distinct chunks (open-addressed), and their postings */
+static Chunk *chunkTable;
+static int chunkTableSize, chunkCount;
+static Posting *postings;
+static int postingCount, postingCapacity;
+
+/* Chunking: Pairs of files sharing chunks (open-addressed on the pair) */
+static SharedPair *pairTable;
+static int pairTableSize, pairCount;
+
+/* Chunking: Bytes chunked, bytes in distinct chunks, and distinct chunks
+ * (and their bytes) held by too many files to credit to pairs.
+*/
+static long long chunkedBytes, distinctBytes, commonBytes;
+static int commonCount;
+
+/* Ways (DEDUPE_REFLINK, DEDUPE_LINK) to replace duplicates by. None if zero */
+int dedupeMethods;
+
+/* Number of duplicates replaced, and the bytes they took */
+static int dedupedCount;
+static long long dedupedBytes;
+
+/* Daemon mode: Index of tracked entries, open-addressed on directory and name */
+static FileEntry **entryIndex;
+static int entryIndexSize, entryIndexCount;
+
+/* Daemon mode: Entries freed by untracking, for reuse */
+static FileEntry **spareEntries;
+static int spareCount, spareCapacity;
+
+/* Daemon mode: Sizes of buckets changed since they were last refined */
+static long *dirtySizes;
+static int dirtyCount, dirtyCapacity;
+
+/* Daemon mode: Root of the tracked tree, and nonzero once asked to stop */
+static const char *daemonRoot;
+static volatile sig_atomic_t stopping;
+
+/* Checkpointed scan: Directories found but not yet scanned (a stack) */
+static char **frontier;
+static int frontierCount, frontierCapacity;
 
 /*
  ******************************************************************************
@@ -67,20 +261,32 @@ void resizeBuffer (void **bp, int *size_p, int toSize) {
     *size_p = toSize;
 }
 
-/* Allocates a FileEntry along with fileName attribute. */
-FileEntry *newFileEntry (const char *fileName, long size) {
-    FileEntry *fp = malloc(sizeof(FileEntry));
-    char *sp = calloc(strlen(fileName) + 1, sizeof(char));
-    assert(fp != NULL && sp != NULL);
-    fp->fileName = strcpy(sp, fileName);
-    fp->size = size;
+/* Allocates a FileEntry along with fileName attribute in the entry arena
+ * (reusing a spare entry if any).
+*/
+FileEntry *newFileEntry (int dir, const char *fileName, const struct stat *statBuffer, int id) {
+    FileEntry *fp = (spareCount > 0) ? spareEntries[--spareCount] :
+        arenaAlloc(&entryArena, sizeof(FileEntry));
+    *fp = (FileEntry){
+        .size = statBuffer->st_size,
+        .id = id,
+        .dir = dir,
+        .fileName = internName(fileName),
+        .dev = statBuffer->st_dev,
+        .ino = statBuffer->st_ino,
+        .mtime = statBuffer->st_mtim
+    };
     return fp;
 }
 
-/* Free's a FileEntry. Both entry and attribute should be allocated. */
-void freeFileEntry (FileEntry *fp) {
-    free(fp->fileName);
-    free(fp);
+/* Returns the full path of an entry, built in one of two reusable buffers
+ * (slot 0 or 1). The path is valid until the slot is reused.
+*/
+const char *entryPath (const FileEntry *fp, int slot) {
+    static char *buffers[2];
+    static int sizes[2];
+    assert(slot == 0 || slot == 1);
+    return buildPath(fp->dir, fp->fileName, buffers + slot, sizes + slot);
 }
 
 /*
@@ -96,18 +302,36 @@ int openFile (const char *fileName) {
         fprintf(stderr, "Error: Couldn't open file \"%s\"!\n", fileName);
         exit(EXIT_FAILURE);
     }
+    adviseOpen(fd);
+    return fd;
+}
+
+/* Opens file and returns file-descriptor. Prints a message and returns -1 on error */
+int tryOpenFile (const char *fileName) {
+    int fd;
+    if ((fd = open(fileName, O_RDONLY, 0)) == -1) {
+        fprintf(stderr, "Error: Couldn't open file \"%s\"! -Ignoring-\n", fileName);
+    } else {
+        adviseOpen(fd);
+    }
     return fd;
 }
 
-/* Returns nonzero if a difference exists between two given files */
-int diff (int fd1, int fd2) {
-    int r1 = 0, r2= 0;
-    char c1 = 0, c2 = 0;
-    do {
-        r1 = read(fd1, &c1, 1);
-        r2 = read(fd2, &c2, 1);
-    } while (r1 == 1 && r2 == 1 && c1 == c2);
-    return c1 != c2;
+/* Closes a file that was read, dropping it from the page cache if the I/O
+ * policy says so.
+*/
+void closeFile (int fd) {
+    adviseConsumed(fd, 0, 0);
+    close(fd);
+}
+
+/* Returns the number of files that may be opened at once, less a reserve */
+int maxOpenFiles (void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur == RLIM_INFINITY) {
+        return 1024 - FD_RESERVE;
+    }
+    return (limit.rlim_cur > FD_RESERVE) ? (int)(limit.rlim_cur - FD_RESERVE) : 1;
 }
 
 /*
@@ -116,15 +340,38 @@ int diff (int fd1, int fd2) {
  ******************************************************************************
 */
 
-/* Reallocates the file table to the given size. Initializes if required */
+/* Returns the home slot of a size in a table of given (power of two) size */
+static int hashSize (long size, int toSize) {
+    unsigned long long h = (unsigned long long)size * HASH_MULTIPLIER;
+    return (int)(h >> 32) & (toSize - 1);
+}
+
+/* Returns the slot holding the given size, or the empty slot it belongs in */
+static int probeFileTable (SizeBucket *table, int size, long fileSize) {
+    int i = hashSize(fileSize, size);
+    while (table[i].count != 0 && table[i].size != fileSize) {
+        i = (i + 1) & (size - 1);
+    }
+    return i;
+}
+
+/* Rehashes the file table to the given size (power of two). Initializes if required */
 void resizeFileTable (int *size_p, int toSize) {
+    SizeBucket *table;
     assert(size_p != NULL); 
-    if (fileTable == NULL) {
-        fileTable = calloc(toSize, sizeof(FileEntry *));
-    } else {
-        fileTable = realloc(fileTable, toSize * sizeof(FileEntry *));
+
+    table = calloc(toSize, sizeof(SizeBucket));
+    assert(table != NULL);
+
+    // Move all occupied buckets to their slot in the new table.
+    for (int i = 0; fileTable != NULL && i < *size_p; i++) {
+        if (fileTable[i].count != 0) {
+            table[probeFileTable(table, toSize, fileTable[i].size)] = fileTable[i];
+        }
     }
-    assert(fileTable != NULL);
+
+    free(fileTable);
+    fileTable = table;
     *size_p = toSize;
 }
 
@@ -133,150 +380,2073 @@ void freeFileTable (void) {
     if (fileTable == NULL) {
         return;
     }
-    for (int i = 0; i < tp; i++) {
-        freeFileEntry(fileTable[i]);
+    for (int i = 0; i < tableSize; i++) {
+        free(fileTable[i].entries);
     }
     free(fileTable);
+    free(spareEntries);
+    freeArena(&entryArena);
+    fileTable = NULL;
+    spareEntries = NULL;
+    tp = bucketCount = tableSize = spareCount = spareCapacity = 0;
 }
 
-/* Returns a pointer to a file if a duplicate exists in the file table */
-FileEntry *duplicate (const char *fileName, long fileSize) {
-    int fd1 = -1, fd2 = -1;
-    assert(fileName != NULL);
+/* Returns the bucket of files with the given size, or NULL if none exist */
+SizeBucket *lookupFileTable (long fileSize) {
+    SizeBucket *bucket;
+    if (fileTable == NULL) {
+        return NULL;
+    }
+    bucket = fileTable + probeFileTable(fileTable, tableSize, fileSize);
+    return (bucket->count == 0) ? NULL : bucket;
+}
 
-    for (int i = 0; i < tp; i++) {
-        if (fileTable[i]->size != fileSize) {
-            continue;
-        }
-        fd1 = openFile(fileName);
-        fd2 = openFile(fileTable[i]->fileName);
-        
-        if (diff(fd1, fd2)) {
-            close(fd1); close(fd2);
-            continue;
-        }
-        close(fd1); close(fd2);
-        return fileTable[i];
+/* Splits a path into directory node and name, and allocates its FileEntry */
+FileEntry *newPathEntry (const char *path, const struct stat *statBuffer, int id) {
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        return newFileEntry(NO_PARENT, path, statBuffer, id);
     }
-    return NULL;
+    return newFileEntry(internDirectory(path, slash - path), slash + 1, statBuffer, id);
 }
 
-/* Tabulates a given file in the file table */
-void tabulate (const char *fileName, long fileSize) {
+/* Tabulates a given file (relative to directory node dir) in the file table.
+ * Returns its entry.
+*/
+FileEntry *tabulate (int dir, const char *fileName, const struct stat *statBuffer) {
+    long fileSize = statBuffer->st_size;
+    SizeBucket *bucket;
 
-    // Reallocate the table if necessary.
-    if (tp >= tableSize) {
+    // Rehash the table if it would exceed half load.
+    if (2 * (bucketCount + 1) > tableSize) {
         resizeFileTable(&tableSize, MAX(DEFAULT_TBL_SIZE, tableSize * 2));
     }
+
+    // Locate the size bucket, claiming an empty slot if needed.
+    bucket = fileTable + probeFileTable(fileTable, tableSize, fileSize);
+    if (bucket->count == 0) {
+        bucket->size = fileSize;
+        bucketCount++;
+    }
+
+    // Grow the bucket if necessary.
+    if (bucket->count >= bucket->capacity) {
+        bucket->capacity = MAX(DEFAULT_BKT_SIZE, bucket->capacity * 2);
+        bucket->entries = realloc(bucket->entries, bucket->capacity * sizeof(FileEntry *));
+        assert(bucket->entries != NULL);
+    }
     
-    fileTable[tp++] = newFileEntry(fileName, fileSize);
+    bucket->entries[bucket->count++] = newFileEntry(dir, fileName, statBuffer, tp);
+    countStat(STAT_FILES, 1);
+    tp++;
+    return bucket->entries[bucket->count - 1];
+}
+
+/* Empties the bucket in slot i, reinserting the rest of its probe cluster so
+ * that lookups don't stop at the gap.
+*/
+static void removeBucket (int i) {
+    SizeBucket moved;
+    free(fileTable[i].entries);
+    fileTable[i] = (SizeBucket){0};
+    bucketCount--;
+    while (fileTable[i = (i + 1) & (tableSize - 1)].count != 0) {
+        moved = fileTable[i];
+        fileTable[i] = (SizeBucket){0};
+        fileTable[probeFileTable(fileTable, tableSize, moved.size)] = moved;
+    }
+}
+
+/* Removes a tabulated entry from the file table. The entry is kept for reuse */
+void untabulate (FileEntry *fp) {
+    SizeBucket *bucket = lookupFileTable(fp->size);
+    int i = 0;
+    assert(bucket != NULL);
+
+    while (bucket->entries[i] != fp) {
+        i++;
+    }
+    bucket->entries[i] = bucket->entries[--bucket->count];
+    if (bucket->count == 0) {
+        removeBucket(bucket - fileTable);
+    }
+
+    if (spareCount >= spareCapacity) {
+        spareCapacity = MAX(DEFAULT_BKT_SIZE, spareCapacity * 2);
+        spareEntries = realloc(spareEntries, spareCapacity * sizeof(FileEntry *));
+        assert(spareEntries != NULL);
+    }
+    spareEntries[spareCount++] = fp;
 }
 
 /*
  ******************************************************************************
- *                          Directory Scanning Routines
+ *                         Duplicate Detection Routines
  ******************************************************************************
 */
 
-/* Returns pointers to consecutive files in a directory stream */
-const char *nextDirectoryFile (DIR *directory) {
-    struct dirent *entryBuffer;
-    static const char *fileName;
+/* Orders file entries by tabulation order */
+static int byId (const void *a, const void *b) {
+    const FileEntry *x = *(FileEntry * const *)a, *y = *(FileEntry * const *)b;
+    return x->id - y->id;
+}
 
-    // Write entries to buffer as long as more exist.
-    while ((entryBuffer = readdir(directory)) != NULL) {
+/* Orders file entries by sample fingerprint */
+static int bySample (const void *a, const void *b) {
+    const FileEntry *x = *(FileEntry * const *)a, *y = *(FileEntry * const *)b;
+    return compareFingerprints(x->sample, y->sample);
+}
 
-        // Ignore unused entries (inode is zero).
-        if (entryBuffer->d_ino == 0) {
-            continue;
+/* Orders file entries by content fingerprint */
+static int byDigest (const void *a, const void *b) {
+    const FileEntry *x = *(FileEntry * const *)a, *y = *(FileEntry * const *)b;
+    return compareFingerprints(x->digest, y->digest);
+}
+
+/* Orders file entries by device and inode */
+static int byInode (const void *a, const void *b) {
+    const FileEntry *x = *(FileEntry * const *)a, *y = *(FileEntry * const *)b;
+    if (x->dev != y->dev) {
+        return (x->dev < y->dev) ? -1 : 1;
+    }
+    return (x->ino < y->ino) ? -1 : (x->ino > y->ino);
+}
+
+/* Swaps two file entry pointers */
+static void swapEntries (FileEntry **a, FileEntry **b) {
+    FileEntry *t = *a;
+    *a = *b;
+    *b = t;
+}
+
+/* Returns the cache key of a file entry */
+static CacheKey entryKey (const FileEntry *fp) {
+    return (CacheKey){.dev = fp->dev, .ino = fp->ino, .size = fp->size,
+        .mtimeSec = fp->mtime.tv_sec, .mtimeNsec = fp->mtime.tv_nsec};
+}
+
+/* Fills in an entry's fingerprint (sample or full) from the cache.
+ * Returns nonzero on a hit.
+*/
+static int cachedFingerprint (FileEntry *fp, int full) {
+    Fingerprint sample, digest;
+    int flags;
+    if (fp->state & (full ? HAVE_DIGEST : HAVE_SAMPLE)) {
+        return 1;
+    }
+    if ((flags = lookupCache(cache, entryKey(fp), &sample, &digest)) & (full ? CACHE_DIGEST : CACHE_SAMPLE)) {
+        fp->sample = sample;
+        fp->digest = digest;
+        fp->state |= HAVE_SAMPLE | ((flags & CACHE_DIGEST) ? HAVE_DIGEST : 0);
+        return 1;
+    }
+    return 0;
+}
+
+/* Caches an entry's freshly computed fingerprint (sample or full). Files
+ * sampled whole have their full fingerprint too.
+*/
+static void storeFingerprint (FileEntry *fp, int full) {
+    int flags = full ? CACHE_DIGEST : CACHE_SAMPLE;
+    if (!full && fp->size <= 2 * SAMPLE_SIZE) {
+        fp->digest = fp->sample;
+        flags |= CACHE_DIGEST;
+    }
+    fp->state |= ((flags & CACHE_SAMPLE) ? HAVE_SAMPLE : 0) | ((flags & CACHE_DIGEST) ? HAVE_DIGEST : 0);
+    countStat(full ? STAT_DIGESTS : STAT_SAMPLES, 1);
+    storeCache(cache, entryKey(fp), flags, fp->sample, fp->digest);
+}
+
+/* Opens an entry and describes the extents its fingerprint (sample or full)
+ * covers as a read job. The job's fd is -1 if the entry can't be opened.
+*/
+static ReadJob fingerprintJob (FileEntry *fp, int full) {
+    ReadJob job = {.fd = tryOpenFile(entryPath(fp, 0)), .extentCount = 1, .length = {fp->size}};
+    if (!full && fp->size > 2 * SAMPLE_SIZE) {
+        job.extentCount = 2;
+        job.length[0] = job.length[1] = SAMPLE_SIZE;
+        job.offset[1] = fp->size - SAMPLE_SIZE;
+    }
+    return job;
+}
+
+/* Fingerprints an open file in full with blocking reads and closes it.
+ * Returns nonzero on success.
+*/
+static int fingerprintBlocking (FileEntry *fp, int fd) {
+    int r;
+    adviseDirect(fd);
+    r = fingerprintFile(fd, &fp->digest);
+    closeFile(fd);
+    if (r == -1) {
+        fprintf(stderr, "Error: Can't read file %s! -Ignoring-\n", entryPath(fp, 0));
+        fp->state |= UNREADABLE;
+        return 0;
+    }
+    storeFingerprint(fp, 1);
+    return 1;
+}
+
+/* As fingerprintEntries, but with reads of a batch of files kept in flight
+ * together through io_uring. Sparse files (so that their holes aren't read)
+ * and files for direct I/O are fingerprinted in full with blocking reads.
+*/
+static int fingerprintEntriesBatched (FileEntry **entries, int n, int full) {
+    ReadJob jobs[URING_BATCH_SIZE];
+    int batch[URING_BATCH_SIZE], count, end, m = 0;
+    char *ok = malloc(n);
+    assert(ok != NULL);
+
+    for (int i = 0; i < n; i = end) {
+
+        // Gather a batch of readable entries missing from the cache.
+        for (count = 0, end = i; end < n && count < URING_BATCH_SIZE; end++) {
+            if (entries[end]->state & UNREADABLE) {
+                ok[end] = 0;
+            } else if (!(ok[end] = cachedFingerprint(entries[end], full))) {
+                jobs[count] = fingerprintJob(entries[end], full);
+                if (jobs[count].fd == -1) {
+                    entries[end]->state |= UNREADABLE;
+                    continue;
+                }
+                if (full && (getIoPolicy() == IO_DIRECT || sparseFile(jobs[count].fd))) {
+                    ok[end] = fingerprintBlocking(entries[end], jobs[count].fd);
+                    continue;
+                }
+                batch[count++] = end;
+            }
+        }
+        uringFingerprint(jobs, count);
+
+        for (int k = 0; k < count; k++) {
+            FileEntry *fp = entries[batch[k]];
+            closeFile(jobs[k].fd);
+            if (jobs[k].result == -1) {
+                fprintf(stderr, "Error: Can't read file %s! -Ignoring-\n", entryPath(fp, 0));
+                fp->state |= UNREADABLE;
+                continue;
+            }
+            *(full ? &fp->digest : &fp->sample) = jobs[k].fp;
+            storeFingerprint(fp, full);
+            ok[batch[k]] = 1;
         }
-        fileName = entryBuffer->d_name;
-        return fileName;
     }
 
-    return NULL;
+    // Move unreadable entries to the end.
+    for (int i = 0; i < n; i++) {
+        if (ok[i]) {
+            swapEntries(entries + m++, entries + i);
+        }
+    }
+    free(ok);
+    return m;
 }
 
-/* Applies function 'f' to all valid files within given directory */
-void scanDirectory (const char *directoryName, void (*f)(const char *)) {
-    char *pathName = NULL;
-    const char *fileName = NULL;
-    int pathSize = 0;
-    DIR *directory;
+/* Fingerprints entries (sample or full), consulting the cache first.
+ * Unreadable entries (also those found so before) are moved to the end of
+ * the array and excluded. Returns the number of remaining entries.
+*/
+static int fingerprintEntries (FileEntry **entries, int n, int full) {
+    int m = 0, fd, r, stage = enterStage(full ? STAGE_DIGEST : STAGE_SAMPLE);
+    if (uringAvailable()) {
+        m = fingerprintEntriesBatched(entries, n, full);
+        enterStage(stage);
+        return m;
+    }
+    for (int i = 0; i < n; i++) {
+        FileEntry *fp = entries[i];
+        if (fp->state & UNREADABLE) {
+            continue;
+        }
 
-    // Open the directory.
-    if ((directory = opendir(directoryName)) == NULL) {
-        fprintf(stderr, "Error: Can't access directory %s! -Ignoring-\n", directoryName);
-        return;
+        // Use cached fingerprints of an unchanged file.
+        if (cachedFingerprint(fp, full)) {
+            swapEntries(entries + m++, entries + i);
+            continue;
+        }
+
+        if ((fd = tryOpenFile(entryPath(fp, 0))) == -1) {
+            fp->state |= UNREADABLE;
+            continue;
+        }
+        if (full) {
+            adviseDirect(fd);
+            r = fingerprintFile(fd, &fp->digest);
+        } else {
+            r = fingerprintSample(fd, fp->size, &fp->sample);
+        }
+        closeFile(fd);
+        if (r == -1) {
+            fprintf(stderr, "Error: Can't read file %s! -Ignoring-\n", entryPath(fp, 0));
+            fp->state |= UNREADABLE;
+            continue;
+        }
+        storeFingerprint(fp, full);
+        swapEntries(entries + m++, entries + i);
     }
+    enterStage(stage);
+    return m;
+}
 
-    // Scan directory contents.
-    while ((fileName = nextDirectoryFile(directory)) != NULL) {
+/* Orders placed entries by device, then disk offset (unknown last, by inode).
+ * Links to one inode are ordered by tabulation order.
+*/
+static int byPlacement (const void *a, const void *b) {
+    const PlacedEntry *x = a, *y = b;
+    if (x->dev != y->dev) {
+        return (x->dev < y->dev) ? -1 : 1;
+    }
+    if (x->known != y->known) {
+        return y->known - x->known;
+    }
+    if (x->offset != y->offset) {
+        return (x->offset < y->offset) ? -1 : 1;
+    }
+    if (x->entry->ino != y->entry->ino) {
+        return (x->entry->ino < y->entry->ino) ? -1 : 1;
+    }
+    return x->entry->id - y->entry->id;
+}
 
-        // Ignore self, parent.
-        if (strcmp(fileName, ".") == 0 || strcmp(fileName, "..") == 0) {
+/* Fingerprints entries (sample or full) in order of their first extent on
+ * disk, so that they are read in a single sweep. Results stay in the entries
+ * for fingerprintEntries to pick up. Only the first link of an inode is read.
+*/
+static void scheduleFingerprints (FileEntry **entries, int n, int full) {
+    PlacedEntry *placed = malloc(n * sizeof(PlacedEntry));
+    FileEntry **order = malloc(n * sizeof(FileEntry *));
+    int m = 0, k = 0, fd, stage = enterStage(full ? STAGE_DIGEST : STAGE_SAMPLE);
+    assert(placed != NULL && order != NULL);
+
+    // Locate the first extent of each entry not already fingerprinted.
+    for (int i = 0; i < n; i++) {
+        FileEntry *fp = entries[i];
+        if ((fp->state & UNREADABLE) || cachedFingerprint(fp, full)) {
             continue;
         }
+        placed[m] = (PlacedEntry){.dev = fp->dev, .entry = fp};
+        if ((fd = open(entryPath(fp, 0), O_RDONLY)) != -1) {
+            placed[m].known = (physicalOffset(fd, &placed[m].offset) == 0);
+            close(fd);
+        }
+        m++;
+    }
 
-        // Compute new length, resize buffer if required.
-        resizeBuffer((void **)&pathName, &pathSize, strlen(directoryName) + strlen(fileName) + 2);
+    // Read in disk order, skipping further links to an inode.
+    qsort(placed, m, sizeof(PlacedEntry), byPlacement);
+    for (int i = 0; i < m; i++) {
+        if (k == 0 || byInode(order + k - 1, &placed[i].entry) != 0) {
+            order[k++] = placed[i].entry;
+        }
+    }
+    fingerprintEntries(order, k, full);
 
-        // Write new path to buffer. Then scan the file.
-        sprintf(pathName, "%s/%s", directoryName, fileName);
-        (*f)(pathName);
+    free(placed);
+    free(order);
+    enterStage(stage);
+}
+
+/* Defers a sample group to the (scheduled) full fingerprint stage */
+static void deferGroup (FileEntry **entries, int n) {
+    if (deferredCount >= deferredCapacity) {
+        deferredCapacity = MAX(DEFAULT_BKT_SIZE, deferredCapacity * 2);
+        deferred = realloc(deferred, deferredCapacity * sizeof(SampleGroup));
+        assert(deferred != NULL);
     }
+    deferred[deferredCount++] = (SampleGroup){.entries = entries, .count = n};
+}
 
-    // Free memory.
-    free(pathName);
+/* Returns nonzero if two files have identical content. A file that can't be
+ * opened is marked unreadable, and differs.
+*/
+static int identical (FileEntry *a, FileEntry *b) {
+    int stage = enterStage(STAGE_COMPARE);
+    int fd1 = tryOpenFile(entryPath(a, 0)), fd2 = tryOpenFile(entryPath(b, 1)), d = 1;
+    off_t offset;
+    if (fd1 != -1 && fd2 != -1 && (d = diff(fd1, fd2, &offset)) && verbose) {
+        fprintf(stderr, "%s and %s differ at offset %lld.\n", entryPath(b, 1),
+            entryPath(a, 0), (long long)offset);
+    }
+    a->state |= (fd1 == -1) ? UNREADABLE : 0;
+    b->state |= (fd2 == -1) ? UNREADABLE : 0;
+    if (fd1 != -1) {
+        closeFile(fd1);
+    }
+    if (fd2 != -1) {
+        closeFile(fd2);
+    }
+    enterStage(stage);
+    return !d;
+}
 
-    // Close the directory.
-    closedir(directory);
+/* Returns the stat fields a file entry keeps */
+static struct stat entryStat (const FileEntry *fp) {
+    struct stat statBuffer;
+    memset(&statBuffer, 0, sizeof(statBuffer));
+    statBuffer.st_size = fp->size;
+    statBuffer.st_dev = fp->dev;
+    statBuffer.st_ino = fp->ino;
+    statBuffer.st_mtim = fp->mtime;
+    return statBuffer;
 }
 
-/*
- ******************************************************************************
- *                            File Scanning Routines
- ******************************************************************************
+/* Replaces a confirmed duplicate by a reflink or hard link of the original,
+ * if asked to, and reports how.
 */
+static void dedupeEntry (FileEntry *duplicate, FileEntry *original) {
+    struct stat expected = entryStat(duplicate), sourceExpected = entryStat(original);
+    int method;
+    if (dedupeMethods == 0 || duplicate->size == 0) {
+        return;
+    }
+    method = dedupeFile(entryPath(duplicate, 0), &expected, entryPath(original, 1),
+        &sourceExpected, dedupeMethods);
+    if (method == -1) {
+        fprintf(stderr, "Error: Can't deduplicate file %s! -Ignoring-\n", entryPath(duplicate, 0));
+        return;
+    }
+    fprintf(report, "%s is now a %s %s.\n", entryPath(duplicate, 0),
+        (method == DEDUPE_REFLINK) ? "reflink of" : "hard link to", entryPath(original, 1));
+    dedupedCount++;
+    dedupedBytes += duplicate->size;
+}
 
-/* Tabulates information about a file. If dir, dir is walked. */
-void scanFile (const char *fileName) {
-    struct stat statBuffer; // For use with stat()
-    FileEntry *fileEntry;   // For extraction of file-table entries.
+/* Returns nonzero if two entries of one shard were verified identical by it */
+static int sameClass (const FileEntry *a, const FileEntry *b) {
+    return a->class != 0 && a->class == b->class && a->shard == b->shard;
+}
 
-    // System call to obtain file info via stat.
-    if (stat(fileName, &statBuffer) == -1) {
-        fprintf(stderr, "Error: Can't access file %s! -Ignoring-\n", fileName);
+/* Reports an entry as a duplicate of another (replacing it if asked to). When
+ * sharding, the pair is instead put in one class if its content is verified.
+*/
+static void reportDuplicate (FileEntry *duplicate, FileEntry *original, int verified) {
+    if (sharding) {
+        if (verified) {
+            original->class = duplicate->class = original->id + 1;
+        }
         return;
     }
+    fprintf(report, "%s and %s are the same file.\n", entryPath(duplicate, 0),
+        entryPath(original, 1));
+    dedupeEntry(duplicate, original);
+}
 
-    // If directory, recursively apply scanFile to contents.
-    if (S_ISDIR(statBuffer.st_mode)) {
-        scanDirectory(fileName, scanFile);
-    } else {
-        int fileSize = statBuffer.st_size;
+/* Reports each entry of a group as a duplicate of the group's first entry.
+ * - Entries must be in tabulation order.
+ * - If verifying, entries differing from the first are split off and
+ *   reported as a group of their own. Entries a shard verified aren't reread.
+*/
+static void reportGroup (FileEntry **entries, int n) {
+    int m;
+    while (n > 1) {
+        for (int i = m = 1; i < n; i++) {
+            if (verify && !sameClass(entries[0], entries[i]) && !identical(entries[0], entries[i])) {
+                continue;
+            }
+            reportDuplicate(entries[i], entries[0], verify);
+            swapEntries(entries + m++, entries + i);
+        }
+
+        // Restore tabulation order of the remainder.
+        entries += m; n -= m;
+        qsort(entries, n, sizeof(FileEntry *), byId);
+    }
+}
 
-        // Print duplicate if file exists in table. Otherwise tabulate.
-        if ((fileEntry = duplicate(fileName, fileSize)) != NULL) {
-            fprintf(stdout, "%s and %s are the same file.\n", fileName, fileEntry->fileName);
-        }  else {
-            tabulate(fileName, fileSize);
+/* Applies 'f' to each run of at least two entries equal under 'order'.
+ * Runs are passed in tabulation order.
+*/
+static void forEachRun (FileEntry **entries, int n, int (*order)(const void *, const void *),
+    void (*f)(FileEntry **, int)) {
+    int j;
+    qsort(entries, n, sizeof(FileEntry *), order);
+    for (int i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && order(entries + i, entries + j) == 0; j++)
+            ;
+        if (j - i > 1) {
+            qsort(entries + i, j - i, sizeof(FileEntry *), byId);
+            f(entries + i, j - i);
         }
     }
 }
 
-/*
- ******************************************************************************
- *                                   Main
- ******************************************************************************
+/* Reports each entry of a group (in tabulation order) as a duplicate of the
+ * group's first entry, without verification. For groups of equal content.
+*/
+static void printGroup (FileEntry **entries, int n) {
+    for (int i = 1; i < n; i++) {
+        reportDuplicate(entries[i], entries[0], 1);
+    }
+}
+
+/* Orders classed entries by class, then tabulation order */
+static int byClass (const void *a, const void *b) {
+    const ClassedEntry *x = a, *y = b;
+    if (x->class != y->class) {
+        return x->class - y->class;
+    }
+    return x->entry->id - y->entry->id;
+}
+
+/* Splits a group of equal samples by reading all its files in lockstep,
+ * and reports the resulting classes. Returns -1 (having done nothing) if
+ * the group can't be opened at once, or is too large to partition within
+ * PARTITION_MEMORY.
 */
+static int partitionSampleGroup (FileEntry **entries, int n) {
+    int *fds, *classes, m = 0, j, stage;
+    ClassedEntry *opened;
+    if (n > maxOpenFiles() || n > MAX_PARTITION_FILES) {
+        return -1;
+    }
+    stage = enterStage(STAGE_COMPARE);
+    fds = malloc(n * sizeof(int));
+    classes = malloc(n * sizeof(int));
+    opened = malloc(n * sizeof(ClassedEntry));
+    assert(fds != NULL && classes != NULL && opened != NULL);
+
+    // Open what can be opened. Unopenable files are left out, as unreadable.
+    for (int i = 0; i < n; i++) {
+        if ((fds[m] = tryOpenFile(entryPath(entries[i], 0))) != -1) {
+            opened[m++].entry = entries[i];
+        } else {
+            entries[i]->state |= UNREADABLE;
+        }
+    }
+    partitionFiles(fds, m, classes);
+    for (int i = 0; i < m; i++) {
+        closeFile(fds[i]);
+        if ((opened[i].class = classes[i]) == -1) {
+            fprintf(stderr, "Error: Can't read file %s! -Ignoring-\n", entryPath(opened[i].entry, 0));
+            opened[i].entry->state |= UNREADABLE;
+        }
+    }
+
+    // Report each class of two or more, reusing the entry array for it.
+    qsort(opened, m, sizeof(ClassedEntry), byClass);
+    for (int i = 0; i < m; i = j) {
+        for (j = i + 1; j < m && opened[j].class == opened[i].class; j++) {
+            entries[j - i] = opened[j].entry;
+        }
+        entries[0] = opened[i].entry;
+        if (opened[i].class != -1 && j - i > 1) {
+            printGroup(entries, j - i);
+        }
+    }
 
-int main (int argc, const char *argv[]) {
-    char root[2] = ".";
+    free(fds);
+    free(classes);
+    free(opened);
+    enterStage(stage);
+    return 0;
+}
 
-    // Perform file-scanning routines.
-    scanFile(root);
+/* Splits a group of equal samples by full content fingerprint (or by
+ * lockstep comparison), and reports the results.
+*/
+static void refineSampleGroup (FileEntry **entries, int n) {
 
-    // Free file table.
-    freeFileTable();
+    // Small files were sampled whole, so they have their full fingerprint.
+    if (entries[0]->size > 2 * SAMPLE_SIZE) {
+        if (kway && partitionSampleGroup(entries, n) == 0) {
+            return;
+        }
+        if (deferring) {
+            deferGroup(entries, n);
+            return;
+        }
+        n = fingerprintEntries(entries, n, 1);
+    }
+    forEachRun(entries, n, byDigest, reportGroup);
+}
+
+/* Reports paths sharing an inode as links, without reading them. The first
+ * path (in tabulation order) of each inode is moved to the front of the array.
+ * Returns the number of these representatives.
+*/
+static int collapseLinks (FileEntry **entries, int n) {
+    int m = 0, j;
+    qsort(entries, n, sizeof(FileEntry *), byInode);
+    for (int i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && byInode(entries + i, entries + j) == 0; j++)
+            ;
+        qsort(entries + i, j - i, sizeof(FileEntry *), byId);
+        for (int k = i + 1; k < j && !sharding; k++) {
+            fprintf(report, "%s and %s are links to the same file.\n", entryPath(entries[k], 0),
+                entryPath(entries[i], 1));
+        }
+        swapEntries(entries + m++, entries + i);
+    }
+    return m;
+}
+
+/* Finds and reports duplicates within a size bucket.
+ * Stages: size (bucket) -> inode -> head/tail sample -> full fingerprint -> verify.
+*/
+static void refineBucket (SizeBucket *bucket) {
+    int n = collapseLinks(bucket->entries, bucket->count);
+    n = fingerprintEntries(bucket->entries, n, 0);
+    forEachRun(bucket->entries, n, bySample, refineSampleGroup);
+}
+
+/* Finds and reports all duplicates in the file table, with each fingerprint
+ * stage read across all buckets in disk order. Buckets are refined as usual
+ * once their fingerprints are known.
+*/
+static void findDuplicatesScheduled (void) {
+    FileEntry **candidates;
+    int n = 0;
+
+    // Sample all files of shared sizes in one sweep.
+    for (int i = 0; i < tableSize; i++) {
+        n += (fileTable[i].count > 1) ? fileTable[i].count : 0;
+    }
+    candidates = malloc(MAX(n, 1) * sizeof(FileEntry *));
+    assert(candidates != NULL);
+    n = 0;
+    for (int i = 0; i < tableSize; i++) {
+        if (fileTable[i].count > 1) {
+            memcpy(candidates + n, fileTable[i].entries, fileTable[i].count * sizeof(FileEntry *));
+            n += fileTable[i].count;
+        }
+    }
+    scheduleFingerprints(candidates, n, 0);
+
+    // Refine buckets by sample, holding back groups that need full fingerprints.
+    deferring = 1;
+    for (int i = 0; i < tableSize; i++) {
+        if (fileTable[i].count > 1) {
+            refineBucket(fileTable + i);
+        }
+    }
+    deferring = 0;
+
+    // Fingerprint the held back groups (no more entries than sampled) in
+    // another sweep, then refine them.
+    n = 0;
+    for (int i = 0; i < deferredCount; i++) {
+        memcpy(candidates + n, deferred[i].entries, deferred[i].count * sizeof(FileEntry *));
+        n += deferred[i].count;
+    }
+    scheduleFingerprints(candidates, n, 1);
+    for (int i = 0; i < deferredCount; i++) {
+        refineSampleGroup(deferred[i].entries, deferred[i].count);
+    }
+
+    free(candidates);
+    free(deferred);
+    deferred = NULL;
+    deferredCount = deferredCapacity = 0;
+}
+
+/* Finds and reports all duplicates in the file table */
+void findDuplicates (void) {
+    if (physicalOrder) {
+        findDuplicatesScheduled();
+        return;
+    }
+    for (int i = 0; i < tableSize; i++) {
+        if (fileTable[i].count > 1) {
+            refineBucket(fileTable + i);
+        }
+    }
+}
+
+/*
+ ******************************************************************************
+ *                         Partial Duplicate Routines
+ ******************************************************************************
+*/
+
+/* Returns the slot of a chunk in the chunk index, or the empty slot it belongs in */
+static int probeChunkTable (Chunk *table, int size, Fingerprint fp) {
+    int i = (fp.lo * HASH_MULTIPLIER) >> 32 & (size - 1);
+    while (table[i].length != 0 && compareFingerprints(table[i].fingerprint, fp) != 0) {
+        i = (i + 1) & (size - 1);
+    }
+    return i;
+}
+
+/* Adds a chunk of a file (given by arg) to the chunk index */
+static void indexChunk (Fingerprint fp, uint32_t length, void *arg) {
+    int file = *(int *)arg, oldSize = chunkTableSize, i;
+    Chunk *old = chunkTable, *c;
+
+    // Rehash the index if it would exceed half load.
+    if (2 * (chunkCount + 1) > chunkTableSize) {
+        chunkTableSize = MAX(DEFAULT_TBL_SIZE, 2 * chunkTableSize);
+        chunkTable = calloc(chunkTableSize, sizeof(Chunk));
+        assert(chunkTable != NULL);
+        for (i = 0; i < oldSize; i++) {
+            if (old[i].length != 0) {
+                chunkTable[probeChunkTable(chunkTable, chunkTableSize, old[i].fingerprint)] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    chunkedBytes += length;
+    c = chunkTable + probeChunkTable(chunkTable, chunkTableSize, fp);
+    if (c->length == 0) {
+        *c = (Chunk){.fingerprint = fp, .length = length, .last = -1};
+        chunkCount++;
+        distinctBytes += length;
+    }
+
+    // Post each file once per chunk, counting repeats. Files are chunked one
+    // after another.
+    if (c->last != -1 && postings[c->last].file == file) {
+        postings[c->last].count++;
+        return;
+    }
+    if (postingCount >= postingCapacity) {
+        postingCapacity = MAX(DEFAULT_TBL_SIZE, 2 * postingCapacity);
+        postings = realloc(postings, postingCapacity * sizeof(Posting));
+        assert(postings != NULL);
+    }
+    postings[postingCount] = (Posting){.file = file, .count = 1, .previous = c->last};
+    c->last = postingCount++;
+    c->files++;
+}
+
+/* Drops the postings of the file being chunked (those from 'start' on), and
+ * the chunks only it held, as if it hadn't been chunked.
+*/
+static void dropChunks (int start) {
+    Chunk *old = chunkTable, *c;
+
+    // Rebuild the index without them. A chunk's last posting is the file's, if any.
+    chunkTable = calloc(chunkTableSize, sizeof(Chunk));
+    assert(chunkTable != NULL);
+    for (int i = 0; i < chunkTableSize; i++) {
+        c = old + i;
+        if (c->length != 0 && c->last >= start) {
+            chunkedBytes -= (long long)postings[c->last].count * c->length;
+            c->last = postings[c->last].previous;
+            c->files--;
+        }
+        if (c->length != 0 && c->files == 0) {
+            distinctBytes -= c->length;
+            chunkCount--;
+        } else if (c->length != 0) {
+            chunkTable[probeChunkTable(chunkTable, chunkTableSize, c->fingerprint)] = *c;
+        }
+    }
+    free(old);
+    postingCount = start;
+}
+
+/* Returns the slot of a pair in the pair table, or the empty slot it belongs in */
+static int probePairTable (SharedPair *table, int size, int a, int b) {
+    uint64_t key = (uint64_t)a << 32 | (uint32_t)b;
+    int i = (key * HASH_MULTIPLIER) >> 32 & (size - 1);
+    while (table[i].bytes != 0 && (table[i].a != a || table[i].b != b)) {
+        i = (i + 1) & (size - 1);
+    }
+    return i;
+}
+
+/* Adds bytes shared by two files (a < b) to their pair */
+static void addSharedBytes (int a, int b, long long bytes) {
+    int oldSize = pairTableSize, i;
+    SharedPair *old = pairTable;
+
+    if (2 * (pairCount + 1) > pairTableSize) {
+        pairTableSize = MAX(DEFAULT_TBL_SIZE, 2 * pairTableSize);
+        pairTable = calloc(pairTableSize, sizeof(SharedPair));
+        assert(pairTable != NULL);
+        for (i = 0; i < oldSize; i++) {
+            if (old[i].bytes != 0) {
+                pairTable[probePairTable(pairTable, pairTableSize, old[i].a, old[i].b)] = old[i];
+            }
+        }
+        free(old);
+    }
+    i = probePairTable(pairTable, pairTableSize, a, b);
+    if (pairTable[i].bytes == 0) {
+        pairTable[i] = (SharedPair){.a = a, .b = b};
+        pairCount++;
+    }
+    pairTable[i].bytes += bytes;
+}
+
+/* Orders shared pairs by bytes shared (most first), then by files */
+static int bySharedBytes (const void *a, const void *b) {
+    const SharedPair *x = a, *y = b;
+    if (x->bytes != y->bytes) {
+        return (x->bytes > y->bytes) ? -1 : 1;
+    }
+    return (x->a != y->a) ? x->a - y->a : x->b - y->b;
+}
+
+/* Finds and reports files sharing content, at any size or offset.
+ * - Each file (one path per inode) is split into content-defined chunks, and
+ *   its distinct chunks are indexed with their number of occurrences.
+ * - Pairs are reported with the bytes of the chunks they share, most first,
+ *   followed by the fraction of bytes a chunk store would save. A chunk one
+ *   file holds twice and another thrice counts twice for the pair.
+*/
+void findPartialDuplicates (void) {
+    FileEntry **entries = malloc(MAX(tp, 1) * sizeof(FileEntry *));
+    int n = 0, m = 0, k, fd, start, *sharers = malloc(CHUNK_MAX_SHARERS * sizeof(int));
+    assert(entries != NULL && sharers != NULL);
+
+    // Chunk one path per inode, in inode order (which follows the disk on most
+    // file systems).
+    for (int i = 0; i < tableSize; i++) {
+        for (int j = 0; j < fileTable[i].count; j++) {
+            if (fileTable[i].entries[j]->size > 0) {
+                entries[n++] = fileTable[i].entries[j];
+            }
+        }
+    }
+    qsort(entries, n, sizeof(FileEntry *), byInode);
+    for (int i = 0; i < n; i++) {
+        if (m > 0 && byInode(entries + m - 1, entries + i) == 0) {
+            continue;
+        }
+        if ((fd = tryOpenFile(entryPath(entries[i], 0))) == -1) {
+            entries[i]->state |= UNREADABLE;
+            continue;
+        }
+
+        // A file that fails partway is left out, chunks read and all.
+        entries[m] = entries[i];
+        start = postingCount;
+        if (chunkFile(fd, indexChunk, &m) == -1) {
+            fprintf(stderr, "Error: Can't read file %s! -Ignoring-\n", entryPath(entries[i], 0));
+            entries[i]->state |= UNREADABLE;
+            dropChunks(start);
+        } else {
+            m++;
+        }
+        closeFile(fd);
+    }
+
+    // Credit each chunk's bytes to every pair of files holding it, as often
+    // as both hold it.
+    for (int i = 0; i < chunkTableSize; i++) {
+        Chunk *c = chunkTable + i;
+        if (c->files > CHUNK_MAX_SHARERS) {
+            commonCount++;
+            commonBytes += c->length;
+        }
+        if (c->files < 2 || c->files > CHUNK_MAX_SHARERS) {
+            continue;
+        }
+        k = 0;
+        for (int p = c->last; p != -1; p = postings[p].previous) {
+            sharers[k++] = p;
+        }
+        for (int a = k - 1; a > 0; a--) {
+            for (int b = a - 1; b >= 0; b--) {
+                Posting *x = postings + sharers[a], *y = postings + sharers[b];
+                addSharedBytes(x->file, y->file, (long long)MIN(x->count, y->count) * c->length);
+            }
+        }
+    }
+
+    // Report pairs, most shared first.
+    k = 0;
+    for (int i = 0; i < pairTableSize; i++) {
+        if (pairTable[i].bytes != 0) {
+            pairTable[k++] = pairTable[i];
+        }
+    }
+    qsort(pairTable, k, sizeof(SharedPair), bySharedBytes);
+    for (int i = 0; i < k; i++) {
+        FileEntry *a = entries[pairTable[i].a], *b = entries[pairTable[i].b];
+        fprintf(report, "%s and %s share %lld bytes (%.1f%% and %.1f%%).\n", entryPath(a, 0),
+            entryPath(b, 1), pairTable[i].bytes, 100.0 * pairTable[i].bytes / a->size,
+            100.0 * pairTable[i].bytes / b->size);
+    }
+    fprintf(report, "Chunked %d files (%lld bytes) into %d distinct chunks (%lld bytes): "
+        "%.1f%% saved.\n", m, chunkedBytes, chunkCount, distinctBytes,
+        (chunkedBytes > 0) ? 100.0 * (chunkedBytes - distinctBytes) / chunkedBytes : 0.0);
+    if (commonCount > 0) {
+        fprintf(report, "%d distinct chunks (%lld bytes) held by more than %d files each are "
+            "not counted in the pairs above.\n", commonCount, commonBytes, CHUNK_MAX_SHARERS);
+    }
+
+    free(entries);
+    free(sharers);
+    free(chunkTable);
+    free(postings);
+    free(pairTable);
+    freeChunkBuffer();
+}
+
+/*
+ ******************************************************************************
+ *                               Shard Routines
+ ******************************************************************************
+*/
+
+/* Copies the fingerprints of each inode's fingerprinted link to its other
+ * links, which duplicate detection skipped. Links are verified identical.
+*/
+static void shareLinkFingerprints (FileEntry **entries, int n) {
+    FileEntry *fp;
+    int j;
+    qsort(entries, n, sizeof(FileEntry *), byInode);
+    for (int i = 0; i < n; i = j) {
+        fp = NULL;
+        for (j = i; j < n && byInode(entries + i, entries + j) == 0; j++) {
+            fp = (fp == NULL && (entries[j]->state & HAVE_SAMPLE)) ? entries[j] : fp;
+        }
+        if (fp == NULL || j - i == 1) {
+            continue;
+        }
+        if (verify && fp->class == 0) {
+            fp->class = fp->id + 1;
+        }
+        for (int k = i; k < j; k++) {
+            entries[k]->sample = fp->sample;
+            entries[k]->digest = fp->digest;
+            entries[k]->state = fp->state;
+            entries[k]->class = fp->class;
+        }
+    }
+}
+
+/* Writes the tabulated files to a shard index instead of reporting them.
+ * - Every file is sampled, since it may have a duplicate in another shard.
+ * - Full fingerprints (and verified classes) of duplicates found within the
+ *   shard are kept, so that merging doesn't redo them.
+*/
+void writeShard (const char *path) {
+    FileEntry **entries;
+    ShardRecord r;
+    int n = 0;
+
+    // Find duplicates within the shard (without reporting them).
+    sharding = 1;
+    findDuplicates();
+
+    // Sample the remaining files.
+    entries = malloc(MAX(tp, 1) * sizeof(FileEntry *));
+    assert(entries != NULL);
+    for (int i = 0; i < tableSize; i++) {
+        if (fileTable[i].count > 0) {
+            memcpy(entries + n, fileTable[i].entries, fileTable[i].count * sizeof(FileEntry *));
+            n += fileTable[i].count;
+        }
+    }
+    if (physicalOrder) {
+        scheduleFingerprints(entries, n, 0);
+    }
+    shareLinkFingerprints(entries, n);
+    fingerprintEntries(entries, n, 0);
+
+    // Index every readable file.
+    createShard(path);
+    for (int i = 0; i < n; i++) {
+        FileEntry *fp = entries[i];
+        if (!(fp->state & HAVE_SAMPLE)) {
+            continue;
+        }
+        r = (ShardRecord){
+            .size = fp->size, .dev = fp->dev, .ino = fp->ino,
+            .mtimeSec = fp->mtime.tv_sec, .mtimeNsec = fp->mtime.tv_nsec,
+            .sample = fp->sample, .digest = fp->digest,
+            .flags = (fp->state & HAVE_DIGEST) ? SHARD_DIGEST : 0,
+            .class = fp->class
+        };
+        addShardRecord(&r, entryPath(fp, 0));
+    }
+    free(entries);
+    if (closeShard() == -1) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Returns the file entry of a shard record */
+static FileEntry *shardEntry (const ShardRecord *r, const char *path, int shard, int id) {
+    struct stat statBuffer;
+    FileEntry *fp;
+    memset(&statBuffer, 0, sizeof(statBuffer));
+    statBuffer.st_size = r->size;
+    statBuffer.st_dev = r->dev;
+    statBuffer.st_ino = r->ino;
+    statBuffer.st_mtim.tv_sec = r->mtimeSec;
+    statBuffer.st_mtim.tv_nsec = r->mtimeNsec;
+    fp = newPathEntry(path, &statBuffer, id);
+    fp->sample = r->sample;
+    fp->digest = r->digest;
+    fp->state = HAVE_SAMPLE | ((r->flags & SHARD_DIGEST) ? HAVE_DIGEST : 0);
+    fp->shard = shard;
+    fp->class = r->class;
+    return fp;
+}
+
+/* Merges shard indexes, and reports all duplicates among their files.
+ * - Only files sharing size and sample with another are loaded.
+ * - Full fingerprints missing from a shard are read, and (if verifying) only
+ *   pairs a shard didn't verify are compared.
+*/
+void mergeShards (char *paths[], int n) {
+    ShardReader *readers = malloc(n * sizeof(ShardReader));
+    ShardRecord first;
+    FileEntry **entries = NULL;
+    char *firstPath = NULL;
+    int *live = malloc(n * sizeof(int)), count, capacity = 0, firstSize = 0, firstShard = 0;
+    int id = 0, least;
+    assert(readers != NULL && live != NULL);
+
+    // Open each shard at its first record.
+    for (int i = 0; i < n; i++) {
+        if (openShard(readers + i, paths[i]) == -1 || (live[i] = nextShardRecord(readers + i)) == -1) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Take runs of equal merge keys across all shards.
+    while (1) {
+        least = -1;
+        for (int i = 0; i < n; i++) {
+            if (live[i] && (least == -1 ||
+                compareShardRecords(&readers[i].record, &readers[least].record) < 0)) {
+                least = i;
+            }
+        }
+        if (least == -1) {
+            break;
+        }
+
+        // The first record of a run is held back until it has company.
+        first = readers[least].record;
+        firstShard = least;
+        resizeBuffer((void **)&firstPath, &firstSize, first.pathLength + 1);
+        strcpy(firstPath, readers[least].path);
+        count = 0;
+        for (int i = 0; i < n; i++) {
+            while (live[i] && compareShardRecords(&readers[i].record, &first) == 0) {
+                if (count + 1 >= capacity) {
+                    capacity = MAX(DEFAULT_BKT_SIZE, capacity * 2);
+                    entries = realloc(entries, capacity * sizeof(FileEntry *));
+                    assert(entries != NULL);
+                }
+                if (count == 1) {
+                    entries[0] = shardEntry(&first, firstPath, firstShard, id++);
+                }
+                if (count++ > 0) {
+                    entries[count - 1] = shardEntry(&readers[i].record, readers[i].path, i, id++);
+                }
+                if ((live[i] = nextShardRecord(readers + i)) == -1) {
+                    fprintf(stderr, "Error: Can't read shard index %s!\n", paths[i]);
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+
+        // Refine the run like a sample group of one size bucket.
+        if (count > 1) {
+            refineSampleGroup(entries, collapseLinks(entries, count));
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        closeShardReader(readers + i);
+    }
+    free(readers);
+    free(live);
+    free(entries);
+    free(firstPath);
+}
+
+/*
+ ******************************************************************************
+ *                           External Memory Routines
+ ******************************************************************************
+*/
+
+/* Spills a scanned file (by full path) to the size sorter */
+void spill (const char *path, const struct stat *statBuffer) {
+    SpillRecord r = {
+        .size = statBuffer->st_size,
+        .dev = statBuffer->st_dev,
+        .ino = statBuffer->st_ino,
+        .mtimeSec = statBuffer->st_mtim.tv_sec,
+        .mtimeNsec = statBuffer->st_mtim.tv_nsec
+    };
+    countStat(STAT_FILES, 1);
+    storePath(&r, path);
+    sorterAdd(&sizeSorter, &r);
+}
+
+/* Returns the stat fields a spilled record keeps */
+static struct stat recordStat (const SpillRecord *r) {
+    struct stat statBuffer;
+    memset(&statBuffer, 0, sizeof(statBuffer));
+    statBuffer.st_size = r->size;
+    statBuffer.st_dev = r->dev;
+    statBuffer.st_ino = r->ino;
+    statBuffer.st_mtim.tv_sec = r->mtimeSec;
+    statBuffer.st_mtim.tv_nsec = r->mtimeNsec;
+    return statBuffer;
+}
+
+/* Fills in a spilled record's sample fingerprint, consulting the cache.
+ * Returns -1 if the file can't be read.
+*/
+static int sampleRecord (SpillRecord *r) {
+    static char *path;
+    static int pathSize;
+    CacheKey key = {.dev = r->dev, .ino = r->ino, .size = r->size,
+        .mtimeSec = r->mtimeSec, .mtimeNsec = r->mtimeNsec};
+    Fingerprint digest;
+    int fd, result, stage;
+
+    if (lookupCache(cache, key, &r->sample, &digest) & CACHE_SAMPLE) {
+        return 0;
+    }
+    stage = enterStage(STAGE_SAMPLE);
+    fd = openFile(loadPath(r, &path, &pathSize));
+    if ((result = fingerprintSample(fd, r->size, &r->sample)) == -1) {
+        fprintf(stderr, "Error: Can't read file %s! -Ignoring-\n", path);
+    } else {
+        countStat(STAT_SAMPLES, 1);
+        storeCache(cache, key, (r->size <= 2 * SAMPLE_SIZE) ? CACHE_SAMPLE | CACHE_DIGEST : CACHE_SAMPLE,
+            r->sample, r->sample);
+    }
+    closeFile(fd);
+    enterStage(stage);
+    return result;
+}
+
+/* Loads a group of spilled records sharing size and sample into memory, and
+ * refines it like a sample group of an in-memory size bucket. Its entries
+ * and names (with their directory nodes) are free'd once it is reported.
+*/
+static void refineSpilledGroup (const SpillRecord *group, int n) {
+    FileEntry **entries = malloc(n * sizeof(FileEntry *));
+    char *path = NULL;
+    int pathSize = 0;
+    struct stat statBuffer;
+    assert(entries != NULL);
+
+    for (int i = 0; i < n; i++) {
+        statBuffer = recordStat(group + i);
+        entries[i] = newPathEntry(loadPath(group + i, &path, &pathSize), &statBuffer, i);
+        entries[i]->sample = entries[i]->digest = group[i].sample;
+    }
+    if ((n = collapseLinks(entries, n)) > 1) {
+        refineSampleGroup(entries, n);
+    }
+
+    free(path);
+    free(entries);
+    freeArena(&entryArena);
+    freeDirNodes();
+}
+
+/* Finds and reports all duplicates among spilled files within the budget.
+ * - Pass 1 streams files by size, and samples those sharing a size.
+ * - Pass 2 streams sampled files by (size, sample), and loads each group of
+ *   two or more for full fingerprinting.
+*/
+void findDuplicatesExternal (void) {
+    SpillRecord r, first, *group = NULL;
+    int pending = 0, groupSize = 0, groupCapacity = 0;
+    Sorter sampleSorter;
+
+    initSorter(&sampleSorter, memoryBudget / 2);
+    sorterFinish(&sizeSorter);
+
+    // Pass 1. The first of each size is held until a second one shows up.
+    while (sorterNext(&sizeSorter, &r)) {
+        if (pending && r.size == first.size) {
+            if (pending == 1 && sampleRecord(&first) == 0) {
+                sorterAdd(&sampleSorter, &first);
+            }
+            if (sampleRecord(&r) == 0) {
+                sorterAdd(&sampleSorter, &r);
+            }
+            pending = 2;
+            continue;
+        }
+        first = r;
+        pending = 1;
+    }
+    freeSorter(&sizeSorter);
+    sorterFinish(&sampleSorter);
+
+    // Pass 2.
+    while (sorterNext(&sampleSorter, &r)) {
+        if (groupSize > 0 && compareSpillKeys(group, &r) != 0) {
+            if (groupSize > 1) {
+                refineSpilledGroup(group, groupSize);
+            }
+            groupSize = 0;
+        }
+        if (groupSize == groupCapacity) {
+            groupCapacity = MAX(DEFAULT_BKT_SIZE, groupCapacity * 2);
+            group = realloc(group, groupCapacity * sizeof(SpillRecord));
+            assert(group != NULL);
+        }
+        group[groupSize++] = r;
+    }
+    if (groupSize > 1) {
+        refineSpilledGroup(group, groupSize);
+    }
+
+    free(group);
+    freeSorter(&sampleSorter);
+    freePathStore();
+}
+
+/*
+ ******************************************************************************
+ *                          Directory Scanning Routines
+ ******************************************************************************
+*/
+
+/* Returns pointers to consecutive files in a directory stream */
+const char *nextDirectoryFile (DIR *directory) {
+    struct dirent *entryBuffer;
+    static const char *fileName;
+
+    // Write entries to buffer as long as more exist.
+    while ((entryBuffer = readdir(directory)) != NULL) {
+
+        // Ignore unused entries (inode is zero).
+        if (entryBuffer->d_ino == 0) {
+            continue;
+        }
+        fileName = entryBuffer->d_name;
+        return fileName;
+    }
+
+    return NULL;
+}
+
+/* Applies function 'f' to all valid files within given directory */
+void scanDirectory (const char *directoryName, void (*f)(const char *)) {
+    char *pathName = NULL;
+    const char *fileName = NULL;
+    int pathSize = 0;
+    DIR *directory;
+
+    // Open the directory.
+    if ((directory = opendir(directoryName)) == NULL) {
+        fprintf(stderr, "Error: Can't access directory %s! -Ignoring-\n", directoryName);
+        return;
+    }
+    countStat(STAT_DIRECTORIES, 1);
+
+    // Scan directory contents.
+    while ((fileName = nextDirectoryFile(directory)) != NULL) {
+
+        // Ignore self, parent.
+        if (strcmp(fileName, ".") == 0 || strcmp(fileName, "..") == 0) {
+            continue;
+        }
+
+        // Compute new length, resize buffer if required.
+        resizeBuffer((void **)&pathName, &pathSize, strlen(directoryName) + strlen(fileName) + 2);
+
+        // Write new path to buffer. Then scan the file.
+        sprintf(pathName, "%s/%s", directoryName, fileName);
+        (*f)(pathName);
+    }
+
+    // Free memory.
+    free(pathName);
+
+    // Close the directory.
+    closedir(directory);
+}
+
+/*
+ ******************************************************************************
+ *                            File Scanning Routines
+ ******************************************************************************
+*/
+
+/* Tabulates (or spills) a stat'ed file if it is a regular file. Its directory
+ * is interned.
+*/
+void tabulateFile (const char *fileName, const struct stat *statBuffer) {
+    const char *slash = strrchr(fileName, '/');
+    if (!S_ISREG(statBuffer->st_mode)) {
+        return;
+    }
+    if (memoryBudget > 0) {
+        spill(fileName, statBuffer);
+    } else if (slash == NULL) {
+        tabulate(NO_PARENT, fileName, statBuffer);
+    } else {
+        tabulate(internDirectory(fileName, slash - fileName), slash + 1, statBuffer);
+    }
+}
+
+/* Tabulates a file found by the parallel walker */
+static void tabulateFound (void *arg, const char *fileName, const struct stat *statBuffer) {
+    tabulateFile(fileName, statBuffer);
+}
+
+/* Tabulates (or spills) a stat'ed file within a directory if it is a regular file */
+void tabulateAt (int dir, const char *fileName, const struct stat *statBuffer) {
+    static char *path;
+    static int pathSize;
+    if (!S_ISREG(statBuffer->st_mode)) {
+        return;
+    }
+    if (memoryBudget > 0) {
+        spill(buildPath(dir, fileName, &path, &pathSize), statBuffer);
+    } else {
+        tabulate(dir, fileName, statBuffer);
+    }
+}
+
+/* Tabulates information about a file. If dir, dir is walked. */
+void scanFile (const char *fileName) {
+    struct stat statBuffer; // For use with stat()
+
+    // System call to obtain file info via statx.
+    if (fetchMetadata(AT_FDCWD, fileName, &statBuffer) == -1) {
+        fprintf(stderr, "Error: Can't access file %s! -Ignoring-\n", fileName);
+        return;
+    }
+
+    // If directory, recursively apply scanFile to contents.
+    if (S_ISDIR(statBuffer.st_mode)) {
+        scanDirectory(fileName, scanFile);
+    } else {
+        tabulateFile(fileName, &statBuffer);
+    }
+}
+
+/* Tabulates the root as scanFile would if it isn't a directory. Returns
+ * nonzero if so, leaving no tree to walk.
+*/
+static int scanRootFile (const char *root) {
+    struct stat statBuffer;
+    if (fetchMetadata(AT_FDCWD, root, &statBuffer) == -1 || S_ISDIR(statBuffer.st_mode)) {
+        return 0;
+    }
+    tabulateFile(root, &statBuffer);
+    return 1;
+}
+
+/* Checkpointed scan: Pushes a copy of a directory path onto the frontier */
+static void pushFrontier (const char *path) {
+    if (frontierCount == frontierCapacity) {
+        frontierCapacity = MAX(64, 2 * frontierCapacity);
+        frontier = realloc(frontier, frontierCapacity * sizeof(char *));
+        assert(frontier != NULL);
+    }
+    frontier[frontierCount] = malloc(strlen(path) + 1);
+    assert(frontier[frontierCount] != NULL);
+    strcpy(frontier[frontierCount++], path);
+}
+
+/* Checkpointed scan: Tabulates a replayed file as it is now. Files gone since
+ * they were logged are dropped.
+*/
+static void tabulateReplayed (const char *path, const struct stat *logged) {
+    struct stat statBuffer;
+    if (fetchMetadata(AT_FDCWD, path, &statBuffer) == 0) {
+        tabulateFile(path, &statBuffer);
+    }
+}
+
+/* Tabulates information about a file tree like scanFile, logging each
+ * completed directory to the checkpoint. The scan continues from the frontier
+ * left by the last checkpoint, with the files found before it replayed.
+*/
+void scanCheckpointed (const char *root) {
+    struct stat statBuffer;
+    const char *fileName;
+    char *dir, *pathName = NULL;
+    int pathSize = 0;
+    DIR *directory;
+
+    // Replay the checkpoint. A complete scan leaves an empty frontier.
+    if (resumeCheckpoint(root, tabulateReplayed, pushFrontier) && verbose) {
+        fprintf(stderr, "Scan already complete. Resuming at fingerprinting.\n");
+    }
+
+    // Scan directories depth-first. The root is scanned as scanFile would.
+    while (frontierCount > 0) {
+        dir = frontier[--frontierCount];
+        beginDirectory(dir);
+        if ((directory = opendir(dir)) == NULL) {
+            fprintf(stderr, "Error: Can't access directory %s! -Ignoring-\n", dir);
+        } else {
+            countStat(STAT_DIRECTORIES, 1);
+        }
+        while (directory != NULL && (fileName = nextDirectoryFile(directory)) != NULL) {
+            if (strcmp(fileName, ".") == 0 || strcmp(fileName, "..") == 0) {
+                continue;
+            }
+            resizeBuffer((void **)&pathName, &pathSize, strlen(dir) + strlen(fileName) + 2);
+            sprintf(pathName, "%s/%s", dir, fileName);
+            if (fetchMetadata(AT_FDCWD, pathName, &statBuffer) == -1) {
+                fprintf(stderr, "Error: Can't access file %s! -Ignoring-\n", pathName);
+            } else if (S_ISDIR(statBuffer.st_mode)) {
+                logSubdirectory(fileName);
+                pushFrontier(pathName);
+            } else if (S_ISREG(statBuffer.st_mode)) {
+                logFile(fileName, &statBuffer);
+                tabulateFile(pathName, &statBuffer);
+            }
+        }
+        if (directory != NULL) {
+            closedir(directory);
+        }
+        endDirectory();
+        free(dir);
+    }
+    endScan();
+
+    free(pathName);
+    free(frontier);
+    frontier = NULL;
+    frontierCapacity = 0;
+}
+
+/*
+ ******************************************************************************
+ *                               Daemon Routines
+ ******************************************************************************
+*/
+
+/* Returns the home slot of a directory and name in the entry index */
+static int hashEntryName (int dir, const char *name) {
+    uint64_t h = (uint64_t)(dir + 2) * HASH_MULTIPLIER;
+    for (; *name != '\0'; name++) {
+        h = (h ^ (unsigned char)*name) * 0x100000001B3ULL;
+    }
+    return (int)(h >> 32) & (entryIndexSize - 1);
+}
+
+/* Returns the slot of the entry of a directory and name, or the empty slot
+ * it belongs in.
+*/
+static int probeEntryIndex (int dir, const char *name) {
+    int i = hashEntryName(dir, name);
+    while (entryIndex[i] != NULL && (entryIndex[i]->dir != dir ||
+        strcmp(entryIndex[i]->fileName, name) != 0)) {
+        i = (i + 1) & (entryIndexSize - 1);
+    }
+    return i;
+}
+
+/* Returns the tracked entry of a name within a directory node, or NULL */
+static FileEntry *lookupEntry (int dir, const char *name) {
+    return (entryIndex == NULL) ? NULL : entryIndex[probeEntryIndex(dir, name)];
+}
+
+/* Adds an entry to the entry index. Rehashes at half load */
+static void indexEntry (FileEntry *fp) {
+    FileEntry **old = entryIndex;
+    int oldSize = entryIndexSize;
+
+    if (2 * (entryIndexCount + 1) > entryIndexSize) {
+        entryIndexSize = MAX(DEFAULT_TBL_SIZE, entryIndexSize * 2);
+        entryIndex = calloc(entryIndexSize, sizeof(FileEntry *));
+        assert(entryIndex != NULL);
+        for (int i = 0; i < oldSize; i++) {
+            if (old[i] != NULL) {
+                entryIndex[probeEntryIndex(old[i]->dir, old[i]->fileName)] = old[i];
+            }
+        }
+        free(old);
+    }
+    entryIndex[probeEntryIndex(fp->dir, fp->fileName)] = fp;
+    entryIndexCount++;
+}
+
+/* Removes an entry from the entry index, reinserting the rest of its probe
+ * cluster.
+*/
+static void unindexEntry (FileEntry *fp) {
+    int i = probeEntryIndex(fp->dir, fp->fileName);
+    FileEntry *moved;
+    entryIndex[i] = NULL;
+    entryIndexCount--;
+    while ((moved = entryIndex[i = (i + 1) & (entryIndexSize - 1)]) != NULL) {
+        entryIndex[i] = NULL;
+        entryIndex[probeEntryIndex(moved->dir, moved->fileName)] = moved;
+    }
+}
+
+/* Empties the entry index */
+static void freeEntryIndex (void) {
+    free(entryIndex);
+    free(dirtySizes);
+    entryIndex = NULL;
+    dirtySizes = NULL;
+    entryIndexSize = entryIndexCount = dirtyCount = dirtyCapacity = 0;
+}
+
+/* Notes that the bucket of a size must be refined again */
+static void markDirty (long size) {
+    if (dirtyCount >= dirtyCapacity) {
+        dirtyCapacity = MAX(DEFAULT_BKT_SIZE, dirtyCapacity * 2);
+        dirtySizes = realloc(dirtySizes, dirtyCapacity * sizeof(long));
+        assert(dirtySizes != NULL);
+    }
+    dirtySizes[dirtyCount++] = size;
+}
+
+/* Tabulates and indexes a stat'ed file within a directory if it is a regular
+ * file. The scan callback of daemon mode.
+*/
+static void trackAt (int dir, const char *fileName, const struct stat *statBuffer) {
+    FileEntry *fp;
+    if (!S_ISREG(statBuffer->st_mode)) {
+        return;
+    }
+    fp = tabulate(dir, fileName, statBuffer);
+    indexEntry(fp);
+    markDirty(fp->size);
+}
+
+/* Stops tracking an entry */
+static void untrack (FileEntry *fp) {
+    unindexEntry(fp);
+    markDirty(fp->size);
+    untabulate(fp);
+}
+
+/* Handles a changed file: Re-tabulates it, unless its identity, size, and
+ * modification time are unchanged.
+*/
+static void fileChanged (int dir, const char *fileName) {
+    static char *path;
+    static int pathSize;
+    FileEntry *fp = lookupEntry(dir, fileName);
+    struct stat statBuffer;
+
+    if (fetchMetadata(AT_FDCWD, buildPath(dir, fileName, &path, &pathSize), &statBuffer) == -1 ||
+        !S_ISREG(statBuffer.st_mode)) {
+        if (fp != NULL) {
+            untrack(fp);
+        }
+        return;
+    }
+    if (fp != NULL && fp->size == statBuffer.st_size && fp->dev == statBuffer.st_dev &&
+        fp->ino == statBuffer.st_ino && fp->mtime.tv_sec == statBuffer.st_mtim.tv_sec &&
+        fp->mtime.tv_nsec == statBuffer.st_mtim.tv_nsec) {
+        return;
+    }
+    if (fp != NULL) {
+        untrack(fp);
+    }
+    trackAt(dir, fileName, &statBuffer);
+}
+
+/* Handles a removed file */
+static void fileRemoved (int dir, const char *fileName) {
+    FileEntry *fp = lookupEntry(dir, fileName);
+    if (fp != NULL) {
+        untrack(fp);
+    }
+}
+
+/* Handles an added directory: Scans (and so watches) it */
+static void directoryAdded (int dir, const char *name) {
+    scanSubtree(dir, name, trackAt);
+}
+
+/* Handles a removed directory: Stops tracking all entries below it */
+static void directoryRemoved (int dir) {
+    FileEntry **below = malloc(MAX(entryIndexCount, 1) * sizeof(FileEntry *));
+    int n = 0;
+    assert(below != NULL);
+
+    // Gather first, as untracking reorders the index.
+    for (int i = 0; i < entryIndexSize; i++) {
+        if (entryIndex[i] != NULL && isBelow(entryIndex[i]->dir, dir)) {
+            below[n++] = entryIndex[i];
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        untrack(below[i]);
+    }
+    free(below);
+}
+
+/* Stops tracking the entries of a bucket found unreadable. A change to one
+ * tracks it afresh.
+*/
+static void untrackUnreadable (SizeBucket *bucket) {
+    // Untabulating moves the last entry into the gap, so go from the end.
+    for (int i = bucket->count - 1; i >= 0; i--) {
+        if (bucket->entries[i]->state & UNREADABLE) {
+            untrack(bucket->entries[i]);
+        }
+    }
+}
+
+/* Handles lost events: Drops the index and builds it anew */
+static void rebuildIndex (void) {
+    fprintf(stderr, "Error: Change events were lost! -Rescanning-\n");
+    freeFileTable();
+    freeEntryIndex();
+    freeDirNodes();
+    scanTree(daemonRoot, trackAt);
+}
+
+/* Refines the buckets changed since last time, so that their fingerprints
+ * (and, if verifying, the classes of identical files) are known before the
+ * next query. Nothing is reported, as when sharding.
+ * - Pairs already in one class aren't compared again.
+ * - Files that can't be read stop being tracked. Untracking dirties their
+ *   bucket again, which is refined from what is known.
+*/
+static void refreshIndex (void) {
+    SizeBucket *bucket;
+    sharding = 1;
+    for (int i = 0; i < dirtyCount; i++) {
+        if ((bucket = lookupFileTable(dirtySizes[i])) != NULL && bucket->count > 1) {
+            refineBucket(bucket);
+            untrackUnreadable(bucket);
+        }
+    }
+    dirtyCount = 0;
+    sharding = 0;
+}
+
+/* Orders file entries by the class they were verified in (zero if none) */
+static int byVerifiedClass (const void *a, const void *b) {
+    const FileEntry *x = *(FileEntry * const *)a, *y = *(FileEntry * const *)b;
+    return (x->class > y->class) - (x->class < y->class);
+}
+
+/* Reports a run of entries of one verified class. Unverified entries aren't
+ * duplicates.
+*/
+static void printClass (FileEntry **entries, int n) {
+    if (entries[0]->class != 0) {
+        printGroup(entries, n);
+    }
+}
+
+/* Reports a run of equal full fingerprints, split by verified class if
+ * verifying.
+*/
+static void printIndexedRun (FileEntry **entries, int n) {
+    if (verify) {
+        forEachRun(entries, n, byVerifiedClass, printClass);
+    } else {
+        printGroup(entries, n);
+    }
+}
+
+/* Reports the duplicates of the index as findDuplicates would, from the
+ * fingerprints and classes refreshIndex left. No file is read.
+*/
+static void reportIndex (void) {
+    SizeBucket *bucket;
+    int n, m;
+    for (int i = 0; i < tableSize; i++) {
+        if ((bucket = fileTable + i)->count < 2) {
+            continue;
+        }
+        n = collapseLinks(bucket->entries, bucket->count);
+        for (int k = m = 0; k < n; k++) {
+            if (bucket->entries[k]->state & HAVE_DIGEST) {
+                swapEntries(bucket->entries + m++, bucket->entries + k);
+            }
+        }
+        forEachRun(bucket->entries, m, byDigest, printIndexedRun);
+    }
+}
+
+/* Reports all duplicates to a client of the daemon, from the index */
+static void serveQuery (int listenFd) {
+    int client;
+    FILE *out;
+    if ((client = accept(listenFd, NULL, NULL)) == -1) {
+        return;
+    }
+    if ((out = fdopen(client, "w")) == NULL) {
+        close(client);
+        return;
+    }
+    report = out;
+    reportIndex();
+    fclose(out);
+    report = stdout;
+}
+
+/* Fills in the address of a socket path. Exits if the path is too long */
+static struct sockaddr_un socketAddress (const char *socketPath) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: Socket path %s is too long!\n", socketPath);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, socketPath);
+    return address;
+}
+
+/* Signal handler: Asks the daemon to stop */
+static void stopDaemon (int sig) {
+    stopping = 1;
+}
+
+/* Runs the daemon: Indexes the tree below root, then keeps the index up to
+ * date with change events, and answers queries on a socket.
+*/
+void runDaemon (const char *root, const char *socketPath) {
+    WatchHandlers handlers = {fileChanged, fileRemoved, directoryAdded, directoryRemoved, rebuildIndex};
+    struct sockaddr_un address = socketAddress(socketPath);
+    struct sigaction action;
+    struct pollfd fds[2];
+
+    // Build the index, watching each directory before it is read.
+    if ((fds[0].fd = initWatch()) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    daemonRoot = root;
+    setDirectoryHook(watchDirectory);
+    scanTree(root, trackAt);
+    refreshIndex();
+
+    // Listen for queries.
+    unlink(socketPath);
+    if ((fds[1].fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+        bind(fds[1].fd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        listen(fds[1].fd, 16) == -1) {
+        fprintf(stderr, "Error: Can't listen on socket %s!\n", socketPath);
+        exit(EXIT_FAILURE);
+    }
+    fds[0].events = fds[1].events = POLLIN;
+    if (verbose) {
+        fprintf(stderr, "Indexed %d files. Listening on %s.\n", entryIndexCount, socketPath);
+    }
+
+    // Stop on interrupt or termination. Clients hanging up are no error.
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopDaemon;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
+
+    while (!stopping) {
+        if (poll(fds, 2, -1) == -1) {
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            processWatchEvents(&handlers);
+            refreshIndex();
+        }
+        if (fds[1].revents & POLLIN) {
+            serveQuery(fds[1].fd);
+        }
+    }
+
+    close(fds[1].fd);
+    unlink(socketPath);
+    setDirectoryHook(NULL);
+    freeWatch();
+    freeEntryIndex();
+}
+
+/* Asks a daemon for its duplicates, and copies them to stdout. Returns -1 if
+ * the daemon can't be reached.
+*/
+int queryDaemon (const char *socketPath) {
+    struct sockaddr_un address = socketAddress(socketPath);
+    char buffer[64 * 1024];
+    ssize_t n;
+    int fd;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+        connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        fprintf(stderr, "Error: Can't reach daemon on socket %s!\n", socketPath);
+        return -1;
+    }
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        fwrite(buffer, 1, n, stdout);
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ ******************************************************************************
+ *                               Option Routines
+ ******************************************************************************
+*/
+
+/* Parses a byte count with an optional K or M suffix. Exits on bad input */
+size_t parseSize (const char *arg) {
+    char *end;
+    unsigned long n = strtoul(arg, &end, 10);
+    if (end == arg) {
+        fprintf(stderr, "Error: Invalid size \"%s\"!\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    switch (*end) {
+        case 'k': case 'K': n *= 1024; end++; break;
+        case 'm': case 'M': n *= 1024 * 1024; end++; break;
+    }
+    if (*end != '\0') {
+        fprintf(stderr, "Error: Invalid size \"%s\"!\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    return n;
+}
+
+/* Parses a page cache policy name (cached, drop, or direct). Exits on bad input */
+int parseIoPolicy (const char *arg) {
+    const char *names[] = {"cached", "drop", "direct"};
+    int policies[] = {IO_CACHED, IO_DROP, IO_DIRECT};
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(arg, names[i]) == 0) {
+            return policies[i];
+        }
+    }
+    fprintf(stderr, "Error: Invalid I/O policy \"%s\"!\n", arg);
+    exit(EXIT_FAILURE);
+}
+
+/* Parses a dedupe action (reflink, link, or any). Exits on bad input */
+int parseDedupeMethods (const char *arg) {
+    if (strcmp(arg, "reflink") == 0) {
+        return DEDUPE_REFLINK;
+    }
+    if (strcmp(arg, "link") == 0) {
+        return DEDUPE_LINK;
+    }
+    if (strcmp(arg, "any") == 0) {
+        return DEDUPE_REFLINK | DEDUPE_LINK;
+    }
+    fprintf(stderr, "Error: Invalid dedupe action \"%s\"!\n", arg);
+    exit(EXIT_FAILURE);
+}
+
+/* Returns the statistics report format named by arg. Exits if invalid */
+int parseStatsFormat (const char *arg) {
+    if (strcmp(arg, "human") == 0) {
+        return STATS_HUMAN;
+    }
+    if (strcmp(arg, "json") == 0) {
+        return STATS_JSON;
+    }
+    fprintf(stderr, "Error: Invalid statistics format \"%s\"!\n", arg);
+    exit(EXIT_FAILURE);
+}
+
+/* Parses a throttle (bytes per second, optionally followed by ':' and reads per
+ * second, and by ':' and a latency target in milliseconds) and applies it.
+ * Zero rates are unlimited. Exits on bad input.
+*/
+void parseThrottle (char *arg) {
+    char *ops = strchr(arg, ':'), *latency = NULL, *end;
+    unsigned long opsPerSecond = 0, milliseconds = 0;
+    size_t bytesPerSecond;
+
+    if (ops != NULL) {
+        *ops++ = '\0';
+        if ((latency = strchr(ops, ':')) != NULL) {
+            *latency++ = '\0';
+        }
+    }
+    bytesPerSecond = parseSize(arg);
+    if (ops != NULL) {
+        opsPerSecond = strtoul(ops, &end, 10);
+        if (end == ops || *end != '\0') {
+            fprintf(stderr, "Error: Invalid read rate \"%s\"!\n", ops);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (latency != NULL) {
+        milliseconds = strtoul(latency, &end, 10);
+        if (end == latency || *end != '\0' || milliseconds == 0) {
+            fprintf(stderr, "Error: Invalid latency target \"%s\"!\n", latency);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (bytesPerSecond == 0 && opsPerSecond == 0) {
+        fprintf(stderr, "Error: A throttle needs a byte or read rate!\n");
+        exit(EXIT_FAILURE);
+    }
+    setThrottle(bytesPerSecond, opsPerSecond, milliseconds * 1000000ULL);
+}
+
+/* Prints program usage and exits */
+void usage (const char *program) {
+    fprintf(stderr, "Usage: %s [-vVdukp] [-b blocksize] [-j threads] [-c cachefile] "
+        "[-m memory] [-i cached|drop|direct] [-a reflink|link|any] [-C checkpoint] "
+        "[-S index] [-s human|json] [-P chunksize] [-t bytes/s[:reads/s[:ms]]] "
+        "[-D socket | -q socket] [directory | -M index...]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ ******************************************************************************
+ *                                   Main
+ ******************************************************************************
+*/
+
+int main (int argc, char *argv[]) {
+    const char *root = ".", *daemonSocket = NULL, *checkpointPath = NULL, *shardPath = NULL;
+    char *checkpointCache = NULL;
+    int opt, merging = 0;
+
+    report = stdout;
+
+    // Parse options.
+    while ((opt = getopt(argc, argv, "vVdukpMb:j:c:m:i:a:C:S:s:P:t:D:q:")) != -1) {
+        switch (opt) {
+            case 'v': verbose = 1; break;
+            case 'V': verify = 1; break;
+            case 'd': relative = 1; break;
+            case 'u': useUring = 1; break;
+            case 'k': kway = 1; break;
+            case 'p': physicalOrder = 1; break;
+            case 'b': setBlockSize(parseSize(optarg)); break;
+            case 'i': setIoPolicy(parseIoPolicy(optarg)); break;
+            case 'a': dedupeMethods = parseDedupeMethods(optarg); break;
+            case 'M': merging = 1; break;
+            case 'C': checkpointPath = optarg; break;
+            case 'S': shardPath = optarg; break;
+            case 's': enableStats(parseStatsFormat(optarg)); break;
+            case 't': parseThrottle(optarg); break;
+            case 'P':
+                if (setChunkSize(parseSize(optarg)) == -1) {
+                    usage(argv[0]);
+                }
+                chunking = 1;
+                break;
+            case 'D': daemonSocket = optarg; break;
+            case 'q': exit(queryDaemon(optarg) == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+            case 'j':
+                if ((threads = atoi(optarg)) < 1 || threads > MAX_WALKERS) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'c':
+                if ((cache = openCache(optarg)) == NULL) {
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                memoryBudget = MAX(MIN_MEMORY_BUDGET, parseSize(optarg));
+                break;
+            default: usage(argv[0]);
+        }
+    }
+
+    // Descriptor-relative scanning is sequential. The daemon scans that way,
+    // keeping the whole index (of fingerprints) in memory.
+    if ((relative || daemonSocket != NULL) && threads > 1) {
+        usage(argv[0]);
+    }
+    if (daemonSocket != NULL && (memoryBudget > 0 || kway || dedupeMethods)) {
+        usage(argv[0]);
+    }
+
+    // A scan takes (at most) one directory, and a merge one or more shard
+    // indexes. Shards are kept in memory, and not by the daemon. Shard workers
+    // only classify files: they don't partition in lockstep or replace files.
+    if ((merging && (optind == argc || argc - optind > USHRT_MAX)) || (!merging && argc - optind > 1)) {
+        usage(argv[0]);
+    }
+    if (!merging && optind < argc) {
+        root = argv[optind];
+    }
+    if ((merging || shardPath != NULL) && (memoryBudget > 0 || daemonSocket != NULL)) {
+        usage(argv[0]);
+    }
+    if ((merging && (shardPath != NULL || checkpointPath != NULL)) ||
+        (shardPath != NULL && (kway || dedupeMethods))) {
+        usage(argv[0]);
+    }
+
+    // Chunking indexes the whole (in-memory) file table itself.
+    if (chunking && (merging || shardPath != NULL || memoryBudget > 0 || daemonSocket != NULL ||
+        dedupeMethods)) {
+        usage(argv[0]);
+    }
+
+    // Checkpointed scans are sequential, by path. Fingerprints computed before a
+    // restart are kept in the given cache, or else in one beside the checkpoint.
+    if (checkpointPath != NULL && (threads > 1 || relative || daemonSocket != NULL)) {
+        usage(argv[0]);
+    }
+    if (checkpointPath != NULL) {
+        if (openCheckpoint(checkpointPath) == -1) {
+            exit(EXIT_FAILURE);
+        }
+        if (cache == NULL) {
+            checkpointCache = malloc(strlen(checkpointPath) + strlen(".cache") + 1);
+            assert(checkpointCache != NULL);
+            sprintf(checkpointCache, "%s.cache", checkpointPath);
+            if ((cache = openCache(checkpointCache)) == NULL) {
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    // Only duplicates confirmed byte by byte are replaced.
+    if (dedupeMethods) {
+        verify = 1;
+    }
+
+    // External-memory scans sort files by size in half the budget.
+    if (memoryBudget > 0) {
+        initSorter(&sizeSorter, memoryBudget / 2);
+    }
+
+    // Without io_uring, reads stay blocking.
+    if (useUring && initUring(getBlockSize()) == -1 && verbose) {
+        fprintf(stderr, "io_uring is unavailable. Using blocking reads.\n");
+    }
+
+    // Perform file-scanning routines, then report duplicates.
+    enterStage(STAGE_SCAN);
+    if (merging) {
+        mergeShards(argv + optind, argc - optind);
+    } else if (daemonSocket != NULL) {
+        runDaemon(root, daemonSocket);
+    } else if ((checkpointPath != NULL || relative || threads > 1) && scanRootFile(root)) {
+        // A file root was tabulated. The walkers only take directories.
+    } else if (checkpointPath != NULL) {
+        scanCheckpointed(root);
+    } else if (relative) {
+        scanTree(root, tabulateAt);
+    } else if (threads > 1) {
+        parallelScan(root, threads, tabulateFound, NULL);
+    } else {
+        scanFile(root);
+    }
+    enterStage(STAGE_OTHER);
+    if (memoryBudget > 0) {
+        findDuplicatesExternal();
+    } else if (chunking) {
+        findPartialDuplicates();
+    } else if (shardPath != NULL) {
+        writeShard(shardPath);
+    } else if (daemonSocket == NULL && !merging) {
+        findDuplicates();
+    }
+    if (dedupeMethods && verbose) {
+        fprintf(stderr, "Deduplicated %d files (%lld bytes).\n", dedupedCount, dedupedBytes);
+    }
+    printStats(stderr);
+
+    // Free file table and buffers.
+    freeFileTable();
+    freeDirNodes();
+    freeCompareBuffers();
+    freeFingerprintBuffer();
+    freeUring();
+    closeCache(cache);
+
+    // The scan is done: Its checkpoint (and own cache) are no longer needed.
+    closeCheckpoint(1);
+    if (checkpointCache != NULL) {
+        unlink(checkpointCache);
+        free(checkpointCache);
+    }
 }
@@ -0,0 +1,40 @@
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include "extent.h"
+
+/*
+ ******************************************************************************
+ *                               Extent Routines
+ ******************************************************************************
+*/
+
+/* Finds the physical byte offset on disk of the first extent of an open file.
+ * Returns -1 if the offset is unknown.
+*/
+int physicalOffset (int fd, uint64_t *offset_p) {
+    uint64_t buffer[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(uint64_t) + 1];
+    struct fiemap *map = (struct fiemap *)buffer;
+    int block = 0, blockSize;
+
+    // Ask for the first extent only.
+    memset(buffer, 0, sizeof(buffer));
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == 0) {
+        if (map->fm_mapped_extents == 0 ||
+            (map->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))) {
+            return -1;
+        }
+        *offset_p = map->fm_extents[0].fe_physical;
+        return 0;
+    }
+
+    // Older filesystems only map single blocks (and only for privileged users).
+    if (ioctl(fd, FIGETBSZ, &blockSize) == 0 && ioctl(fd, FIBMAP, &block) == 0 && block != 0) {
+        *offset_p = (uint64_t)block * blockSize;
+        return 0;
+    }
+    return -1;
+}
@@ -0,0 +1,22 @@
+#if !defined(EXTENT_H)
+#define EXTENT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ ******************************************************************************
+ *                               Extent Routines
+ ******************************************************************************
+*/
+
+/* Finds the physical byte offset on disk of the first extent of an open file.
+ * - Asks for the extent map (FIEMAP), falling back to the block map (FIBMAP).
+ * - Returns -1 if the offset is unknown (no extents, inline data, or neither
+ *   map is supported).
+*/
+int physicalOffset (int fd, uint64_t *offset_p);
+
+#endif
@@ -0,0 +1,376 @@
+#define _POSIX_C_SOURCE 200809L
+#include "external.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* Path store descriptor (-1 until first use) and its length */
+static int pathFd = -1;
+static off_t pathLength;
+
+/* Path store write buffer, and the number of bytes in it */
+static char *pathBuffer;
+static size_t pathBuffered;
+
+/*
+ ******************************************************************************
+ *                           Internal File Routines
+ ******************************************************************************
+*/
+
+/* Creates an anonymous spill file in $TMPDIR (or /tmp). Exits on error */
+static int spillFile (void) {
+    const char *dir = getenv("TMPDIR");
+    char *path;
+    int fd;
+
+    dir = (dir == NULL || *dir == '\0') ? "/tmp" : dir;
+    path = malloc(strlen(dir) + sizeof("/dupspill.XXXXXX"));
+    assert(path != NULL);
+    sprintf(path, "%s/dupspill.XXXXXX", dir);
+
+    // The file is unlinked at once, so it vanishes with the descriptor.
+    if ((fd = mkstemp(path)) == -1) {
+        fprintf(stderr, "Error: Couldn't create spill file in %s!\n", dir);
+        exit(EXIT_FAILURE);
+    }
+    unlink(path);
+    free(path);
+    return fd;
+}
+
+/* Writes all of a buffer at an offset. Exits on error */
+static void writeAt (int fd, const void *buffer, size_t n, off_t offset) {
+    const char *p = buffer;
+    ssize_t w;
+    while (n > 0) {
+        if ((w = pwrite(fd, p, n, offset)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: Couldn't write spill file!\n");
+            exit(EXIT_FAILURE);
+        }
+        p += w; n -= w; offset += w;
+    }
+}
+
+/* Reads up to n bytes at an offset. Exits on error. Returns bytes read */
+static size_t readAt (int fd, void *buffer, size_t n, off_t offset) {
+    size_t total = 0;
+    ssize_t r;
+    while (total < n) {
+        if ((r = pread(fd, (char *)buffer + total, n - total, offset + total)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: Couldn't read spill file!\n");
+            exit(EXIT_FAILURE);
+        }
+        if (r == 0) {
+            break;
+        }
+        total += r;
+    }
+    return total;
+}
+
+/*
+ ******************************************************************************
+ *                          Internal Sorter Routines
+ ******************************************************************************
+*/
+
+/* Orders records by (size, sample), then path (i.e. scan order) */
+static int bySpillOrder (const void *a, const void *b) {
+    const SpillRecord *x = a, *y = b;
+    int c = compareSpillKeys(x, y);
+    if (c != 0) {
+        return c;
+    }
+    return (x->pathOffset < y->pathOffset) ? -1 : (x->pathOffset > y->pathOffset);
+}
+
+/* Appends a run descriptor to the sorter */
+static void addRun (Sorter *s, int fd) {
+    if (s->runCount == s->runCapacity) {
+        s->runCapacity = (s->runCapacity == 0) ? 16 : s->runCapacity * 2;
+        s->runs = realloc(s->runs, s->runCapacity * sizeof(int));
+        assert(s->runs != NULL);
+    }
+    s->runs[s->runCount++] = fd;
+}
+
+/* Sorts the buffered records and spills them as a run */
+static void spillRun (Sorter *s) {
+    int fd = spillFile();
+    qsort(s->buffer, s->count, sizeof(SpillRecord), bySpillOrder);
+    writeAt(fd, s->buffer, s->count * sizeof(SpillRecord), 0);
+    addRun(s, fd);
+    s->count = 0;
+}
+
+/* Returns the current record of a merge input, refilling its block as needed.
+ * Returns NULL once the input is exhausted.
+*/
+static SpillRecord *peekInput (MergeInput *in) {
+    size_t blockRecords = MERGE_BLOCK_SIZE / sizeof(SpillRecord), n;
+    if (in->position == in->count) {
+        n = readAt(in->fd, in->block, blockRecords * sizeof(SpillRecord), in->offset);
+        in->offset += n;
+        in->count = n / sizeof(SpillRecord);
+        in->position = 0;
+        if (in->count == 0) {
+            return NULL;
+        }
+    }
+    return in->block + in->position;
+}
+
+/* Orders two heap entries (input indices) by their current records */
+static int heapLess (Sorter *s, int a, int b) {
+    return bySpillOrder(peekInput(s->inputs + a), peekInput(s->inputs + b)) < 0;
+}
+
+/* Restores the heap property downward from index i */
+static void siftDown (Sorter *s, int i) {
+    int child, t;
+    while ((child = 2 * i + 1) < s->heapSize) {
+        if (child + 1 < s->heapSize && heapLess(s, s->heap[child + 1], s->heap[child])) {
+            child++;
+        }
+        if (!heapLess(s, s->heap[child], s->heap[i])) {
+            break;
+        }
+        t = s->heap[i]; s->heap[i] = s->heap[child]; s->heap[child] = t;
+        i = child;
+    }
+}
+
+/* Opens a heap over the first n runs */
+static void openMerge (Sorter *s, int n) {
+    s->inputs = calloc(n, sizeof(MergeInput));
+    s->heap = malloc(n * sizeof(int));
+    assert(s->inputs != NULL && s->heap != NULL);
+    s->heapSize = 0;
+    for (int i = 0; i < n; i++) {
+        s->inputs[i].fd = s->runs[i];
+        s->inputs[i].block = malloc(MERGE_BLOCK_SIZE);
+        assert(s->inputs[i].block != NULL);
+        if (peekInput(s->inputs + i) != NULL) {
+            s->heap[s->heapSize++] = i;
+        }
+    }
+    for (int i = s->heapSize / 2 - 1; i >= 0; i--) {
+        siftDown(s, i);
+    }
+}
+
+/* Pops the least record off the merge heap. Returns zero if empty */
+static int popMerge (Sorter *s, SpillRecord *r) {
+    MergeInput *in;
+    if (s->heapSize == 0) {
+        return 0;
+    }
+    in = s->inputs + s->heap[0];
+    *r = *peekInput(in);
+    in->position++;
+    if (peekInput(in) == NULL) {
+        s->heap[0] = s->heap[--s->heapSize];
+    }
+    siftDown(s, 0);
+    return 1;
+}
+
+/* Closes the merge over the first n runs, closing them too */
+static void closeMerge (Sorter *s, int n) {
+    for (int i = 0; i < n; i++) {
+        close(s->inputs[i].fd);
+        free(s->inputs[i].block);
+    }
+    free(s->inputs);
+    free(s->heap);
+    s->inputs = NULL;
+    s->heap = NULL;
+    s->heapSize = 0;
+}
+
+/* Merges the first fanIn runs into one new run at the end */
+static void mergeRuns (Sorter *s) {
+    size_t blockRecords = MERGE_BLOCK_SIZE / sizeof(SpillRecord), n = 0;
+    SpillRecord *out = malloc(blockRecords * sizeof(SpillRecord));
+    int fd = spillFile();
+    off_t offset = 0;
+    assert(out != NULL);
+
+    openMerge(s, s->fanIn);
+    while (popMerge(s, out + n)) {
+        if (++n == blockRecords) {
+            writeAt(fd, out, n * sizeof(SpillRecord), offset);
+            offset += n * sizeof(SpillRecord);
+            n = 0;
+        }
+    }
+    writeAt(fd, out, n * sizeof(SpillRecord), offset);
+    closeMerge(s, s->fanIn);
+    free(out);
+
+    memmove(s->runs, s->runs + s->fanIn, (s->runCount - s->fanIn) * sizeof(int));
+    s->runCount -= s->fanIn;
+    addRun(s, fd);
+}
+
+/*
+ ******************************************************************************
+ *                               Sorter Routines
+ ******************************************************************************
+*/
+
+/* Initializes a sorter that uses about 'budget' bytes of memory */
+void initSorter (Sorter *s, size_t budget) {
+    memset(s, 0, sizeof(*s));
+    budget = (budget < MIN_MEMORY_BUDGET) ? MIN_MEMORY_BUDGET : budget;
+    s->capacity = budget / sizeof(SpillRecord);
+    s->fanIn = budget / MERGE_BLOCK_SIZE;
+    s->fanIn = (s->fanIn < MIN_MERGE_FAN_IN) ? MIN_MERGE_FAN_IN : s->fanIn;
+    s->fanIn = (s->fanIn > MAX_MERGE_FAN_IN) ? MAX_MERGE_FAN_IN : s->fanIn;
+}
+
+/* Adds a record to the sorter */
+void sorterAdd (Sorter *s, const SpillRecord *r) {
+    if (s->buffer == NULL) {
+        s->buffer = malloc(s->capacity * sizeof(SpillRecord));
+        assert(s->buffer != NULL);
+    }
+    if (s->count == s->capacity) {
+        spillRun(s);
+    }
+    s->buffer[s->count++] = *r;
+}
+
+/* Ends input. Merges spilled runs until one merge pass remains */
+void sorterFinish (Sorter *s) {
+
+    // Everything fit: just sort in memory.
+    if (s->runCount == 0) {
+        qsort(s->buffer, s->count, sizeof(SpillRecord), bySpillOrder);
+        return;
+    }
+
+    // Spill the remainder and release the buffer for the merge blocks.
+    if (s->count > 0) {
+        spillRun(s);
+    }
+    free(s->buffer);
+    s->buffer = NULL;
+
+    while (s->runCount > s->fanIn) {
+        mergeRuns(s);
+    }
+    openMerge(s, s->runCount);
+}
+
+/* Writes the next record in sorted order to r. Returns zero when exhausted */
+int sorterNext (Sorter *s, SpillRecord *r) {
+    if (s->runCount == 0) {
+        if (s->next == s->count) {
+            return 0;
+        }
+        *r = s->buffer[s->next++];
+        return 1;
+    }
+    return popMerge(s, r);
+}
+
+/* Returns negative, zero, or positive as a's (size, sample) orders before,
+ * equal to, or after b's
+*/
+int compareSpillKeys (const SpillRecord *a, const SpillRecord *b) {
+    if (a->size != b->size) {
+        return (a->size < b->size) ? -1 : 1;
+    }
+    return compareFingerprints(a->sample, b->sample);
+}
+
+/* Frees the sorter and its runs */
+void freeSorter (Sorter *s) {
+    if (s->inputs != NULL) {
+        closeMerge(s, s->runCount);
+    } else {
+        for (int i = 0; i < s->runCount; i++) {
+            close(s->runs[i]);
+        }
+    }
+    free(s->runs);
+    free(s->buffer);
+    memset(s, 0, sizeof(*s));
+}
+
+/*
+ ******************************************************************************
+ *                             Path Store Routines
+ ******************************************************************************
+*/
+
+/* Writes out the buffered part of the path store */
+static void flushPaths (void) {
+    writeAt(pathFd, pathBuffer, pathBuffered, pathLength - pathBuffered);
+    pathBuffered = 0;
+}
+
+/* Appends a path to the on-disk path store. Sets the record's path fields */
+void storePath (SpillRecord *r, const char *path) {
+    size_t n = strlen(path);
+    if (pathFd == -1) {
+        pathFd = spillFile();
+        pathBuffer = malloc(PATH_BUFFER_SIZE);
+        assert(pathBuffer != NULL);
+    }
+    if (pathBuffered + n > PATH_BUFFER_SIZE) {
+        flushPaths();
+    }
+
+    // Paths longer than the buffer are written directly.
+    r->pathOffset = pathLength;
+    r->pathLength = n;
+    if (n > PATH_BUFFER_SIZE) {
+        writeAt(pathFd, path, n, pathLength);
+    } else {
+        memcpy(pathBuffer + pathBuffered, path, n);
+        pathBuffered += n;
+    }
+    pathLength += n;
+}
+
+/* Reads a record's path into a buffer, growing it as needed. Returns it */
+char *loadPath (const SpillRecord *r, char **bp, int *size_p) {
+    if (pathBuffered > 0) {
+        flushPaths();
+    }
+    if (*bp == NULL || *size_p < (int)r->pathLength + 1) {
+        *bp = realloc(*bp, r->pathLength + 1);
+        assert(*bp != NULL);
+        *size_p = r->pathLength + 1;
+    }
+    readAt(pathFd, *bp, r->pathLength, r->pathOffset);
+    (*bp)[r->pathLength] = '\0';
+    return *bp;
+}
+
+/* Closes the path store */
+void freePathStore (void) {
+    if (pathFd != -1) {
+        close(pathFd);
+    }
+    free(pathBuffer);
+    pathBuffer = NULL;
+    pathFd = -1;
+    pathLength = 0;
+    pathBuffered = 0;
+}
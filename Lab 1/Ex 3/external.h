@@ -0,0 +1,109 @@
+#if !defined(EXTERNAL_H)
+#define EXTERNAL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <sys/types.h>
+#include "fingerprint.h"
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Bytes of buffer per run while merging.
+#define MERGE_BLOCK_SIZE            (64 * 1024)
+
+// Limits on the number of runs merged at once.
+#define MIN_MERGE_FAN_IN            2
+#define MAX_MERGE_FAN_IN            512
+
+// Bytes of path store writes buffered before writing them out.
+#define PATH_BUFFER_SIZE            (64 * 1024)
+
+// Smallest accepted memory budget.
+#define MIN_MEMORY_BUDGET           (1024 * 1024)
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Spill Record: A file as spilled to disk. Its path lives in the path store */
+typedef struct {
+    int64_t size;
+    uint64_t dev, ino;
+    int64_t mtimeSec, mtimeNsec;
+    uint64_t pathOffset;
+    uint32_t pathLength, reserved;
+    Fingerprint sample;
+} SpillRecord;
+
+/* Merge Input: A spilled run being read back block by block */
+typedef struct {
+    int fd;
+    off_t offset;
+    SpillRecord *block;
+    size_t count, position;
+} MergeInput;
+
+/* Sorter: Sorts records by (size, sample, path) within a memory budget.
+ * Records are buffered, spilled as sorted runs when the buffer fills, and
+ * merged back k ways.
+*/
+typedef struct {
+    size_t capacity, count, next;       // Buffered records.
+    SpillRecord *buffer;
+    int *runs;                          // Spilled run descriptors.
+    int runCount, runCapacity, fanIn;
+    MergeInput *inputs;                 // Final merge: inputs and heap.
+    int *heap, heapSize;
+} Sorter;
+
+/*
+ ******************************************************************************
+ *                               Sorter Routines
+ ******************************************************************************
+*/
+
+/* Initializes a sorter that uses about 'budget' bytes of memory */
+void initSorter (Sorter *s, size_t budget);
+
+/* Adds a record to the sorter */
+void sorterAdd (Sorter *s, const SpillRecord *r);
+
+/* Ends input. Merges spilled runs until one merge pass remains */
+void sorterFinish (Sorter *s);
+
+/* Writes the next record in sorted order to r. Returns zero when exhausted */
+int sorterNext (Sorter *s, SpillRecord *r);
+
+/* Returns negative, zero, or positive as a's (size, sample) orders before,
+ * equal to, or after b's
+*/
+int compareSpillKeys (const SpillRecord *a, const SpillRecord *b);
+
+/* Frees the sorter and its runs */
+void freeSorter (Sorter *s);
+
+/*
+ ******************************************************************************
+ *                             Path Store Routines
+ ******************************************************************************
+*/
+
+/* Appends a path to the on-disk path store. Sets the record's path fields */
+void storePath (SpillRecord *r, const char *path);
+
+/* Reads a record's path into a buffer, growing it as needed. Returns it */
+char *loadPath (const SpillRecord *r, char **bp, int *size_p);
+
+/* Closes the path store */
+void freePathStore (void);
+
+#endif
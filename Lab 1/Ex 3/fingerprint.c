@@ -0,0 +1,278 @@
+#define _POSIX_C_SOURCE 200809L
+#include "fingerprint.h"
+#include "compare.h"
+#include "kernel.h"
+#include "stats.h"
+#include "throttle.h"
+#include <pthread.h>
+
+/*
+ * The fingerprint is an XXH3-style hash: eight 64-bit lanes each absorb a
+ * 32x32->64 bit product of the input keyed with a secret, and are scrambled
+ * every block of stripes. It is not compatible with XXH3 itself. The stripe
+ * loop is run by the fastest hash kernel the CPU supports.
+*/
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+#define PRIME64_1                   0x9E3779B185EBCA87ULL
+#define PRIME64_2                   0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3                   0x165667B19E3779F9ULL
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* Hash secret. Generated on first use */
+static unsigned char secret[SECRET_SIZE];
+
+/* Hash kernel running the stripe loop. Selected on first use */
+static const HashKernel *kernel;
+
+/* Runs initSecret once, whichever thread fingerprints first */
+static pthread_once_t secretOnce = PTHREAD_ONCE_INIT;
+
+/* Aligned file reading buffer */
+static unsigned char *fileBuffer;
+
+/*
+ ******************************************************************************
+ *                          Internal Hash Routines
+ ******************************************************************************
+*/
+
+/* Reads an unaligned little-endian 64-bit word */
+static uint64_t read64 (const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Returns the next value of a splitmix64 sequence */
+static uint64_t splitmix64 (uint64_t *state) {
+    uint64_t z = (*state += PRIME64_1);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* Generates the (fixed) secret, and selects the hash kernel unless one was
+ * set. Run through secretOnce.
+*/
+static void initSecret (void) {
+    uint64_t seed = PRIME64_3, v;
+    if (kernel == NULL) {
+        kernel = bestKernel();
+    }
+    for (int i = 0; i < SECRET_SIZE; i += sizeof(v)) {
+        v = splitmix64(&seed);
+        memcpy(secret + i, &v, sizeof(v));
+    }
+}
+
+/* Multiplies two 64-bit words to 128 bits and folds the halves together */
+static uint64_t mulFold64 (uint64_t a, uint64_t b) {
+    __uint128_t p = (__uint128_t)a * b;
+    return (uint64_t)p ^ (uint64_t)(p >> 64);
+}
+
+/* Final mixing of a 64-bit word */
+static uint64_t avalanche (uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    return h ^ (h >> 32);
+}
+
+/* Merges the lanes into 64 bits using the secret at the given offset */
+static uint64_t mergeLanes (const uint64_t acc[8], int offset, uint64_t start) {
+    uint64_t h = start;
+    for (int i = 0; i < 4; i++) {
+        h += mulFold64(acc[2 * i] ^ read64(secret + offset + 16 * i),
+                       acc[2 * i + 1] ^ read64(secret + offset + 16 * i + 8));
+    }
+    return avalanche(h);
+}
+
+/*
+ ******************************************************************************
+ *                            Fingerprint Routines
+ ******************************************************************************
+*/
+
+/* Initializes a streaming fingerprint state */
+void initFingerprint (FingerprintState *state) {
+    pthread_once(&secretOnce, initSecret);
+    memset(state, 0, sizeof(*state));
+    state->acc[0] = PRIME32_1;
+    state->acc[1] = PRIME64_1;
+    state->acc[2] = PRIME64_2;
+    state->acc[3] = PRIME64_3;
+    state->acc[4] = ~PRIME64_1;
+    state->acc[5] = ~PRIME64_2;
+    state->acc[6] = ~PRIME64_3;
+    state->acc[7] = ~(uint64_t)PRIME32_1;
+}
+
+/* Consumes n bytes of data into the fingerprint state */
+void updateFingerprint (FingerprintState *state, const void *data, size_t n) {
+    const unsigned char *p = data;
+    size_t take;
+    state->length += n;
+
+    // Complete a partial stripe first.
+    if (state->buffered > 0) {
+        take = STRIPE_SIZE - state->buffered;
+        take = (take > n) ? n : take;
+        memcpy(state->buffer + state->buffered, p, take);
+        state->buffered += take;
+        p += take; n -= take;
+        if (state->buffered < STRIPE_SIZE) {
+            return;
+        }
+        kernel->consume(state->acc, state->buffer, 1, &state->stripes, secret);
+        state->buffered = 0;
+    }
+
+    // Consume whole stripes directly from the input.
+    kernel->consume(state->acc, p, n / STRIPE_SIZE, &state->stripes, secret);
+    p += n - n % STRIPE_SIZE;
+    n %= STRIPE_SIZE;
+
+    // Keep the remainder for later.
+    memcpy(state->buffer, p, n);
+    state->buffered = n;
+}
+
+/* Returns the fingerprint of all data consumed so far */
+Fingerprint finalFingerprint (const FingerprintState *state) {
+    uint64_t acc[8];
+    unsigned char last[STRIPE_SIZE] = {0};
+    memcpy(acc, state->acc, sizeof(acc));
+
+    // Absorb the zero-padded partial stripe. The length disambiguates it.
+    if (state->buffered > 0) {
+        memcpy(last, state->buffer, state->buffered);
+        accumulateStripe(acc, last, secret + 8 * state->stripes);
+    }
+
+    return (Fingerprint){
+        .lo = mergeLanes(acc, 11, state->length * PRIME64_1),
+        .hi = mergeLanes(acc, SCRAMBLE_OFFSET - 75, ~(state->length * PRIME64_2))
+    };
+}
+
+/* Returns the fingerprint of a buffer */
+Fingerprint fingerprint (const void *data, size_t n) {
+    FingerprintState state;
+    initFingerprint(&state);
+    updateFingerprint(&state, data, n);
+    return finalFingerprint(&state);
+}
+
+/* Selects the hash kernel (see kernel.h) to fingerprint with. It must be one
+ * the host supports.
+*/
+void setHashKernel (const HashKernel *k) {
+    kernel = k;
+}
+
+/* Returns negative, zero, or positive as a orders before, equal, or after b */
+int compareFingerprints (Fingerprint a, Fingerprint b) {
+    if (a.hi != b.hi) {
+        return (a.hi < b.hi) ? -1 : 1;
+    }
+    if (a.lo != b.lo) {
+        return (a.lo < b.lo) ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ ******************************************************************************
+ *                          File Fingerprint Routines
+ ******************************************************************************
+*/
+
+/* Allocates the file buffer if it doesn't exist yet */
+static void initFingerprintBuffer (void) {
+    if (fileBuffer != NULL) {
+        return;
+    }
+    if (posix_memalign((void **)&fileBuffer, BLOCK_ALIGNMENT, MAX_BLOCK_SIZE) != 0) {
+        fprintf(stderr, "Error: Couldn't allocate fingerprint buffer!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Fingerprints the first and last SAMPLE_SIZE bytes of a file of given size.
+ * - If the file is no larger than 2 * SAMPLE_SIZE, this covers all of it
+ *   and equals the result of fingerprintFile.
+ * - Returns -1 on a read error, otherwise zero.
+*/
+int fingerprintSample (int fd, off_t size, Fingerprint *fp) {
+    ssize_t head, tail = 0;
+    uint64_t t, u;
+    initFingerprintBuffer();
+
+    // Small files are sampled whole.
+    if (size <= 2 * SAMPLE_SIZE) {
+        return fingerprintFile(fd, fp);
+    }
+
+    // Otherwise read the head and tail samples back to back.
+    u = throttleRead(SAMPLE_SIZE);
+    t = startTimer();
+    head = pread(fd, fileBuffer, SAMPLE_SIZE, 0);
+    stopTimer(HIST_READ, t);
+    throttleDone(u);
+    if (head == -1) {
+        return -1;
+    }
+    u = throttleRead(SAMPLE_SIZE);
+    t = startTimer();
+    tail = pread(fd, fileBuffer + head, SAMPLE_SIZE, size - SAMPLE_SIZE);
+    stopTimer(HIST_READ, t);
+    throttleDone(u);
+    if (tail == -1) {
+        return -1;
+    }
+    countStat(STAT_BYTES_READ, head + tail);
+    *fp = fingerprint(fileBuffer, head + tail);
+    return 0;
+}
+
+/* Fingerprints the full content of a file, skipping the reads of any holes.
+ * Returns -1 on read error.
+*/
+int fingerprintFile (int fd, Fingerprint *fp) {
+    FingerprintState state;
+    SparseCursor cursor;
+    ssize_t r;
+    initFingerprintBuffer();
+    initFingerprint(&state);
+
+    // Holes are hashed as the zeros they read as, without reading them.
+    if (lseek(fd, 0, SEEK_SET) == -1 || openCursor(&cursor, fd) == -1) {
+        return -1;
+    }
+    while ((r = readSparse(&cursor, fileBuffer, getBlockSize())) > 0) {
+        updateFingerprint(&state, fileBuffer, r);
+    }
+    if (r == -1) {
+        return -1;
+    }
+    *fp = finalFingerprint(&state);
+    return 0;
+}
+
+/* Free's the file fingerprinting buffer */
+void freeFingerprintBuffer (void) {
+    free(fileBuffer);
+    fileBuffer = NULL;
+}
@@ -0,0 +1,94 @@
+#if !defined(FINGERPRINT_H)
+#define FINGERPRINT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <sys/types.h>
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Bytes consumed per accumulation step (eight 64-bit lanes).
+#define STRIPE_SIZE                 64
+
+// Stripes accumulated between scrambles of the accumulators.
+#define STRIPES_PER_BLOCK           16
+
+// Bytes sampled from each of the head and tail of a file.
+#define SAMPLE_SIZE                 4096
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* 128-bit content fingerprint */
+typedef struct {
+    uint64_t lo, hi;
+} Fingerprint;
+
+/* Streaming fingerprint state */
+typedef struct {
+    uint64_t acc[8];                        // Lane accumulators.
+    unsigned char buffer[STRIPE_SIZE];      // Partial stripe.
+    size_t buffered;                        // Bytes in partial stripe.
+    size_t stripes;                         // Stripes in current block.
+    uint64_t length;                        // Total bytes consumed.
+} FingerprintState;
+
+/*
+ ******************************************************************************
+ *                            Fingerprint Routines
+ ******************************************************************************
+*/
+
+/* Initializes a streaming fingerprint state */
+void initFingerprint (FingerprintState *state);
+
+/* Consumes n bytes of data into the fingerprint state */
+void updateFingerprint (FingerprintState *state, const void *data, size_t n);
+
+/* Returns the fingerprint of all data consumed so far */
+Fingerprint finalFingerprint (const FingerprintState *state);
+
+/* Returns the fingerprint of a buffer */
+Fingerprint fingerprint (const void *data, size_t n);
+
+/* Selects the hash kernel (see kernel.h) to fingerprint with. It must be one
+ * the host supports.
+*/
+struct hashKernel;
+void setHashKernel (const struct hashKernel *k);
+
+/* Returns negative, zero, or positive as a orders before, equal, or after b */
+int compareFingerprints (Fingerprint a, Fingerprint b);
+
+/*
+ ******************************************************************************
+ *                          File Fingerprint Routines
+ ******************************************************************************
+*/
+
+/* Fingerprints the first and last SAMPLE_SIZE bytes of a file of given size.
+ * - If the file is no larger than 2 * SAMPLE_SIZE, this covers all of it
+ *   and equals the result of fingerprintFile.
+ * - Returns -1 on a read error, otherwise zero.
+*/
+int fingerprintSample (int fd, off_t size, Fingerprint *fp);
+
+/* Fingerprints the full content of a file, skipping the reads of any holes.
+ * Returns -1 on read error.
+*/
+int fingerprintFile (int fd, Fingerprint *fp);
+
+/* Free's the file fingerprinting buffer */
+void freeFingerprintBuffer (void);
+
+#endif
@@ -0,0 +1,99 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fingerprint.h"
+#include "kernel.h"
+
+/*
+ ******************************************************************************
+ *                   Hash Kernel Microbenchmark (make hashbench)
+ ******************************************************************************
+*/
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Bytes hashed per timed pass (fits in the last-level cache of most hosts).
+#define BENCH_BUFFER_SIZE           (4 * 1024 * 1024)
+
+// Minimum time to measure each kernel over, in seconds.
+#define BENCH_SECONDS               1.0
+
+// Largest input of the agreement check, in bytes.
+#define CHECK_MAX_SIZE              4096
+
+/*
+ ******************************************************************************
+ *                              Benchmark Routines
+ ******************************************************************************
+*/
+
+/* Returns monotonic time in seconds */
+static double now (void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Returns nonzero if the current kernel fingerprints every length (and
+ * misalignment) of the buffer as the reference fingerprints say.
+*/
+static int agrees (const unsigned char *buffer, const Fingerprint *reference) {
+    for (int n = 0; n <= CHECK_MAX_SIZE; n++) {
+        if (compareFingerprints(fingerprint(buffer + n % 7, n), reference[n]) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Returns the throughput of the current kernel in GB/s */
+static double throughput (const unsigned char *buffer) {
+    volatile uint64_t sink = 0;
+    double start = now(), elapsed;
+    long passes = 0;
+    do {
+        sink += fingerprint(buffer, BENCH_BUFFER_SIZE).lo;
+        passes++;
+    } while ((elapsed = now() - start) < BENCH_SECONDS);
+    return (double)passes * BENCH_BUFFER_SIZE / elapsed / 1e9;
+}
+
+int main (void) {
+    unsigned char *buffer = malloc(BENCH_BUFFER_SIZE);
+    Fingerprint reference[CHECK_MAX_SIZE + 1];
+    const HashKernel *const *kernels;
+    int count;
+
+    if (buffer == NULL) {
+        fprintf(stderr, "Error: Couldn't allocate benchmark buffer!\n");
+        exit(EXIT_FAILURE);
+    }
+    srand(1);
+    for (int i = 0; i < BENCH_BUFFER_SIZE; i++) {
+        buffer[i] = rand();
+    }
+
+    // The scalar kernel is the reference every other kernel must agree with.
+    kernels = supportedKernels(&count);
+    setHashKernel(kernels[0]);
+    for (int n = 0; n <= CHECK_MAX_SIZE; n++) {
+        reference[n] = fingerprint(buffer + n % 7, n);
+    }
+
+    printf("%-10s %10s  %s\n", "kernel", "GB/s", "agrees");
+    for (int i = 0; i < count; i++) {
+        setHashKernel(kernels[i]);
+        printf("%-10s %10.2f  %s\n", kernels[i]->name, throughput(buffer),
+            agrees(buffer, reference) ? "yes" : "NO");
+    }
+    printf("Selected: %s\n", bestKernel()->name);
+
+    free(buffer);
+    return 0;
+}
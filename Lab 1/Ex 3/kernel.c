@@ -0,0 +1,340 @@
+#define _POSIX_C_SOURCE 200809L
+#include "kernel.h"
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define X86_KERNELS
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/*
+ * Every kernel keeps the eight lanes in registers across a run of stripes.
+ * Per lane i and stripe word d (keyed to k = d ^ key), a stripe adds d to
+ * lane i ^ 1 and the 32x32->64 bit product of the halves of k to lane i. A
+ * scramble sets each lane a to ((a ^ (a >> 47)) ^ key) * PRIME32_1.
+*/
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// CPU features kernels depend on.
+#define CPU_SSE2                    1
+#define CPU_AVX2                    2
+#define CPU_AVX512                  4
+
+// XCR0 state the OS must save for AVX (SSE, AVX) and AVX-512 (also opmask, ZMM).
+#define XCR0_AVX                    0x06
+#define XCR0_AVX512                 0xE6
+
+// Kernel selection: Bytes each kernel is timed over, and times it is (keeping
+// its best).
+#define CALIBRATION_SIZE            (64 * 1024)
+#define CALIBRATION_ROUNDS          5
+
+/*
+ ******************************************************************************
+ *                               Scalar Kernel
+ ******************************************************************************
+*/
+
+/* Reads an unaligned little-endian 64-bit word */
+static uint64_t read64 (const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Accumulates one stripe into the lanes using the given stripe key (scalar) */
+void accumulateStripe (uint64_t acc[8], const unsigned char *stripe, const unsigned char *key) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t d = read64(stripe + 8 * i);
+        uint64_t k = d ^ read64(key + 8 * i);
+        acc[i ^ 1] += d;
+        acc[i] += (k & 0xFFFFFFFFULL) * (k >> 32);
+    }
+}
+
+/* Scalar stripe loop */
+static void consumeScalar (uint64_t acc[8], const unsigned char *data, size_t n,
+    size_t *stripes_p, const unsigned char *secret) {
+    const unsigned char *key = secret + SCRAMBLE_OFFSET;
+    size_t s = *stripes_p;
+    uint64_t a[8];
+    memcpy(a, acc, sizeof(a));
+
+    for (; n > 0; n--, data += STRIPE_SIZE) {
+        accumulateStripe(a, data, secret + 8 * s);
+        if (++s < STRIPES_PER_BLOCK) {
+            continue;
+        }
+        for (int i = 0; i < 8; i++) {
+            a[i] = ((a[i] ^ (a[i] >> 47)) ^ read64(key + 8 * i)) * PRIME32_1;
+        }
+        s = 0;
+    }
+
+    memcpy(acc, a, sizeof(a));
+    *stripes_p = s;
+}
+
+static const HashKernel scalarKernel = {"scalar", consumeScalar};
+
+#if defined(X86_KERNELS)
+
+/*
+ ******************************************************************************
+ *                                SSE2 Kernel
+ ******************************************************************************
+*/
+
+/* SSE2 stripe loop: Two lanes per register */
+__attribute__((target("sse2")))
+static void consumeSse2 (uint64_t acc[8], const unsigned char *data, size_t n,
+    size_t *stripes_p, const unsigned char *secret) {
+    const unsigned char *key = secret + SCRAMBLE_OFFSET;
+    const __m128i prime = _mm_set1_epi32((int)PRIME32_1);
+    size_t s = *stripes_p;
+    __m128i a[4], d, k, x;
+
+    for (int i = 0; i < 4; i++) {
+        a[i] = _mm_loadu_si128((const __m128i *)acc + i);
+    }
+    for (; n > 0; n--, data += STRIPE_SIZE) {
+        for (int i = 0; i < 4; i++) {
+            d = _mm_loadu_si128((const __m128i *)data + i);
+            k = _mm_xor_si128(d, _mm_loadu_si128((const __m128i *)(secret + 8 * s) + i));
+            a[i] = _mm_add_epi64(a[i], _mm_mul_epu32(k, _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1))));
+            a[i] = _mm_add_epi64(a[i], _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+        }
+        if (++s < STRIPES_PER_BLOCK) {
+            continue;
+        }
+        for (int i = 0; i < 4; i++) {
+            x = _mm_xor_si128(a[i], _mm_srli_epi64(a[i], 47));
+            x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)key + i));
+            a[i] = _mm_add_epi64(_mm_mul_epu32(x, prime),
+                _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(x, 32), prime), 32));
+        }
+        s = 0;
+    }
+    for (int i = 0; i < 4; i++) {
+        _mm_storeu_si128((__m128i *)acc + i, a[i]);
+    }
+    *stripes_p = s;
+}
+
+static const HashKernel sse2Kernel = {"sse2", consumeSse2};
+
+/*
+ ******************************************************************************
+ *                                AVX2 Kernel
+ ******************************************************************************
+*/
+
+/* AVX2 stripe loop: Four lanes per register */
+__attribute__((target("avx2")))
+static void consumeAvx2 (uint64_t acc[8], const unsigned char *data, size_t n,
+    size_t *stripes_p, const unsigned char *secret) {
+    const unsigned char *key = secret + SCRAMBLE_OFFSET;
+    const __m256i prime = _mm256_set1_epi32((int)PRIME32_1);
+    size_t s = *stripes_p;
+    __m256i a[2], d, k, x;
+
+    for (int i = 0; i < 2; i++) {
+        a[i] = _mm256_loadu_si256((const __m256i *)acc + i);
+    }
+    for (; n > 0; n--, data += STRIPE_SIZE) {
+        for (int i = 0; i < 2; i++) {
+            d = _mm256_loadu_si256((const __m256i *)data + i);
+            k = _mm256_xor_si256(d, _mm256_loadu_si256((const __m256i *)(secret + 8 * s) + i));
+            a[i] = _mm256_add_epi64(a[i], _mm256_mul_epu32(k, _mm256_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1))));
+            a[i] = _mm256_add_epi64(a[i], _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+        }
+        if (++s < STRIPES_PER_BLOCK) {
+            continue;
+        }
+        for (int i = 0; i < 2; i++) {
+            x = _mm256_xor_si256(a[i], _mm256_srli_epi64(a[i], 47));
+            x = _mm256_xor_si256(x, _mm256_loadu_si256((const __m256i *)key + i));
+            a[i] = _mm256_add_epi64(_mm256_mul_epu32(x, prime),
+                _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(x, 32), prime), 32));
+        }
+        s = 0;
+    }
+    for (int i = 0; i < 2; i++) {
+        _mm256_storeu_si256((__m256i *)acc + i, a[i]);
+    }
+    *stripes_p = s;
+}
+
+static const HashKernel avx2Kernel = {"avx2", consumeAvx2};
+
+/*
+ ******************************************************************************
+ *                               AVX-512 Kernel
+ ******************************************************************************
+*/
+
+/* AVX-512 stripe loop: All eight lanes in one register */
+__attribute__((target("avx512f")))
+static void consumeAvx512 (uint64_t acc[8], const unsigned char *data, size_t n,
+    size_t *stripes_p, const unsigned char *secret) {
+    const __m512i prime = _mm512_set1_epi32((int)PRIME32_1);
+    const __m512i scrambleKey = _mm512_loadu_si512(secret + SCRAMBLE_OFFSET);
+    size_t s = *stripes_p;
+    __m512i a = _mm512_loadu_si512(acc), d, k, x;
+
+    for (; n > 0; n--, data += STRIPE_SIZE) {
+        d = _mm512_loadu_si512(data);
+        k = _mm512_xor_si512(d, _mm512_loadu_si512(secret + 8 * s));
+        a = _mm512_add_epi64(a, _mm512_mul_epu32(k,
+            _mm512_shuffle_epi32(k, (_MM_PERM_ENUM)_MM_SHUFFLE(0, 3, 0, 1))));
+        a = _mm512_add_epi64(a, _mm512_shuffle_epi32(d, (_MM_PERM_ENUM)_MM_SHUFFLE(1, 0, 3, 2)));
+        if (++s < STRIPES_PER_BLOCK) {
+            continue;
+        }
+        x = _mm512_xor_si512(_mm512_xor_si512(a, _mm512_srli_epi64(a, 47)), scrambleKey);
+        a = _mm512_add_epi64(_mm512_mul_epu32(x, prime),
+            _mm512_slli_epi64(_mm512_mul_epu32(_mm512_srli_epi64(x, 32), prime), 32));
+        s = 0;
+    }
+    _mm512_storeu_si512(acc, a);
+    *stripes_p = s;
+}
+
+static const HashKernel avx512Kernel = {"avx512", consumeAvx512};
+
+/*
+ ******************************************************************************
+ *                              CPU Detection
+ ******************************************************************************
+*/
+
+/* Returns the kernel-relevant features of the CPU that the OS also enables */
+static int cpuFeatures (void) {
+    unsigned a, b, c, d, lo, hi;
+    uint64_t xcr0 = 0;
+    int features = 0;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d)) {
+        return 0;
+    }
+    if (d & bit_SSE2) {
+        features |= CPU_SSE2;
+    }
+
+    // Wide registers are only usable if the OS saves them on context switch.
+    if (c & bit_OSXSAVE) {
+        __asm__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+        xcr0 = ((uint64_t)hi << 32) | lo;
+    }
+    if (__get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+        if ((b & bit_AVX2) && (xcr0 & XCR0_AVX) == XCR0_AVX) {
+            features |= CPU_AVX2;
+        }
+        if ((b & bit_AVX512F) && (xcr0 & XCR0_AVX512) == XCR0_AVX512) {
+            features |= CPU_AVX512;
+        }
+    }
+    return features;
+}
+
+#endif
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* Kernels the host supports, from plain to widest, and their number.
+ * Detected once, by whichever thread asks first.
+*/
+static const HashKernel *kernels[4];
+static int kernelCount;
+static pthread_once_t kernelsOnce = PTHREAD_ONCE_INIT;
+
+/* The kernel that measured fastest. Measured once, by whichever thread asks first */
+static const HashKernel *fastestKernel;
+static pthread_once_t fastestOnce = PTHREAD_ONCE_INIT;
+
+/*
+ ******************************************************************************
+ *                               Kernel Routines
+ ******************************************************************************
+*/
+
+/* Detects the kernels the host supports. Run through kernelsOnce */
+static void detectKernels (void) {
+    kernels[kernelCount++] = &scalarKernel;
+#if defined(X86_KERNELS)
+    int features = cpuFeatures();
+    if (features & CPU_SSE2) {
+        kernels[kernelCount++] = &sse2Kernel;
+    }
+    if (features & CPU_AVX2) {
+        kernels[kernelCount++] = &avx2Kernel;
+    }
+    if (features & CPU_AVX512) {
+        kernels[kernelCount++] = &avx512Kernel;
+    }
+#endif
+}
+
+/* Returns the kernels the host supports, from plain to widest. Sets count_p */
+const HashKernel *const *supportedKernels (int *count_p) {
+    pthread_once(&kernelsOnce, detectKernels);
+    *count_p = kernelCount;
+    return kernels;
+}
+
+/* Times each supported kernel over a buffer, keeping the fastest: Wider isn't
+ * always faster (AVX-512 may lower the clock). Run through fastestOnce.
+*/
+static void measureKernels (void) {
+    static const unsigned char data[CALIBRATION_SIZE], secret[SECRET_SIZE];
+    uint64_t best[4], elapsed, acc[8] = {0};
+    volatile uint64_t sink = 0;
+    struct timespec start, end;
+    size_t stripes;
+    int count, fastest;
+    const HashKernel *const *list = supportedKernels(&count);
+
+    // Time each kernel in turn, a few rounds over.
+    for (int i = 0; i < count; i++) {
+        best[i] = UINT64_MAX;
+    }
+    for (int r = 0; r < CALIBRATION_ROUNDS; r++) {
+        for (int i = 0; i < count; i++) {
+            stripes = 0;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            list[i]->consume(acc, data, CALIBRATION_SIZE / STRIPE_SIZE, &stripes, secret);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            sink += acc[0];
+            elapsed = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+            if (elapsed < best[i]) {
+                best[i] = elapsed;
+            }
+        }
+    }
+
+    // Widest first, so that it wins ties.
+    fastest = count - 1;
+    for (int i = count - 2; i >= 0; i--) {
+        if (best[i] < best[fastest]) {
+            fastest = i;
+        }
+    }
+    fastestKernel = list[fastest];
+}
+
+/* Returns the fastest kernel the host supports, as measured on first use */
+const HashKernel *bestKernel (void) {
+    pthread_once(&fastestOnce, measureKernels);
+    return fastestKernel;
+}
@@ -0,0 +1,61 @@
+#if !defined(KERNEL_H)
+#define KERNEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "fingerprint.h"
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+#define PRIME32_1                   0x9E3779B1U
+
+// Size of the secret: room for a block of stripe keys plus a scramble key.
+#define SECRET_SIZE                 192
+
+// Offset of the scramble key within the secret.
+#define SCRAMBLE_OFFSET             (SECRET_SIZE - STRIPE_SIZE)
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Hash Kernel: One implementation (instruction set) of the stripe loop.
+ * - consume absorbs n whole stripes into the lanes. Stripe s of a block is
+ *   keyed with secret + 8 * s, and the lanes are scrambled after each block.
+ * - *stripes_p is the position within the current block, and is updated.
+ * - All kernels compute the same result.
+*/
+typedef struct hashKernel {
+    const char *name;
+    void (*consume)(uint64_t acc[8], const unsigned char *data, size_t n,
+        size_t *stripes_p, const unsigned char *secret);
+} HashKernel;
+
+/*
+ ******************************************************************************
+ *                               Kernel Routines
+ ******************************************************************************
+*/
+
+/* Accumulates one stripe into the lanes using the given stripe key (scalar) */
+void accumulateStripe (uint64_t acc[8], const unsigned char *stripe, const unsigned char *key);
+
+/* Returns the kernels the host supports, from plain to widest. Sets count_p.
+ * Thread-safe.
+*/
+const HashKernel *const *supportedKernels (int *count_p);
+
+/* Returns the fastest kernel the host supports, timed over a short run on
+ * first use. Thread-safe.
+*/
+const HashKernel *bestKernel (void);
+
+#endif
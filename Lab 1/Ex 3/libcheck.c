@@ -0,0 +1,433 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "dupfind.h"
+#include "stats.h"
+
+/*
+ ******************************************************************************
+ *                     Library Check (make check-lib)
+ ******************************************************************************
+*/
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Finders run at once by the concurrency check, and runs per finder.
+#define CONCURRENT_FINDERS          3
+#define RUNS_PER_FINDER             2
+
+// Groups after which the early stop check stops its run.
+#define STOP_AFTER                  3
+
+// Endings of the lines of a duplicates report, after the pair of paths.
+#define SAME_FILE                   " are the same file."
+#define SAME_LINK                   " are links to the same file."
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Group Set: The groups of a run, each as its sorted paths on one line.
+ * Once sorted, sets of equal groups are equal line for line.
+*/
+typedef struct {
+    char **groups;
+    int count, capacity;
+    int stopAfter;                  // Groups after which to stop (zero: never).
+} GroupSet;
+
+/* Concurrent Job: A finder's options, its root, and the sets of its runs */
+typedef struct {
+    DupOptions options;
+    const char *root;
+    GroupSet sets[RUNS_PER_FINDER];
+} Job;
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* Nonzero once a check failed */
+static int failed;
+
+/* Group of each path of the report being read (for byGroup) */
+static const int *groupOf;
+
+/*
+ ******************************************************************************
+ *                            Group Set Routines
+ ******************************************************************************
+*/
+
+/* Compares two strings through pointers to them (for qsort) */
+static int byString (const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Adds a group of n paths to a set. The paths are sorted in place */
+static void addGroup (GroupSet *set, const char **paths, int n) {
+    size_t length = 0;
+    char *line;
+
+    // Sort the group's paths, and join them.
+    for (int i = 0; i < n; i++) {
+        length += strlen(paths[i]) + 1;
+    }
+    qsort(paths, n, sizeof(*paths), byString);
+    line = malloc(length + 1);
+    assert(line != NULL);
+    line[0] = '\0';
+    for (int i = 0; i < n; i++) {
+        strcat(line, paths[i]);
+        strcat(line, (i + 1 < n) ? " " : "");
+    }
+
+    if (set->count == set->capacity) {
+        set->capacity = (set->capacity == 0) ? 64 : set->capacity * 2;
+        set->groups = realloc(set->groups, set->capacity * sizeof(*set->groups));
+        assert(set->groups != NULL);
+    }
+    set->groups[set->count++] = line;
+}
+
+/* Adds a group to the set that arg points to. Returns nonzero to stop the run */
+static int collectGroup (void *arg, const DupGroup *group) {
+    GroupSet *set = *(GroupSet **)arg;
+    const char *paths[group->count];
+    for (int i = 0; i < group->count; i++) {
+        paths[i] = group->files[i].path;
+    }
+    addGroup(set, paths, group->count);
+    return set->stopAfter > 0 && set->count == set->stopAfter;
+}
+
+/* Returns nonzero if every group of 'part' is in 'whole' (both sorted) */
+static int includedIn (const GroupSet *part, const GroupSet *whole) {
+    int j = 0;
+    for (int i = 0; i < part->count; i++) {
+        while (j < whole->count && strcmp(whole->groups[j], part->groups[i]) < 0) {
+            j++;
+        }
+        if (j == whole->count || strcmp(whole->groups[j], part->groups[i]) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Returns nonzero if two sorted sets hold the same groups */
+static int sameGroups (const GroupSet *a, const GroupSet *b) {
+    return a->count == b->count && includedIn(a, b);
+}
+
+/* Returns the representative of path i's group, compressing the way there */
+static int findRoot (int *parent, int i) {
+    while (parent[i] != i) {
+        i = parent[i] = parent[parent[i]];
+    }
+    return i;
+}
+
+/* Returns the index of a path in a sorted array of n paths */
+static int pathIndex (char **paths, int n, const char *path) {
+    char **found = bsearch(&path, paths, n, sizeof(*paths), byString);
+    assert(found != NULL);
+    return found - paths;
+}
+
+/* Compares two paths' indices by group, then by index (for qsort) */
+static int byGroup (const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (groupOf[x] != groupOf[y]) ? groupOf[x] - groupOf[y] : x - y;
+}
+
+/* Reads the groups of a duplicates report: Each line pairs two paths of a
+ * group. Pairs are joined into groups. Returns -1 on a line of another form.
+*/
+static int readReport (FILE *stream, GroupSet *set) {
+    char *line = NULL, *and, **paths = NULL;
+    size_t size = 0, length;
+    int n = 0, capacity = 0, result = 0, *parent, *order;
+    const char **members;
+
+    // Collect both paths of every pair.
+    while (getline(&line, &size, stream) != -1) {
+        length = strcspn(line, "\n");
+        line[length] = '\0';
+        if (length >= strlen(SAME_FILE) && strcmp(line + length - strlen(SAME_FILE), SAME_FILE) == 0) {
+            line[length - strlen(SAME_FILE)] = '\0';
+        } else if (length >= strlen(SAME_LINK) && strcmp(line + length - strlen(SAME_LINK), SAME_LINK) == 0) {
+            line[length - strlen(SAME_LINK)] = '\0';
+        } else {
+            result = -1;
+            break;
+        }
+        if ((and = strstr(line, " and ")) == NULL) {
+            result = -1;
+            break;
+        }
+        *and = '\0';
+        if (n + 2 > capacity) {
+            capacity = (capacity == 0) ? 256 : capacity * 2;
+            paths = realloc(paths, capacity * sizeof(*paths));
+            assert(paths != NULL);
+        }
+        paths[n++] = strdup(line);
+        paths[n++] = strdup(and + 5);
+    }
+    free(line);
+
+    // Join pairs on their paths: Path i is paired with path i ^ 1.
+    if (result == 0 && n > 0) {
+        char **sorted = malloc(n * sizeof(*sorted));
+        int unique = 0, x, y;
+        assert(sorted != NULL);
+        memcpy(sorted, paths, n * sizeof(*sorted));
+        qsort(sorted, n, sizeof(*sorted), byString);
+        for (int i = 0; i < n; i++) {
+            if (unique == 0 || strcmp(sorted[unique - 1], sorted[i]) != 0) {
+                sorted[unique++] = sorted[i];
+            }
+        }
+        parent = malloc(unique * sizeof(int));
+        order = malloc(unique * sizeof(int));
+        members = malloc(unique * sizeof(*members));
+        assert(parent != NULL && order != NULL && members != NULL);
+        for (int i = 0; i < unique; i++) {
+            parent[i] = order[i] = i;
+        }
+        for (int i = 0; i < n; i += 2) {
+            x = findRoot(parent, pathIndex(sorted, unique, paths[i]));
+            y = findRoot(parent, pathIndex(sorted, unique, paths[i + 1]));
+            parent[x] = y;
+        }
+        for (int i = 0; i < unique; i++) {
+            findRoot(parent, i);
+        }
+
+        // Gather each group's paths.
+        groupOf = parent;
+        qsort(order, unique, sizeof(int), byGroup);
+        for (int i = 0, j; i < unique; i = j) {
+            for (j = i; j < unique && parent[order[j]] == parent[order[i]]; j++) {
+                members[j - i] = sorted[order[j]];
+            }
+            addGroup(set, members, j - i);
+        }
+        free(members);
+        free(order);
+        free(parent);
+        free(sorted);
+    }
+    for (int i = 0; i < n; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    qsort(set->groups, set->count, sizeof(*set->groups), byString);
+    return result;
+}
+
+/* Runs duplicates (at finder) over root, and reads the groups it reports.
+ * Returns -1 if it can't be run or fails.
+*/
+static int runReport (const char *finder, const char *root, GroupSet *set) {
+    int pipeFds[2], status, result;
+    FILE *stream;
+    pid_t pid;
+
+    if (pipe(pipeFds) == -1 || (pid = fork()) == -1) {
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(pipeFds[1], STDOUT_FILENO);
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+        execl(finder, finder, root, (char *)NULL);
+        _exit(127);
+    }
+    close(pipeFds[1]);
+    stream = fdopen(pipeFds[0], "r");
+    assert(stream != NULL);
+    result = readReport(stream, set);
+    fclose(stream);
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+/* Free's a set's groups */
+static void freeGroupSet (GroupSet *set) {
+    for (int i = 0; i < set->count; i++) {
+        free(set->groups[i]);
+    }
+    free(set->groups);
+    set->groups = NULL;
+    set->count = set->capacity = 0;
+}
+
+/*
+ ******************************************************************************
+ *                              Check Routines
+ ******************************************************************************
+*/
+
+/* Runs a finder over root once per set (collecting each run's groups into
+ * it), then sorts the sets. Returns the result of the last run.
+*/
+static int runInto (DupOptions options, const char *root, GroupSet *sets, int runs) {
+    GroupSet *current = sets;
+    DupFinder *finder;
+    int result = -1;
+
+    // The callback collects into the set current points to.
+    options.onGroup = collectGroup;
+    options.arg = &current;
+    finder = newDupFinder(&options);
+    for (int i = 0; i < runs; i++) {
+        current = &sets[i];
+        result = runDupFinder(finder, root);
+        qsort(sets[i].groups, sets[i].count, sizeof(*sets[i].groups), byString);
+    }
+    freeDupFinder(finder);
+    return result;
+}
+
+/* Prints the outcome of a check */
+static void report (const char *check, int passed) {
+    printf("%s: %s\n", passed ? "PASS" : "FAIL", check);
+    failed |= !passed;
+}
+
+/* Enters a stage of a run (as the onStage hook) */
+static int enterRunStage (void *arg, int stage) {
+    return enterStage(stage);
+}
+
+/* Runs the runs of a concurrent job */
+static void *runJob (void *arg) {
+    Job *job = arg;
+    runInto(job->options, job->root, job->sets, RUNS_PER_FINDER);
+    return NULL;
+}
+
+/* Runs finders concurrently over root, each reused for several runs, and
+ * sharing cache (if not NULL). All enter stages, as they mustn't for stage
+ * times to mean anything, but safely. Returns nonzero if all runs find the
+ * expected groups.
+*/
+static int runConcurrently (const char *root, Cache *cache, const GroupSet *expected) {
+    Job jobs[CONCURRENT_FINDERS] = {{{0}}};
+    pthread_t workers[CONCURRENT_FINDERS];
+    int agree = 1;
+
+    for (int i = 0; i < CONCURRENT_FINDERS; i++) {
+        jobs[i].options = (DupOptions){.threads = i + 1, .verify = i % 2, .cache = cache,
+            .onStage = enterRunStage};
+        jobs[i].root = root;
+        if (pthread_create(&workers[i], NULL, runJob, &jobs[i]) != 0) {
+            fprintf(stderr, "Error: Can't start a finder thread!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < CONCURRENT_FINDERS; i++) {
+        pthread_join(workers[i], NULL);
+        for (int j = 0; j < RUNS_PER_FINDER; j++) {
+            agree &= sameGroups(expected, &jobs[i].sets[j]);
+            freeGroupSet(&jobs[i].sets[j]);
+        }
+    }
+    return agree;
+}
+
+int main (int argc, char *argv[]) {
+    GroupSet serial = {0}, other[RUNS_PER_FINDER] = {{0}};
+    char cachePath[64];
+    const char *root;
+    Cache *cache;
+    int result;
+
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s directory [duplicates]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    root = argv[1];
+    enableStats(STATS_HUMAN);
+
+    // Reference: One walker thread, fingerprints only.
+    if (runInto((DupOptions){0}, root, &serial, 1) == -1) {
+        fprintf(stderr, "Error: Can't walk %s!\n", root);
+        return EXIT_FAILURE;
+    }
+    printf("%d groups in %s.\n", serial.count, root);
+
+    // The command's own pipeline, as it reports.
+    if (argc == 3) {
+        result = runReport(argv[2], root, &other[0]);
+        report("duplicates reports the same groups", result == 0 && sameGroups(&serial, &other[0]));
+        freeGroupSet(&other[0]);
+    }
+
+    // Parallel walker.
+    runInto((DupOptions){.threads = 4}, root, other, 1);
+    report("4 walker threads find the same groups", sameGroups(&serial, &other[0]));
+    freeGroupSet(&other[0]);
+
+    // Content comparison.
+    runInto((DupOptions){.verify = 1}, root, other, 1);
+    report("verifying finds the same groups", sameGroups(&serial, &other[0]));
+    freeGroupSet(&other[0]);
+
+    // Cache: Filled by the first run, read by the second.
+    snprintf(cachePath, sizeof(cachePath), "/tmp/libcheck-%d.cache", (int)getpid());
+    unlink(cachePath);
+    if ((cache = openCache(cachePath)) == NULL) {
+        report("opening a cache", 0);
+    } else {
+        runInto((DupOptions){.cache = cache}, root, other, RUNS_PER_FINDER);
+        report("a cache finds the same groups, cold and warm",
+            sameGroups(&serial, &other[0]) && sameGroups(&serial, &other[1]));
+        closeCache(cache);
+        for (int i = 0; i < RUNS_PER_FINDER; i++) {
+            freeGroupSet(&other[i]);
+        }
+    }
+    unlink(cachePath);
+
+    // Concurrent finders, each reused for several runs.
+    report("concurrent and reused finders find the same groups", runConcurrently(root, NULL, &serial));
+
+    // Concurrent finders sharing a cache: Filling it at once, then reading it.
+    if ((cache = openCache(cachePath)) == NULL) {
+        report("opening a cache", 0);
+    } else {
+        report("concurrent finders sharing a cache find the same groups",
+            runConcurrently(root, cache, &serial));
+        closeCache(cache);
+    }
+    unlink(cachePath);
+
+    // Early stop: The run ends at the group whose callback returns nonzero.
+    other[0].stopAfter = STOP_AFTER;
+    result = runInto((DupOptions){0}, root, other, 1);
+    report("a nonzero callback stops the run",
+        serial.count < STOP_AFTER || (result == STOP_AFTER && other[0].count == STOP_AFTER &&
+            includedIn(&other[0], &serial)));
+    freeGroupSet(&other[0]);
+
+    freeGroupSet(&serial);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
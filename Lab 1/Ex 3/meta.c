@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include "meta.h"
+#include "uring.h"
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/sysmacros.h>
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Fields fetched, and how: Cached attributes are good enough.
+#define META_MASK                   (STATX_TYPE | STATX_SIZE | STATX_INO | STATX_MTIME)
+#define META_FLAGS                  AT_STATX_DONT_SYNC
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* Nonzero once statx turned out to be unsupported */
+static int noStatx;
+
+/*
+ ******************************************************************************
+ *                         Internal Metadata Routines
+ ******************************************************************************
+*/
+
+/* Fills in the fields of a stat buffer that statx fetched */
+static void fromStatx (const struct statx *x, struct stat *statBuffer) {
+    memset(statBuffer, 0, sizeof(*statBuffer));
+    statBuffer->st_mode = x->stx_mode & S_IFMT;
+    statBuffer->st_size = x->stx_size;
+    statBuffer->st_dev = makedev(x->stx_dev_major, x->stx_dev_minor);
+    statBuffer->st_ino = x->stx_ino;
+    statBuffer->st_mtim.tv_sec = x->stx_mtime.tv_sec;
+    statBuffer->st_mtim.tv_nsec = x->stx_mtime.tv_nsec;
+}
+
+/*
+ ******************************************************************************
+ *                              Metadata Routines
+ ******************************************************************************
+*/
+
+/* Fetches the metadata the finder uses of a path (relative to dirfd, following
+ * links). Returns -1 (with errno set) on error.
+*/
+int fetchMetadata (int dirfd, const char *path, struct stat *statBuffer) {
+    struct statx x;
+    uint64_t t = startTimer();
+    int r;
+
+    if (!noStatx) {
+        if ((r = statx(dirfd, path, META_FLAGS, META_MASK, &x)) == 0) {
+            fromStatx(&x, statBuffer);
+        }
+        if (r == 0 || errno != ENOSYS) {
+            stopTimer(HIST_STAT, t);
+            return r;
+        }
+        noStatx = 1;
+    }
+    r = fstatat(dirfd, path, statBuffer, 0);
+    stopTimer(HIST_STAT, t);
+    return r;
+}
+
+/* Fetches the metadata of n names relative to dirfd, concurrently through
+ * io_uring if set up. results[i] is zero, or -1 if name i can't be accessed.
+*/
+void fetchMetadataBatch (int dirfd, const char *const *names, int n, struct stat *statBuffers,
+    int *results) {
+    struct statx *xs;
+
+    if (!uringAvailable() || noStatx || n < 2) {
+        for (int i = 0; i < n; i++) {
+            results[i] = fetchMetadata(dirfd, names[i], statBuffers + i);
+        }
+        return;
+    }
+    xs = malloc(n * sizeof(struct statx));
+    assert(xs != NULL);
+    uringStatx(dirfd, names, n, META_MASK, META_FLAGS, xs, results);
+
+    // Kernels without the ring operation reject it. Fetch those directly.
+    for (int i = 0; i < n; i++) {
+        if (results[i] == -EINVAL) {
+            results[i] = fetchMetadata(dirfd, names[i], statBuffers + i);
+        } else if (results[i] < 0) {
+            results[i] = -1;
+        } else {
+            fromStatx(xs + i, statBuffers + i);
+        }
+    }
+    free(xs);
+}
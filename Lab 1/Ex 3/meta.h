@@ -0,0 +1,33 @@
+#if !defined(META_H)
+#define META_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ ******************************************************************************
+ *                              Metadata Routines
+ ******************************************************************************
+*/
+
+/* Fetches the metadata the finder uses of a path (relative to dirfd, following
+ * links): its type, size, device, inode and modification time. Other fields
+ * are zero.
+ * - Uses statx with just those fields, without forcing network file systems
+ *   to revalidate cached attributes. Falls back to stat if there's no statx.
+ * - Returns -1 (with errno set) on error.
+*/
+int fetchMetadata (int dirfd, const char *path, struct stat *statBuffer);
+
+/* Fetches the metadata of n names relative to dirfd, as fetchMetadata.
+ * results[i] is zero, or -1 if name i can't be accessed.
+ * - With io_uring set up (see uring.h), the fetches run concurrently.
+*/
+void fetchMetadataBatch (int dirfd, const char *const *names, int n, struct stat *statBuffers,
+    int *results);
+
+#endif
@@ -0,0 +1,51 @@
+#!/bin/sh
+# Checks that duplicates reports a tree as it did at an earlier commit:
+# - Builds duplicates as of the commit into a temporary directory.
+# - Runs both builds over the tree, from within it, and compares the reports
+#   line for line (order included), without options and verifying. Walker
+#   threads vary the order, and so which path of a group each line pairs;
+#   libcheck.c compares their groups instead.
+# Usage: ./output-check.sh [commit] directory [duplicates]
+
+REF=${1:-HEAD}
+TREE=$2
+BIN=$(cd "$(dirname "${3:-./duplicates}")" && pwd)/$(basename "${3:-./duplicates}")
+WORK=$(mktemp -d)
+FAILED=0
+
+cleanup () {
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+pass () { echo "PASS: $1"; }
+fail () { echo "FAIL: $1"; FAILED=1; }
+
+[ -d "$TREE" ] || { echo "Usage: $0 [commit] directory [duplicates]"; exit 1; }
+[ -x "$BIN" ] || { echo "No binary at $BIN (run make first)"; exit 1; }
+
+# Build the earlier duplicates from this directory as of the commit.
+DIR=$(cd "$(dirname "$0")" && git rev-parse --show-prefix)
+TOP=$(cd "$(dirname "$0")" && git rev-parse --show-toplevel)
+if ! git -C "$TOP" archive "$REF:$DIR" | tar -x -C "$WORK" ||
+   ! make -C "$WORK" all > "$WORK/make.out" 2>&1; then
+    cat "$WORK/make.out" 2> /dev/null
+    echo "Can't build duplicates as of $REF"
+    exit 1
+fi
+
+# Compares the reports of both builds for a set of options (the arguments).
+compareReports () {
+    (cd "$TREE" && "$WORK/duplicates" "$@" > "$WORK/before" 2> /dev/null)
+    (cd "$TREE" && "$BIN" "$@" > "$WORK/after" 2> /dev/null)
+    if cmp -s "$WORK/before" "$WORK/after"; then
+        pass "${*:-no options}: $(wc -l < "$WORK/after") lines as of $REF"
+    else
+        fail "${*:-no options}: $(diff "$WORK/before" "$WORK/after" | grep -c '^[<>]') lines differ from $REF"
+    fi
+}
+
+compareReports
+compareReports -V
+
+exit $FAILED
@@ -0,0 +1,185 @@
+#define _POSIX_C_SOURCE 200809L
+#include "shard.h"
+#include <unistd.h>
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Shard index header */
+typedef struct {
+    char magic[8];
+    uint32_t version, recordSize;
+} ShardHeader;
+
+/* Pending Record: A record being written, and the offset of its path */
+typedef struct {
+    ShardRecord record;
+    size_t path;
+} PendingRecord;
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* Path of the shard index being written */
+static char *shardPath;
+
+/* Records of the shard index being written, and their paths (back to back) */
+static PendingRecord *pending;
+static size_t pendingCount, pendingCapacity;
+static char *paths;
+static size_t pathsLength, pathsCapacity;
+
+/*
+ ******************************************************************************
+ *                          Internal Shard Routines
+ ******************************************************************************
+*/
+
+/* Orders pending records by merge key, then path */
+static int byMergeKey (const void *a, const void *b) {
+    const PendingRecord *x = a, *y = b;
+    int c = compareShardRecords(&x->record, &y->record);
+    return (c != 0) ? c : strcmp(paths + x->path, paths + y->path);
+}
+
+/* Frees the shard index being written */
+static void freeShard (void) {
+    free(shardPath);
+    free(pending);
+    free(paths);
+    shardPath = paths = NULL;
+    pending = NULL;
+    pendingCount = pendingCapacity = pathsLength = pathsCapacity = 0;
+}
+
+/*
+ ******************************************************************************
+ *                               Shard Routines
+ ******************************************************************************
+*/
+
+/* Orders shard records by size, then sample fingerprint: the merge key */
+int compareShardRecords (const ShardRecord *a, const ShardRecord *b) {
+    if (a->size != b->size) {
+        return (a->size < b->size) ? -1 : 1;
+    }
+    return compareFingerprints(a->sample, b->sample);
+}
+
+/* Starts a shard index to be written to path */
+void createShard (const char *path) {
+    assert(shardPath == NULL);
+    shardPath = malloc(strlen(path) + 1);
+    assert(shardPath != NULL);
+    strcpy(shardPath, path);
+}
+
+/* Adds a file (and its path) to the shard index being written */
+void addShardRecord (const ShardRecord *record, const char *path) {
+    size_t n = strlen(path) + 1;
+    if (pendingCount == pendingCapacity) {
+        pendingCapacity = (pendingCapacity == 0) ? 1024 : pendingCapacity * 2;
+        pending = realloc(pending, pendingCapacity * sizeof(PendingRecord));
+        assert(pending != NULL);
+    }
+    while (pathsLength + n > pathsCapacity) {
+        pathsCapacity = (pathsCapacity == 0) ? 64 * 1024 : pathsCapacity * 2;
+        paths = realloc(paths, pathsCapacity);
+        assert(paths != NULL);
+    }
+    pending[pendingCount] = (PendingRecord){.record = *record, .path = pathsLength};
+    pending[pendingCount++].record.pathLength = n - 1;
+    memcpy(paths + pathsLength, path, n);
+    pathsLength += n;
+}
+
+/* Writes the shard index out in merge order, replacing any file at its path
+ * only once complete. Returns -1 on error.
+*/
+int closeShard (void) {
+    ShardHeader header = {.magic = SHARD_MAGIC, .version = SHARD_VERSION,
+        .recordSize = sizeof(ShardRecord)};
+    char *temp = malloc(strlen(shardPath) + 5);
+    FILE *file;
+    int ok;
+    assert(temp != NULL);
+
+    // Write to a temporary file, so that a failed worker leaves no partial shard.
+    sprintf(temp, "%s.tmp", shardPath);
+    if ((file = fopen(temp, "w")) == NULL) {
+        fprintf(stderr, "Error: Couldn't create shard index %s!\n", temp);
+        free(temp);
+        freeShard();
+        return -1;
+    }
+    qsort(pending, pendingCount, sizeof(PendingRecord), byMergeKey);
+    ok = (fwrite(&header, sizeof(header), 1, file) == 1);
+    for (size_t i = 0; ok && i < pendingCount; i++) {
+        ok = (fwrite(&pending[i].record, sizeof(ShardRecord), 1, file) == 1 &&
+            fwrite(paths + pending[i].path, pending[i].record.pathLength, 1, file) == 1);
+    }
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(temp, shardPath) == -1) {
+        fprintf(stderr, "Error: Couldn't write shard index %s!\n", shardPath);
+        unlink(temp);
+        ok = 0;
+    }
+    free(temp);
+    freeShard();
+    return ok ? 0 : -1;
+}
+
+/* Opens a shard index for reading, positioned at its first record. Returns
+ * -1 on error.
+*/
+int openShard (ShardReader *reader, const char *path) {
+    ShardHeader header;
+    *reader = (ShardReader){0};
+    if ((reader->file = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "Error: Couldn't open shard index %s!\n", path);
+        return -1;
+    }
+    if (fread(&header, sizeof(header), 1, reader->file) != 1 ||
+        memcmp(header.magic, SHARD_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SHARD_VERSION || header.recordSize != sizeof(ShardRecord)) {
+        fprintf(stderr, "Error: %s is not a shard index!\n", path);
+        fclose(reader->file);
+        reader->file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads the next record (and path) of a shard. Returns zero at the end of
+ * the shard, and -1 on error.
+*/
+int nextShardRecord (ShardReader *reader) {
+    if (fread(&reader->record, sizeof(ShardRecord), 1, reader->file) != 1) {
+        return ferror(reader->file) ? -1 : 0;
+    }
+    if (reader->record.pathLength + 1 > reader->pathCapacity) {
+        reader->pathCapacity = reader->record.pathLength + 1;
+        reader->path = realloc(reader->path, reader->pathCapacity);
+        assert(reader->path != NULL);
+    }
+    if (fread(reader->path, 1, reader->record.pathLength, reader->file) != reader->record.pathLength) {
+        return -1;
+    }
+    reader->path[reader->record.pathLength] = '\0';
+    return 1;
+}
+
+/* Closes a shard reader */
+void closeShardReader (ShardReader *reader) {
+    if (reader->file != NULL) {
+        fclose(reader->file);
+    }
+    free(reader->path);
+    *reader = (ShardReader){0};
+}
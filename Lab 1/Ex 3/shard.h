@@ -0,0 +1,84 @@
+#if !defined(SHARD_H)
+#define SHARD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "fingerprint.h"
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Shard index magic and format version.
+#define SHARD_MAGIC                 "DUPSHARD"
+#define SHARD_VERSION               1
+
+// Record flags: Whether the record holds a full fingerprint.
+#define SHARD_DIGEST                0x1
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Shard Record: A file of a shard, followed (on disk) by its path.
+ * - 'class' is nonzero if the shard verified the file byte by byte: records
+ *   of one shard sharing a (nonzero) class have identical content.
+*/
+typedef struct {
+    int64_t size;
+    uint64_t dev, ino;
+    int64_t mtimeSec, mtimeNsec;
+    Fingerprint sample, digest;
+    uint32_t flags, class;
+    uint32_t pathLength, reserved;
+} ShardRecord;
+
+/* Shard Reader: An open shard index, and its current record */
+typedef struct {
+    FILE *file;
+    ShardRecord record;
+    char *path;
+    size_t pathCapacity;
+} ShardReader;
+
+/*
+ ******************************************************************************
+ *                               Shard Routines
+ ******************************************************************************
+*/
+
+/* Orders shard records by size, then sample fingerprint: the merge key */
+int compareShardRecords (const ShardRecord *a, const ShardRecord *b);
+
+/* Starts a shard index to be written to path */
+void createShard (const char *path);
+
+/* Adds a file (and its path) to the shard index being written */
+void addShardRecord (const ShardRecord *record, const char *path);
+
+/* Writes the shard index out in merge order, replacing any file at its path
+ * only once complete. Returns -1 on error.
+*/
+int closeShard (void);
+
+/* Opens a shard index for reading, positioned at its first record. Returns
+ * -1 on error.
+*/
+int openShard (ShardReader *reader, const char *path);
+
+/* Reads the next record (and path) of a shard. Returns zero at the end of
+ * the shard, and -1 on error.
+*/
+int nextShardRecord (ShardReader *reader);
+
+/* Closes a shard reader */
+void closeShardReader (ShardReader *reader);
+
+#endif
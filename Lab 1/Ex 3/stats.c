@@ -0,0 +1,218 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stats.h"
+#include <pthread.h>
+#include <time.h>
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Histogram: Power-of-two buckets, and the count, sum and maximum of values */
+typedef struct {
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count, sum, max;
+} Histogram;
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* Report format if statistics are collected, zero otherwise */
+int statsEnabled;
+
+/* Counters and histograms */
+static uint64_t counters[STAT_COUNTERS];
+static Histogram histograms[STAT_HISTOGRAMS];
+
+/* Time spent per stage, the current stage, and when it was entered */
+static uint64_t stageTimes[STAT_STAGES];
+static int currentStage;
+static uint64_t stageStart, startTime;
+
+/* Guards the stage, and the time spent per stage */
+static pthread_mutex_t stageLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Report names */
+static const char *counterNames[STAT_COUNTERS] = {
+    "directories", "files", "bytes_read", "cache_hits", "cache_misses",
+    "samples", "digests", "pairs_different", "partitioned_files", "throttled_ns",
+    "backoffs"
+};
+static const char *histogramNames[STAT_HISTOGRAMS] = {
+    "stat_ns", "read_ns", "compare_ns", "early_exit_bytes"
+};
+static const char *stageNames[STAT_STAGES] = {
+    "other", "scan", "sample", "digest", "compare"
+};
+
+/*
+ ******************************************************************************
+ *                        Internal Statistics Routines
+ ******************************************************************************
+*/
+
+/* Returns the bucket of a value: its bit length */
+static int bucketOf (uint64_t value) {
+    int b = 0;
+    while (value != 0 && b < HISTOGRAM_BUCKETS - 1) {
+        value >>= 1;
+        b++;
+    }
+    return b;
+}
+
+/* Returns an upper bound of the q-quantile (0 < q <= 1) of a histogram */
+static uint64_t quantile (const Histogram *h, double q) {
+    uint64_t seen = 0, rank = (uint64_t)(q * h->count + 0.5);
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        if ((seen += h->buckets[b]) >= rank && seen > 0) {
+            uint64_t bound = (b == 0) ? 0 : ((uint64_t)1 << b) - 1;
+            return (bound < h->max) ? bound : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* Prints a duration in nanoseconds with a readable unit */
+static void printDuration (FILE *stream, double ns) {
+    if (ns >= 1e9) {
+        fprintf(stream, "%.2f s", ns / 1e9);
+    } else if (ns >= 1e6) {
+        fprintf(stream, "%.2f ms", ns / 1e6);
+    } else if (ns >= 1e3) {
+        fprintf(stream, "%.2f us", ns / 1e3);
+    } else {
+        fprintf(stream, "%.0f ns", ns);
+    }
+}
+
+/* Prints the statistics for people */
+static void printHuman (FILE *stream, uint64_t total) {
+    fprintf(stream, "Statistics:\n");
+    for (int c = 0; c < STAT_COUNTERS; c++) {
+        fprintf(stream, "  %-20s %llu\n", counterNames[c], (unsigned long long)counters[c]);
+    }
+    for (int i = 0; i < STAT_HISTOGRAMS; i++) {
+        const Histogram *h = histograms + i;
+        fprintf(stream, "  %-20s %llu", histogramNames[i], (unsigned long long)h->count);
+        if (h->count > 0) {
+            fprintf(stream, "  mean %.0f  p50 <=%llu  p90 <=%llu  p99 <=%llu  max %llu",
+                (double)h->sum / h->count, (unsigned long long)quantile(h, 0.5),
+                (unsigned long long)quantile(h, 0.9), (unsigned long long)quantile(h, 0.99),
+                (unsigned long long)h->max);
+        }
+        fprintf(stream, "\n");
+    }
+    fprintf(stream, "  Time per stage:\n");
+    for (int s = 0; s < STAT_STAGES; s++) {
+        fprintf(stream, "    %-18s ", stageNames[s]);
+        printDuration(stream, stageTimes[s]);
+        fprintf(stream, " (%.1f%%)\n", (total > 0) ? 100.0 * stageTimes[s] / total : 0.0);
+    }
+    fprintf(stream, "    %-18s ", "total");
+    printDuration(stream, total);
+    fprintf(stream, "\n");
+}
+
+/* Prints the statistics as one JSON object */
+static void printJson (FILE *stream, uint64_t total) {
+    int last;
+    fprintf(stream, "{\"counters\": {");
+    for (int c = 0; c < STAT_COUNTERS; c++) {
+        fprintf(stream, "%s\"%s\": %llu", (c > 0) ? ", " : "", counterNames[c],
+            (unsigned long long)counters[c]);
+    }
+    fprintf(stream, "}, \"histograms\": {");
+    for (int i = 0; i < STAT_HISTOGRAMS; i++) {
+        const Histogram *h = histograms + i;
+        fprintf(stream, "%s\"%s\": {\"count\": %llu, \"sum\": %llu, \"max\": %llu, \"buckets\": [",
+            (i > 0) ? ", " : "", histogramNames[i], (unsigned long long)h->count,
+            (unsigned long long)h->sum, (unsigned long long)h->max);
+        for (last = HISTOGRAM_BUCKETS - 1; last > 0 && h->buckets[last] == 0; last--)
+            ;
+        for (int b = 0; b <= last; b++) {
+            fprintf(stream, "%s%llu", (b > 0) ? ", " : "", (unsigned long long)h->buckets[b]);
+        }
+        fprintf(stream, "]}");
+    }
+    fprintf(stream, "}, \"stages_ns\": {");
+    for (int s = 0; s < STAT_STAGES; s++) {
+        fprintf(stream, "\"%s\": %llu, ", stageNames[s], (unsigned long long)stageTimes[s]);
+    }
+    fprintf(stream, "\"total\": %llu}}\n", (unsigned long long)total);
+}
+
+/*
+ ******************************************************************************
+ *                            Statistics Routines
+ ******************************************************************************
+*/
+
+/* Starts collecting statistics, to be reported in the given format */
+void enableStats (int format) {
+    statsEnabled = format;
+    startTime = stageStart = statClock();
+}
+
+/* Returns the monotonic clock in nanoseconds */
+uint64_t statClock (void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/* Adds n to a counter. Thread-safe */
+void addStat (int counter, uint64_t n) {
+    __atomic_fetch_add(counters + counter, n, __ATOMIC_RELAXED);
+}
+
+/* Records a value in a histogram. Thread-safe */
+void recordValue (int histogram, uint64_t value) {
+    Histogram *h = histograms + histogram;
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    __atomic_fetch_add(h->buckets + bucketOf(value), 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+    while (value > max && !__atomic_compare_exchange_n(&h->max, &max, value, 1,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* Attributes time from now on to a stage. Returns the previous stage.
+ * Thread-safe; the stage is the process's.
+*/
+int enterStage (int stage) {
+    int previous;
+    uint64_t now;
+    pthread_mutex_lock(&stageLock);
+    previous = currentStage;
+    if (statsEnabled) {
+        now = statClock();
+        stageTimes[currentStage] += now - stageStart;
+        stageStart = now;
+    }
+    currentStage = stage;
+    pthread_mutex_unlock(&stageLock);
+    return previous;
+}
+
+/* Prints the statistics collected (if any) in their format */
+void printStats (FILE *stream) {
+    uint64_t total;
+    if (!statsEnabled) {
+        return;
+    }
+
+    // Charge the current stage up to now, staying in it.
+    enterStage(enterStage(STAGE_OTHER));
+    total = statClock() - startTime;
+    if (statsEnabled == STATS_JSON) {
+        printJson(stream, total);
+    } else {
+        printHuman(stream, total);
+    }
+}
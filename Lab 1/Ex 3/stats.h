@@ -0,0 +1,93 @@
+#if !defined(STATS_H)
+#define STATS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Output formats of the statistics report.
+#define STATS_HUMAN                 1
+#define STATS_JSON                  2
+
+// Histogram buckets: bucket b counts values in [2^(b-1), 2^b).
+#define HISTOGRAM_BUCKETS           64
+
+// Counters.
+#define STAT_DIRECTORIES            0   // Directories opened.
+#define STAT_FILES                  1   // Regular files tabulated.
+#define STAT_BYTES_READ             2   // File content bytes read.
+#define STAT_CACHE_HITS             3   // Fingerprint cache lookups that found the file.
+#define STAT_CACHE_MISSES           4   // Fingerprint cache lookups that didn't.
+#define STAT_SAMPLES                5   // Sample fingerprints computed.
+#define STAT_DIGESTS                6   // Full fingerprints computed.
+#define STAT_PAIRS_DIFFERENT        7   // Pairs compared that differed.
+#define STAT_PARTITIONED_FILES      8   // Files partitioned in lockstep.
+#define STAT_THROTTLED_NS           9   // Time reads waited for throttle tokens.
+#define STAT_BACKOFFS               10  // Throttle rate cuts on high read latency.
+#define STAT_COUNTERS               11
+
+// Histograms: latencies (in nanoseconds) and offsets (in bytes).
+#define HIST_STAT                   0   // stat calls.
+#define HIST_READ                   1   // Blocking content reads.
+#define HIST_COMPARE                2   // Pairwise comparisons.
+#define HIST_EARLY_EXIT             3   // Offsets at which compared pairs differed.
+#define STAT_HISTOGRAMS             4
+
+// Stages that run time is attributed to.
+#define STAGE_OTHER                 0
+#define STAGE_SCAN                  1   // Traversal and metadata.
+#define STAGE_SAMPLE                2   // Head/tail sample fingerprints.
+#define STAGE_DIGEST                3   // Full fingerprints.
+#define STAGE_COMPARE               4   // Byte-by-byte verification.
+#define STAT_STAGES                 5
+
+/* Statistics hooks. Disabled, each costs a test of statsEnabled */
+#define countStat(c, n)             do { if (statsEnabled) addStat((c), (n)); } while (0)
+#define startTimer()                (statsEnabled ? statClock() : 0)
+#define stopTimer(h, t)             do { if (statsEnabled) recordValue((h), statClock() - (t)); } while (0)
+#define recordOffset(h, v)          do { if (statsEnabled) recordValue((h), (v)); } while (0)
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* Report format if statistics are collected, zero otherwise */
+extern int statsEnabled;
+
+/*
+ ******************************************************************************
+ *                            Statistics Routines
+ ******************************************************************************
+*/
+
+/* Starts collecting statistics, to be reported in the given format */
+void enableStats (int format);
+
+/* Returns the monotonic clock in nanoseconds */
+uint64_t statClock (void);
+
+/* Adds n to a counter. Thread-safe */
+void addStat (int counter, uint64_t n);
+
+/* Records a value in a histogram. Thread-safe */
+void recordValue (int histogram, uint64_t value);
+
+/* Attributes time from now on to a stage. Returns the previous stage, to be
+ * restored by the caller. Thread-safe, but there is one stage per process:
+ * Concurrent callers (such as finders sharing an onStage hook, dupfind.h)
+ * blur the times, which go to whichever stage was entered last.
+*/
+int enterStage (int stage);
+
+/* Prints the statistics collected (if any) in their format */
+void printStats (FILE *stream);
+
+#endif
@@ -0,0 +1,169 @@
+#define _POSIX_C_SOURCE 200809L
+#include "throttle.h"
+#include "stats.h"
+#include <pthread.h>
+#include <time.h>
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Bucket capacity, as time at the full rate (ns).
+#define BURST_TIME                  (100 * 1000000ULL)
+
+// Backoff: How often the rate is adjusted (ns), and its bounds and steps.
+#define ADJUST_INTERVAL             (100 * 1000000ULL)
+#define MIN_SCALE                   (1.0 / 64)
+#define RECOVERY_STEP               (1.0 / 16)
+
+// Weight of a new latency sample in the smoothed latency (as in TCP's SRTT).
+#define LATENCY_WEIGHT              (1.0 / 8)
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Token bucket: Set rate per second (zero if unlimited), and tokens held.
+ * Tokens go negative when a read takes more than the bucket holds; the next
+ * reads wait the debt off.
+*/
+typedef struct {
+    double rate, tokens, capacity;
+} Bucket;
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* Nonzero if reads are throttled */
+int throttleEnabled;
+
+/* Byte and operation buckets, last refilled at 'refilled' */
+static Bucket bytes, ops;
+static uint64_t refilled;
+
+/* Backoff: Share of the set rates allowed, latency target, smoothed latency,
+ * and when the share was last adjusted.
+*/
+static double scale = 1.0;
+static uint64_t targetLatency;
+static double smoothedLatency;
+static uint64_t adjusted;
+
+/* Guards all of the above */
+static pthread_mutex_t throttleLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ ******************************************************************************
+ *                         Internal Throttle Routines
+ ******************************************************************************
+*/
+
+/* Sets up a bucket for a rate, full */
+static void initBucket (Bucket *b, uint64_t rate) {
+    b->rate = rate;
+    b->capacity = (double)rate * BURST_TIME / 1e9;
+    if (b->capacity < 1) {
+        b->capacity = 1;
+    }
+    b->tokens = b->capacity;
+}
+
+/* Adds the tokens earned over 'elapsed' ns at the allowed rate */
+static void refillBucket (Bucket *b, uint64_t elapsed) {
+    if (b->rate > 0) {
+        b->tokens += b->rate * scale * elapsed / 1e9;
+        if (b->tokens > b->capacity) {
+            b->tokens = b->capacity;
+        }
+    }
+}
+
+/* Takes n tokens. Returns the wait (ns) until the bucket is out of debt */
+static uint64_t takeTokens (Bucket *b, double n) {
+    if (b->rate == 0) {
+        return 0;
+    }
+    b->tokens -= n;
+    return (b->tokens >= 0) ? 0 : (uint64_t)(-b->tokens * 1e9 / (b->rate * scale));
+}
+
+/*
+ ******************************************************************************
+ *                              Throttle Routines
+ ******************************************************************************
+*/
+
+/* Limits content reads to bytesPerSecond and opsPerSecond (zero: unlimited),
+ * backing off while the smoothed read latency exceeds targetLatency.
+*/
+void setThrottle (uint64_t bytesPerSecond, uint64_t opsPerSecond, uint64_t latency) {
+    pthread_mutex_lock(&throttleLock);
+    initBucket(&bytes, bytesPerSecond);
+    initBucket(&ops, opsPerSecond);
+    targetLatency = (latency == 0) ? THROTTLE_TARGET_LATENCY : latency;
+    refilled = adjusted = statClock();
+    scale = 1.0;
+    smoothedLatency = 0;
+    throttleEnabled = 1;
+    pthread_mutex_unlock(&throttleLock);
+}
+
+/* Takes the tokens of one read of n bytes, sleeping until the buckets allow
+ * it. Returns the clock when the read may start.
+*/
+uint64_t acquireTokens (size_t n) {
+    uint64_t now, wait, opWait;
+    struct timespec ts;
+
+    // Refill, then take. Whichever bucket is deeper in debt sets the wait.
+    pthread_mutex_lock(&throttleLock);
+    now = statClock();
+    refillBucket(&bytes, now - refilled);
+    refillBucket(&ops, now - refilled);
+    refilled = now;
+    wait = takeTokens(&bytes, n);
+    if ((opWait = takeTokens(&ops, 1)) > wait) {
+        wait = opWait;
+    }
+    pthread_mutex_unlock(&throttleLock);
+
+    if (wait == 0) {
+        return now;
+    }
+    countStat(STAT_THROTTLED_NS, wait);
+    ts.tv_sec = wait / 1000000000ULL;
+    ts.tv_nsec = wait % 1000000000ULL;
+    while (nanosleep(&ts, &ts) == -1)
+        ;
+    return statClock();
+}
+
+/* Feeds the latency of a read started at 'start' to the backoff. Cuts the
+ * rates in half (multiplicative decrease) when the smoothed latency is over
+ * target, and restores them a step at a time (additive increase) otherwise.
+*/
+void observeLatency (uint64_t start) {
+    uint64_t now = statClock();
+    double latency = (double)(now - start);
+
+    pthread_mutex_lock(&throttleLock);
+    smoothedLatency = (smoothedLatency == 0) ? latency :
+        smoothedLatency + (latency - smoothedLatency) * LATENCY_WEIGHT;
+    if (now - adjusted >= ADJUST_INTERVAL) {
+        if (smoothedLatency > targetLatency && scale > MIN_SCALE) {
+            scale = (scale / 2 < MIN_SCALE) ? MIN_SCALE : scale / 2;
+            countStat(STAT_BACKOFFS, 1);
+        } else if (smoothedLatency <= targetLatency && scale < 1.0) {
+            scale = (scale + RECOVERY_STEP > 1.0) ? 1.0 : scale + RECOVERY_STEP;
+        }
+        adjusted = now;
+    }
+    pthread_mutex_unlock(&throttleLock);
+}
@@ -0,0 +1,54 @@
+#if !defined(THROTTLE_H)
+#define THROTTLE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Smoothed read latency above which reads back off, unless set (ns).
+#define THROTTLE_TARGET_LATENCY     (20 * 1000000ULL)
+
+/* Throttle hooks. Disabled, each costs a test of throttleEnabled */
+#define throttleRead(n)             (throttleEnabled ? acquireTokens(n) : 0)
+#define throttleDone(t)             do { if (throttleEnabled) observeLatency(t); } while (0)
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* Nonzero if reads are throttled */
+extern int throttleEnabled;
+
+/*
+ ******************************************************************************
+ *                             Throttle Routines
+ ******************************************************************************
+*/
+
+/* Limits content reads to bytesPerSecond and opsPerSecond (zero: unlimited).
+ * - Each limit is a token bucket holding a tenth of a second of burst.
+ * - While the smoothed read latency exceeds targetLatency (ns, zero for the
+ *   default), both rates are halved, down to 1/64. They recover by 1/16
+ *   of the set rate per tenth of a second once latency drops.
+*/
+void setThrottle (uint64_t bytesPerSecond, uint64_t opsPerSecond, uint64_t targetLatency);
+
+/* Takes the tokens of one read of n bytes, sleeping until the buckets allow
+ * it. Returns the clock (as statClock) when the read may start. Thread-safe.
+*/
+uint64_t acquireTokens (size_t n);
+
+/* Feeds the latency of a read started at 'start' to the backoff. Thread-safe */
+void observeLatency (uint64_t start);
+
+#endif
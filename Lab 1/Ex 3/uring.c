@@ -0,0 +1,435 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include "compare.h"
+#include "stats.h"
+#include "throttle.h"
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Ring: Mapped submission and completion queues */
+typedef struct {
+    int fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+} Ring;
+
+/* Read buffer: A registered buffer and the read it serves */
+typedef struct {
+    int job;                // Job the read is for, -1 if free.
+    int done;               // Nonzero once the read completed.
+    off_t position;         // Position of the read in the job's extent stream.
+    off_t offset;           // File offset of the read.
+    unsigned length;        // Bytes requested.
+    unsigned filled;        // Bytes read so far (short reads are resubmitted).
+    int result;             // Bytes read, or negative errno.
+    uint64_t issued;        // When the read was queued (if throttled).
+    unsigned char *data;
+} ReadBuffer;
+
+/* Job progress, parallel to the caller's jobs */
+typedef struct {
+    off_t total;            // Bytes in all extents (less if cut short).
+    off_t submitted;        // Stream position of the next read to submit.
+    off_t consumed;         // Stream position of the next byte to hash.
+    int inflight;           // Reads in flight.
+    int failed;             // Nonzero after a read error.
+    FingerprintState state;
+} JobState;
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* The ring (fd is -1 if not set up) */
+static Ring ring = {.fd = -1};
+
+/* Read buffers, their backing memory, and their size */
+static ReadBuffer buffers[URING_DEPTH];
+static unsigned char *bufferMemory;
+static size_t bufferSize;
+
+/* Nonzero if buffers are registered with the ring (reads use READ_FIXED) */
+static int fixedBuffers;
+
+/*
+ ******************************************************************************
+ *                           Internal Ring Routines
+ ******************************************************************************
+*/
+
+/* Maps the rings of a freshly set up io_uring. Returns -1 on error */
+static int mapRing (struct io_uring_params *p) {
+    ring.sqRingSize = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    ring.cqRingSize = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqesSize = p->sq_entries * sizeof(struct io_uring_sqe);
+
+    // With a single mapping both rings live in the larger of the two.
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cqRingSize > ring.sqRingSize) {
+            ring.sqRingSize = ring.cqRingSize;
+        }
+        ring.cqRingSize = ring.sqRingSize;
+    }
+
+    ring.sqRing = mmap(NULL, ring.sqRingSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sqRing == MAP_FAILED) {
+        return -1;
+    }
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cqRing = ring.sqRing;
+    } else {
+        ring.cqRing = mmap(NULL, ring.cqRingSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cqRing == MAP_FAILED) {
+            return -1;
+        }
+    }
+    ring.sqes = mmap(NULL, ring.sqesSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        return -1;
+    }
+
+    ring.sqHead = (unsigned *)((char *)ring.sqRing + p->sq_off.head);
+    ring.sqTail = (unsigned *)((char *)ring.sqRing + p->sq_off.tail);
+    ring.sqMask = (unsigned *)((char *)ring.sqRing + p->sq_off.ring_mask);
+    ring.sqArray = (unsigned *)((char *)ring.sqRing + p->sq_off.array);
+    ring.cqHead = (unsigned *)((char *)ring.cqRing + p->cq_off.head);
+    ring.cqTail = (unsigned *)((char *)ring.cqRing + p->cq_off.tail);
+    ring.cqMask = (unsigned *)((char *)ring.cqRing + p->cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)((char *)ring.cqRing + p->cq_off.cqes);
+    return 0;
+}
+
+/* Queues the unfilled rest of buffer b's read. Submitted by the next enter */
+static void queueRead (int fd, int b) {
+    unsigned tail = *ring.sqTail, i = tail & *ring.sqMask;
+    struct io_uring_sqe *sqe = ring.sqes + i;
+    ReadBuffer *rb = buffers + b;
+
+    rb->issued = throttleRead(rb->length - rb->filled);
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = fixedBuffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = rb->offset + rb->filled;
+    sqe->addr = (unsigned long)(rb->data + rb->filled);
+    sqe->len = rb->length - rb->filled;
+    sqe->buf_index = fixedBuffers ? b : 0;
+    sqe->user_data = b;
+
+    ring.sqArray[i] = i;
+    __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Submits n queued reads and waits for at least one completion */
+static int enterRing (unsigned n) {
+    int r;
+    do {
+        r = syscall(__NR_io_uring_enter, ring.fd, n, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (r == -1 && errno == EINTR);
+    return r;
+}
+
+/*
+ ******************************************************************************
+ *                            Internal Job Routines
+ ******************************************************************************
+*/
+
+/* Returns the file offset of a job stream position, and the bytes left in
+ * its extent (through extentLeft)
+*/
+static off_t fileOffset (const ReadJob *job, off_t position, off_t *extentLeft) {
+    int i = 0;
+    while (i < job->extentCount - 1 && position >= job->length[i]) {
+        position -= job->length[i++];
+    }
+    *extentLeft = job->length[i] - position;
+    return job->offset[i] + position;
+}
+
+/* Returns the index of a free buffer, or -1 if none */
+static int freeBuffer (void) {
+    for (int b = 0; b < URING_DEPTH; b++) {
+        if (buffers[b].job == -1) {
+            return b;
+        }
+    }
+    return -1;
+}
+
+/* Returns the number of reads submitted but not yet completed */
+static int readsInFlight (void) {
+    int n = 0;
+    for (int b = 0; b < URING_DEPTH; b++) {
+        n += (buffers[b].job != -1 && !buffers[b].done);
+    }
+    return n;
+}
+
+/* Queues reads for a job while it has unread extents and buffers are free.
+ * Returns the number of reads queued.
+*/
+static unsigned feedJob (ReadJob *jobs, JobState *states, int j) {
+    JobState *s = states + j;
+    unsigned queued = 0;
+    off_t left;
+    int b;
+
+    while (!s->failed && s->submitted < s->total && s->inflight < URING_READS_PER_JOB &&
+        (b = freeBuffer()) != -1) {
+        buffers[b].offset = fileOffset(jobs + j, s->submitted, &left);
+        buffers[b].job = j;
+        buffers[b].done = 0;
+        buffers[b].position = s->submitted;
+        buffers[b].length = (left < (off_t)bufferSize) ? left : bufferSize;
+        buffers[b].filled = 0;
+        queueRead(jobs[j].fd, b);
+        s->submitted += buffers[b].length;
+        s->inflight++;
+        queued++;
+    }
+    return queued;
+}
+
+/* Hashes a job's completed reads in stream order. Returns nonzero once the
+ * job is finished (complete or failed, with no reads in flight).
+*/
+static int consumeJob (ReadJob *jobs, JobState *states, int j) {
+    JobState *s = states + j;
+    int progress = 1;
+
+    while (progress) {
+        progress = 0;
+        for (int b = 0; b < URING_DEPTH; b++) {
+            ReadBuffer *rb = buffers + b;
+            if (rb->job != j || !rb->done || (rb->position != s->consumed && !s->failed &&
+                rb->position < s->total)) {
+                continue;
+            }
+
+            // Hash the next read in order. Errors fail the job, end of file cuts it.
+            if (!s->failed && rb->position == s->consumed) {
+                if (rb->result < 0) {
+                    s->failed = 1;
+                } else {
+                    updateFingerprint(&s->state, rb->data, rb->result);
+                    s->consumed += rb->result;
+                    if ((unsigned)rb->result < rb->length) {
+                        s->total = s->consumed;
+                    }
+                }
+            }
+            rb->job = -1;
+            progress = 1;
+        }
+    }
+
+    if (s->inflight > 0 || (!s->failed && s->consumed < s->total)) {
+        return 0;
+    }
+    jobs[j].result = s->failed ? -1 : 0;
+    if (!s->failed) {
+        jobs[j].fp = finalFingerprint(&s->state);
+    }
+    return 1;
+}
+
+/*
+ ******************************************************************************
+ *                              io_uring Routines
+ ******************************************************************************
+*/
+
+/* Sets up the ring and registers its buffers (of given block size).
+ * Returns -1 if io_uring is unavailable, in which case callers should use
+ * blocking reads instead.
+*/
+int initUring (size_t blockSize) {
+    struct io_uring_params params;
+    struct iovec iov[URING_DEPTH];
+
+    memset(&params, 0, sizeof(params));
+    if ((ring.fd = syscall(__NR_io_uring_setup, URING_DEPTH, &params)) == -1) {
+        return -1;
+    }
+    if (mapRing(&params) == -1 ||
+        posix_memalign((void **)&bufferMemory, BLOCK_ALIGNMENT, URING_DEPTH * blockSize) != 0) {
+        bufferMemory = NULL;
+        freeUring();
+        return -1;
+    }
+    bufferSize = blockSize;
+
+    for (int b = 0; b < URING_DEPTH; b++) {
+        buffers[b] = (ReadBuffer){.job = -1, .data = bufferMemory + b * blockSize};
+        iov[b] = (struct iovec){.iov_base = buffers[b].data, .iov_len = blockSize};
+    }
+
+    // Registered buffers save a page-pinning per read, but need memlock room.
+    fixedBuffers = (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS,
+        iov, URING_DEPTH) == 0);
+    return 0;
+}
+
+/* Returns nonzero if the ring is set up */
+int uringAvailable (void) {
+    return ring.fd != -1;
+}
+
+/* Runs all jobs, keeping reads across many files in flight at once */
+void uringFingerprint (ReadJob *jobs, int n) {
+    JobState *states = calloc(n, sizeof(JobState));
+    int *active = malloc(n * sizeof(int)), activeCount = 0, next = 0;
+    struct io_uring_cqe *cqe;
+    ReadBuffer *rb;
+    unsigned queued, requeued = 0, head;
+    assert(ring.fd != -1 && states != NULL && active != NULL);
+
+    for (int j = 0; j < n; j++) {
+        initFingerprint(&states[j].state);
+        for (int e = 0; e < jobs[j].extentCount; e++) {
+            states[j].total += jobs[j].length[e];
+        }
+    }
+
+    while (next < n || activeCount > 0) {
+
+        // Keep active jobs fed, then start new ones while buffers remain.
+        queued = requeued;
+        requeued = 0;
+        for (int a = 0; a < activeCount; a++) {
+            queued += feedJob(jobs, states, active[a]);
+        }
+        while (next < n && freeBuffer() != -1) {
+            queued += feedJob(jobs, states, next);
+            active[activeCount++] = next++;
+        }
+
+        // Submit, and wait for a completion if any read is in flight.
+        if (readsInFlight() > 0 && enterRing(queued) == -1) {
+            fprintf(stderr, "Error: io_uring_enter failed!\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // Reap completions. A short read is resubmitted for the rest of its
+        // buffer; only a read of nothing is the end of the file.
+        head = *ring.cqHead;
+        while (head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE)) {
+            cqe = ring.cqes + (head & *ring.cqMask);
+            rb = buffers + cqe->user_data;
+            countStat(STAT_BYTES_READ, (cqe->res > 0) ? cqe->res : 0);
+            throttleDone(rb->issued);
+            head++;
+            if (cqe->res > 0 && rb->filled + cqe->res < rb->length) {
+                rb->filled += cqe->res;
+                queueRead(jobs[rb->job].fd, cqe->user_data);
+                requeued++;
+                continue;
+            }
+            rb->done = 1;
+            rb->result = (cqe->res < 0) ? cqe->res : (int)rb->filled + cqe->res;
+            states[rb->job].inflight--;
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+
+        // Hash completed reads; retire finished jobs.
+        for (int a = 0; a < activeCount; a++) {
+            if (consumeJob(jobs, states, active[a])) {
+                active[a--] = active[--activeCount];
+            }
+        }
+    }
+
+    free(states);
+    free(active);
+}
+
+/* Runs statx (with the given mask and flags) on n names relative to dirfd,
+ * keeping up to URING_DEPTH in flight. results[i] receives zero or a negative
+ * errno.
+*/
+void uringStatx (int dirfd, const char *const *names, int n, unsigned mask, int flags,
+    struct statx *buffers, int *results) {
+    uint64_t *issued = malloc(n * sizeof(uint64_t));
+    int next = 0, inflight = 0, queued;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned tail, head, i;
+    assert(ring.fd != -1 && issued != NULL);
+
+    while (next < n || inflight > 0) {
+
+        // Queue statx calls while there is room.
+        for (queued = 0; next < n && inflight < URING_DEPTH; queued++, inflight++, next++) {
+            tail = *ring.sqTail;
+            i = tail & *ring.sqMask;
+            sqe = ring.sqes + i;
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dirfd;
+            sqe->addr = (unsigned long)names[next];
+            sqe->len = mask;
+            sqe->statx_flags = flags;
+            sqe->off = (unsigned long)(buffers + next);
+            sqe->user_data = next;
+            ring.sqArray[i] = i;
+            __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+            issued[next] = startTimer();
+        }
+
+        // Submit, wait for a completion, and reap all completions.
+        if (enterRing(queued) == -1) {
+            fprintf(stderr, "Error: io_uring_enter failed!\n");
+            exit(EXIT_FAILURE);
+        }
+        head = *ring.cqHead;
+        while (head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE)) {
+            cqe = ring.cqes + (head & *ring.cqMask);
+            results[cqe->user_data] = cqe->res;
+            stopTimer(HIST_STAT, issued[cqe->user_data]);
+            inflight--;
+            head++;
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    }
+    free(issued);
+}
+
+/* Tears down the ring and frees its buffers */
+void freeUring (void) {
+    if (ring.sqes != NULL && ring.sqes != MAP_FAILED) {
+        munmap(ring.sqes, ring.sqesSize);
+    }
+    if (ring.cqRing != NULL && ring.cqRing != MAP_FAILED && ring.cqRing != ring.sqRing) {
+        munmap(ring.cqRing, ring.cqRingSize);
+    }
+    if (ring.sqRing != NULL && ring.sqRing != MAP_FAILED) {
+        munmap(ring.sqRing, ring.sqRingSize);
+    }
+    if (ring.fd != -1) {
+        close(ring.fd);
+    }
+    free(bufferMemory);
+    bufferMemory = NULL;
+    fixedBuffers = 0;
+    ring = (Ring){.fd = -1};
+}
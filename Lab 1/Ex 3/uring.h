@@ -0,0 +1,75 @@
+#if !defined(URING_H)
+#define URING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+#include "fingerprint.h"
+
+// Filled in by statx (see sys/stat.h).
+struct statx;
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Number of registered read buffers, and so the maximum reads in flight.
+#define URING_DEPTH                 32
+
+// Maximum reads in flight for a single file.
+#define URING_READS_PER_JOB         4
+
+// Number of files callers should open per batch of jobs.
+#define URING_BATCH_SIZE            256
+
+// Maximum extents of a file that one job reads.
+#define MAX_JOB_EXTENTS             2
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Read Job: Fingerprint the given extents of an open file, in order */
+typedef struct {
+    int fd;
+    int extentCount;
+    off_t offset[MAX_JOB_EXTENTS], length[MAX_JOB_EXTENTS];
+    Fingerprint fp;         // Result fingerprint.
+    int result;             // Zero on success, -1 on a read error.
+} ReadJob;
+
+/*
+ ******************************************************************************
+ *                              io_uring Routines
+ ******************************************************************************
+*/
+
+/* Sets up the ring and registers its buffers (of given block size).
+ * Returns -1 if io_uring is unavailable, in which case callers should use
+ * blocking reads instead.
+*/
+int initUring (size_t blockSize);
+
+/* Returns nonzero if the ring is set up */
+int uringAvailable (void);
+
+/* Runs all jobs, keeping reads across many files in flight at once */
+void uringFingerprint (ReadJob *jobs, int n);
+
+/* Runs statx (with the given mask and flags) on n names relative to dirfd,
+ * keeping up to URING_DEPTH in flight. results[i] receives zero or a negative
+ * errno. No reads may be in flight.
+*/
+void uringStatx (int dirfd, const char *const *names, int n, unsigned mask, int flags,
+    struct statx *buffers, int *results);
+
+/* Tears down the ring and frees its buffers */
+void freeUring (void);
+
+#endif
@@ -0,0 +1,290 @@
+#define _POSIX_C_SOURCE 200809L
+#include "walker.h"
+#include "stats.h"
+#include "meta.h"
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Work-stealing deque of directory paths. Owner uses the tail, thieves the head */
+typedef struct {
+    pthread_mutex_t lock;
+    char **paths;
+    int head, tail, capacity;
+} Deque;
+
+/* A file found by a walker, awaiting delivery to the callback */
+typedef struct {
+    char *fileName;
+    struct stat statBuffer;
+} FoundFile;
+
+/* Walker thread state */
+typedef struct Walker {
+    int id;
+    struct Walk *walk;
+    Deque deque;
+    FoundFile batch[WALKER_BATCH_SIZE];
+    int batchSize;
+} Walker;
+
+/* State of one walk, shared by its walkers */
+typedef struct Walk {
+
+    // Walkers and their count.
+    Walker *walkers;
+    int walkerCount;
+
+    // Callback for found files, its argument, and lock serializing calls to it.
+    void (*callback)(void *, const char *, const struct stat *);
+    void *arg;
+    pthread_mutex_t callbackLock;
+
+    // Directories queued in deques, and directories queued or being scanned.
+    int queued, pending;
+
+    // Lock and condition for idle walkers waiting on work or termination.
+    pthread_mutex_t idleLock;
+    pthread_cond_t workAvailable;
+} Walk;
+
+/*
+ ******************************************************************************
+ *                               Deque Routines
+ ******************************************************************************
+*/
+
+/* Pushes a path onto the tail of a deque. Takes ownership of the path */
+static void pushTail (Deque *dq, char *path) {
+    pthread_mutex_lock(&dq->lock);
+
+    // Compact or grow the deque if the tail reached the end.
+    if (dq->tail == dq->capacity) {
+        if (dq->head > dq->capacity / 2) {
+            memmove(dq->paths, dq->paths + dq->head, (dq->tail - dq->head) * sizeof(char *));
+        } else {
+            dq->capacity = (dq->capacity == 0) ? 64 : dq->capacity * 2;
+            dq->paths = realloc(dq->paths, dq->capacity * sizeof(char *));
+            assert(dq->paths != NULL);
+            memmove(dq->paths, dq->paths + dq->head, (dq->tail - dq->head) * sizeof(char *));
+        }
+        dq->tail -= dq->head;
+        dq->head = 0;
+    }
+    dq->paths[dq->tail++] = path;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+/* Pops a path from the tail of a deque. Returns NULL if empty */
+static char *popTail (Deque *dq) {
+    char *path = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head) {
+        path = dq->paths[--dq->tail];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return path;
+}
+
+/* Steals a path from the head of a deque. Returns NULL if empty */
+static char *stealHead (Deque *dq) {
+    char *path = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head) {
+        path = dq->paths[dq->head++];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return path;
+}
+
+/*
+ ******************************************************************************
+ *                          Internal Walker Routines
+ ******************************************************************************
+*/
+
+/* Queues a directory on the walker's own deque and wakes an idle walker */
+static void queueDirectory (Walker *w, char *path) {
+    Walk *walk = w->walk;
+    pushTail(&w->deque, path);
+    pthread_mutex_lock(&walk->idleLock);
+    walk->queued++; walk->pending++;
+    pthread_cond_signal(&walk->workAvailable);
+    pthread_mutex_unlock(&walk->idleLock);
+}
+
+/* Returns the next directory for a walker: its own, else stolen, else NULL */
+static char *nextDirectory (Walker *w) {
+    Walk *walk = w->walk;
+    char *path = popTail(&w->deque);
+    for (int i = 1; path == NULL && i < walk->walkerCount; i++) {
+        path = stealHead(&walk->walkers[(w->id + i) % walk->walkerCount].deque);
+    }
+    if (path != NULL) {
+        pthread_mutex_lock(&walk->idleLock);
+        walk->queued--;
+        pthread_mutex_unlock(&walk->idleLock);
+    }
+    return path;
+}
+
+/* Delivers a walker's batch of found files to the callback */
+static void flushBatch (Walker *w) {
+    Walk *walk = w->walk;
+    pthread_mutex_lock(&walk->callbackLock);
+    for (int i = 0; i < w->batchSize; i++) {
+        walk->callback(walk->arg, w->batch[i].fileName, &w->batch[i].statBuffer);
+    }
+    pthread_mutex_unlock(&walk->callbackLock);
+    for (int i = 0; i < w->batchSize; i++) {
+        free(w->batch[i].fileName);
+    }
+    w->batchSize = 0;
+}
+
+/* Scans one directory, queueing subdirectories and batching files */
+static void walkDirectory (Walker *w, const char *directoryName) {
+    struct dirent *entry;
+    struct stat statBuffer;
+    char *pathName;
+    DIR *directory;
+
+    if ((directory = opendir(directoryName)) == NULL) {
+        fprintf(stderr, "Error: Can't access directory %s! -Ignoring-\n", directoryName);
+        return;
+    }
+    countStat(STAT_DIRECTORIES, 1);
+
+    while ((entry = readdir(directory)) != NULL) {
+
+        // Ignore unused entries, self, and parent.
+        if (entry->d_ino == 0 || strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        pathName = malloc(strlen(directoryName) + strlen(entry->d_name) + 2);
+        assert(pathName != NULL);
+        sprintf(pathName, "%s/%s", directoryName, entry->d_name);
+
+        if (fetchMetadata(AT_FDCWD, pathName, &statBuffer) == -1) {
+            fprintf(stderr, "Error: Can't access file %s! -Ignoring-\n", pathName);
+            free(pathName);
+            continue;
+        }
+
+        // Directories become work. Files are batched for the callback.
+        if (S_ISDIR(statBuffer.st_mode)) {
+            queueDirectory(w, pathName);
+            continue;
+        }
+        w->batch[w->batchSize] = (FoundFile){.fileName = pathName, .statBuffer = statBuffer};
+        if (++w->batchSize == WALKER_BATCH_SIZE) {
+            flushBatch(w);
+        }
+    }
+
+    closedir(directory);
+}
+
+/* Walker thread body. Runs until no directories are queued or being scanned */
+static void *walkerThread (void *arg) {
+    Walker *w = arg;
+    Walk *walk = w->walk;
+    char *path;
+
+    while (1) {
+        if ((path = nextDirectory(w)) != NULL) {
+            walkDirectory(w, path);
+            free(path);
+
+            // Finishing the last pending directory ends the walk.
+            pthread_mutex_lock(&walk->idleLock);
+            if (--walk->pending == 0) {
+                pthread_cond_broadcast(&walk->workAvailable);
+            }
+            pthread_mutex_unlock(&walk->idleLock);
+            continue;
+        }
+
+        // Nothing to take: sleep until work is queued or the walk ends.
+        pthread_mutex_lock(&walk->idleLock);
+        while (walk->queued == 0 && walk->pending > 0) {
+            pthread_cond_wait(&walk->workAvailable, &walk->idleLock);
+        }
+        if (walk->pending == 0) {
+            pthread_mutex_unlock(&walk->idleLock);
+            break;
+        }
+        pthread_mutex_unlock(&walk->idleLock);
+    }
+
+    flushBatch(w);
+    return NULL;
+}
+
+/*
+ ******************************************************************************
+ *                               Walker Routines
+ ******************************************************************************
+*/
+
+/* Walks the tree below root with the given number of threads.
+ * - Directories are distributed over per-thread work-stealing deques.
+ * - 'f' is applied (with arg) to every non-directory file. Calls to 'f' are
+ *   serialized and delivered in batches, so 'f' needn't be thread-safe.
+*/
+void parallelScan (const char *root, int threads,
+    void (*f)(void *arg, const char *fileName, const struct stat *statBuffer), void *arg) {
+    Walk walk = {.callback = f, .arg = arg};
+    Walker *walkers;
+    pthread_t *tids;
+    char *rootPath;
+    assert(root != NULL && f != NULL);
+
+    threads = (threads < 1) ? 1 : (threads > MAX_WALKERS) ? MAX_WALKERS : threads;
+    walkers = calloc(threads, sizeof(Walker));
+    tids = calloc(threads, sizeof(pthread_t));
+    rootPath = malloc(strlen(root) + 1);
+    assert(walkers != NULL && tids != NULL && rootPath != NULL);
+    walk.walkers = walkers;
+    walk.walkerCount = threads;
+    pthread_mutex_init(&walk.callbackLock, NULL);
+    pthread_mutex_init(&walk.idleLock, NULL);
+    pthread_cond_init(&walk.workAvailable, NULL);
+
+    for (int i = 0; i < threads; i++) {
+        walkers[i].id = i;
+        walkers[i].walk = &walk;
+        pthread_mutex_init(&walkers[i].deque.lock, NULL);
+    }
+
+    // Seed the first walker with the root.
+    queueDirectory(walkers, strcpy(rootPath, root));
+
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(tids + i, NULL, walkerThread, walkers + i) != 0) {
+            fprintf(stderr, "Error: Couldn't create walker thread!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&walkers[i].deque.lock);
+        free(walkers[i].deque.paths);
+    }
+    pthread_mutex_destroy(&walk.callbackLock);
+    pthread_mutex_destroy(&walk.idleLock);
+    pthread_cond_destroy(&walk.workAvailable);
+    free(walkers);
+    free(tids);
+}
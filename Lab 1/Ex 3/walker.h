@@ -0,0 +1,38 @@
+#if !defined(WALKER_H)
+#define WALKER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Maximum number of walker threads.
+#define MAX_WALKERS                 256
+
+// Number of files a walker collects before handing them to the callback.
+#define WALKER_BATCH_SIZE           256
+
+/*
+ ******************************************************************************
+ *                               Walker Routines
+ ******************************************************************************
+*/
+
+/* Walks the tree below root with the given number of threads.
+ * - Directories are distributed over per-thread work-stealing deques.
+ * - 'f' is applied (with arg) to every non-directory file. Calls to 'f' are
+ *   serialized and delivered in batches, so 'f' needn't be thread-safe.
+ * - All state is the call's own, so walks may run concurrently.
+*/
+void parallelScan (const char *root, int threads,
+    void (*f)(void *arg, const char *fileName, const struct stat *statBuffer), void *arg);
+
+#endif
@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+#include "watch.h"
+#include "dirtree.h"
+#include <unistd.h>
+#include <errno.h>
+#include <sys/inotify.h>
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Events watched for in each directory.
+#define WATCH_EVENTS                (IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | \
+                                     IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+// Marks an unused watch descriptor.
+#define NO_WATCH                    (-1)
+
+/*
+ ******************************************************************************
+ *                             Global Variables
+ ******************************************************************************
+*/
+
+/* The inotify descriptor (-1 if not set up) */
+static int watchFd = -1;
+
+/* Directory node of each watch descriptor (NO_WATCH if unused), and count */
+static int *watchDirs;
+static int watchCapacity;
+
+/* Event buffer */
+static char *eventBuffer;
+
+/*
+ ******************************************************************************
+ *                          Internal Watch Routines
+ ******************************************************************************
+*/
+
+/* Drops the watches of a directory node and all nodes below it */
+static void unwatchTree (int dir) {
+    for (int wd = 0; wd < watchCapacity; wd++) {
+        if (watchDirs[wd] != NO_WATCH && isBelow(watchDirs[wd], dir)) {
+            inotify_rm_watch(watchFd, wd);
+            watchDirs[wd] = NO_WATCH;
+        }
+    }
+}
+
+/* Returns the watched node of 'name' within directory node 'parent', or -1 */
+static int watchedChild (int parent, const char *name) {
+    for (int wd = 0; wd < watchCapacity; wd++) {
+        const DirNode *node;
+        if (watchDirs[wd] == NO_WATCH) {
+            continue;
+        }
+        node = getDirNode(watchDirs[wd]);
+        if (node->parent == parent && strcmp(node->name, name) == 0) {
+            return watchDirs[wd];
+        }
+    }
+    return -1;
+}
+
+/* Applies the handler matching a single event in watched directory 'dir' */
+static void dispatchEvent (const WatchHandlers *h, int dir, const struct inotify_event *event) {
+    int child;
+
+    // Files.
+    if (!(event->mask & IN_ISDIR)) {
+        if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            h->fileRemoved(dir, event->name);
+        } else {
+            h->fileChanged(dir, event->name);
+        }
+        return;
+    }
+
+    // Directories.
+    if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        if (watchedChild(dir, event->name) == -1) {
+            h->directoryAdded(dir, event->name);
+        }
+    } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        if ((child = watchedChild(dir, event->name)) != -1) {
+            unwatchTree(child);
+            h->directoryRemoved(child);
+        }
+    }
+}
+
+/*
+ ******************************************************************************
+ *                               Watch Routines
+ ******************************************************************************
+*/
+
+/* Sets up change notification. Returns the descriptor to poll, or -1 */
+int initWatch (void) {
+    if ((watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+        fprintf(stderr, "Error: Can't set up change notification!\n");
+        return -1;
+    }
+    if ((eventBuffer = malloc(WATCH_BUFFER_SIZE)) == NULL) {
+        fprintf(stderr, "Error: Couldn't allocate event buffer!\n");
+        exit(EXIT_FAILURE);
+    }
+    return watchFd;
+}
+
+/* Watches a directory node for changes to its entries */
+void watchDirectory (int dir) {
+    const DirNode *node = getDirNode(dir);
+    char *path = NULL;
+    int size = 0, wd, capacity;
+
+    if ((wd = inotify_add_watch(watchFd, buildPath(node->parent, node->name, &path, &size),
+        WATCH_EVENTS)) == -1) {
+        fprintf(stderr, "Error: Can't watch directory %s! -Ignoring-\n", path);
+        free(path);
+        return;
+    }
+    free(path);
+
+    // Watch descriptors are small integers, so index by them directly.
+    if (wd >= watchCapacity) {
+        capacity = (watchCapacity == 0) ? 64 : watchCapacity;
+        while (capacity <= wd) {
+            capacity *= 2;
+        }
+        watchDirs = realloc(watchDirs, capacity * sizeof(int));
+        assert(watchDirs != NULL);
+        for (int i = watchCapacity; i < capacity; i++) {
+            watchDirs[i] = NO_WATCH;
+        }
+        watchCapacity = capacity;
+    }
+    watchDirs[wd] = dir;
+}
+
+/* Reads all pending change events, and applies the matching handlers.
+ * - Directories removed have their watches (and those below) dropped first.
+ * - Directories added that are already watched are not reported again.
+*/
+void processWatchEvents (const WatchHandlers *h) {
+    const struct inotify_event *event;
+    int overflowed = 0;
+    ssize_t n;
+
+    while ((n = read(watchFd, eventBuffer, WATCH_BUFFER_SIZE)) > 0 || (n == -1 && errno == EINTR)) {
+        for (ssize_t off = 0; !overflowed && off < n; off += sizeof(*event) + event->len) {
+            event = (const struct inotify_event *)(eventBuffer + off);
+
+            // After lost events nothing else can be trusted. Drain the rest.
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflowed = 1;
+                break;
+            }
+
+            // Ignore stale watches, and events on watched directories themselves
+            // (those are seen through their parents).
+            if (event->wd < 0 || event->wd >= watchCapacity || watchDirs[event->wd] == NO_WATCH) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                watchDirs[event->wd] = NO_WATCH;
+                continue;
+            }
+            if (event->len == 0) {
+                continue;
+            }
+            dispatchEvent(h, watchDirs[event->wd], event);
+        }
+    }
+    if (n == -1 && errno != EAGAIN) {
+        fprintf(stderr, "Error: Can't read change events!\n");
+    }
+
+    if (overflowed) {
+        for (int wd = 0; wd < watchCapacity; wd++) {
+            if (watchDirs[wd] != NO_WATCH) {
+                inotify_rm_watch(watchFd, wd);
+                watchDirs[wd] = NO_WATCH;
+            }
+        }
+        h->overflow();
+    }
+}
+
+/* Drops all watches and closes change notification */
+void freeWatch (void) {
+    if (watchFd != -1) {
+        close(watchFd);
+    }
+    free(watchDirs);
+    free(eventBuffer);
+    watchFd = -1;
+    watchDirs = NULL;
+    eventBuffer = NULL;
+    watchCapacity = 0;
+}
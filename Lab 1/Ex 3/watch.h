@@ -0,0 +1,56 @@
+#if !defined(WATCH_H)
+#define WATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ ******************************************************************************
+ *                             Symbolic Constants
+ ******************************************************************************
+*/
+
+// Size of the buffer change events are read into.
+#define WATCH_BUFFER_SIZE           (64 * 1024)
+
+/*
+ ******************************************************************************
+ *                                 Data Types
+ ******************************************************************************
+*/
+
+/* Watch Handlers: Callbacks for changes within watched directories. Files and
+ * directories are given by directory node and name.
+*/
+typedef struct {
+    void (*fileChanged)(int dir, const char *name);     // Created, written, moved in, or attributes set.
+    void (*fileRemoved)(int dir, const char *name);     // Deleted or moved out.
+    void (*directoryAdded)(int dir, const char *name);  // Created or moved in, not yet watched.
+    void (*directoryRemoved)(int dir);                  // Deleted or moved out, no longer watched.
+    void (*overflow)(void);                             // Events were lost, and all watches dropped.
+} WatchHandlers;
+
+/*
+ ******************************************************************************
+ *                               Watch Routines
+ ******************************************************************************
+*/
+
+/* Sets up change notification. Returns the descriptor to poll, or -1 */
+int initWatch (void);
+
+/* Watches a directory node for changes to its entries */
+void watchDirectory (int dir);
+
+/* Reads all pending change events, and applies the matching handlers.
+ * - Directories removed have their watches (and those below) dropped first.
+ * - Directories added that are already watched are not reported again.
+*/
+void processWatchEvents (const WatchHandlers *h);
+
+/* Drops all watches and closes change notification */
+void freeWatch (void);
+
+#endif